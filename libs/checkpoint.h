@@ -0,0 +1,51 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A checkpoint holds the text of every document at some committed version,
+ * so a restart only replays the write-ahead log from the offset it names.
+ * It is written to a temporary file, synced and renamed into place, so the
+ * file at path is always a whole checkpoint. Loading maps the file instead
+ * of reading it: the loaded text is borrowed straight from the mapping.
+ *
+ * File layout, integers are little-endian u64 unless noted:
+ *
+ *   "MDCKPT1\n" wal_offset doc_count
+ *   doc_count * (u8 name_len, name, version, text_len, text)
+ *   "MDCKEND\n"
+ *
+ * Log records before wal_offset are all covered by the checkpoint. Records
+ * after it may be too, if they were logged while the checkpoint was being
+ * taken, so replay skips those at or below a document's version.
+ */
+
+#define CHECKPOINT_MAGIC "MDCKPT1\n"
+#define CHECKPOINT_END "MDCKEND\n"
+#define CHECKPOINT_MAGIC_LEN 8
+
+typedef struct checkpoint_doc {
+    const char *name;       // not NUL-terminated when loaded
+    size_t name_len;
+    uint64_t version;
+    const char *text;
+    size_t len;
+} checkpoint_doc;
+
+// Returns 0 to go on, -1 to stop loading
+typedef int (*checkpoint_fn)(const checkpoint_doc *doc, void *ctx);
+
+// Replaces the checkpoint at path. Returns once it is on disk
+int checkpoint_write(const char *path, uint64_t wal_offset, const checkpoint_doc *docs,
+                     size_t count);
+
+/**
+ * Maps the checkpoint at path and passes every document to fn. The mapping
+ * is never removed, so the text stays valid for the life of the process.
+ * Returns 1 once all documents were passed, 0 if there is no checkpoint and
+ * -1 if it is malformed or fn failed.
+ */
+int checkpoint_load(const char *path, uint64_t *wal_offset_out, checkpoint_fn fn, void *ctx);
+
+#endif
@@ -9,8 +9,6 @@
  * Ensure you DO NOT change the name of document struct.
  */
 
-//Chunk store text and has ptr to taverse to next 
-
 typedef enum { EDIT_INSERT, EDIT_DELETE } edit_type;
 
 typedef struct edit {
@@ -22,16 +20,97 @@ typedef struct edit {
 } edit;
 
 
-typedef struct chunk {
-    char *text;
-    struct chunk *next;
-} chunk;
+/**
+ * One effect of a commit, in positions of the version before the commit.
+ * A commit reports its changes sorted by position and non-overlapping.
+ * Inserted text points into the add buffer and stays valid until the
+ * document is freed.
+ */
+typedef struct change {
+    edit_type type;
+    size_t pos;
+    size_t len;             // bytes inserted or deleted
+    const char *text;       // inserted bytes, NULL for deletes
+} change;
+
+struct document;
+
+// Called by every commit after the version number has moved on. changes is
+// NULL when they aren't known: after markdown_revert or if memory ran out.
+// Non-zero refuses the commit, see markdown_set_commit_hook
+typedef int (*commit_hook_fn)(const struct document *doc, const change *changes,
+                              size_t count, void *ctx);
+
+
+/**
+ * A piece is one node of a committed version's piece tree: a span of text
+ * that lives either in the document's original buffer or in its add buffer.
+ * The tree is a treap: an in-order walk gives the text, "total" says how
+ * much of it lies in a subtree, and random priorities keep it balanced, so
+ * finding a position costs O(log pieces).
+ *
+ * Committed trees are persistent. A commit never changes a node an older
+ * version can still reach, it copies the path down to each edit instead,
+ * so consecutive versions share every node their edits didn't touch.
+ * "refs" counts the parents and version roots pointing at a node.
+ * The text is NOT NUL-terminated, use len.
+ */
+typedef struct piece {
+    const char *text;
+    size_t len;
+    size_t total;           // len of this piece and every piece below it
+    uint32_t priority;      // no lower than either child's
+    uint32_t refs;
+    struct piece *left;
+    struct piece *right;
+} piece;
+
+
+// The root of one retained version, see markdown_set_history
+typedef struct kept_version {
+    uint64_t version;       // UINT64_MAX for an empty slot
+    piece *root;
+} kept_version;
+
+
+/**
+ * One block of the append-only add buffer. Inserted text is copied in once
+ * and never moves afterwards, so pieces can point straight into it.
+ */
+typedef struct add_block {
+    struct add_block *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} add_block;
+
+
+/**
+ * Per-document staging state. Edits are queued here between commits, and the
+ * formatting commands cache a flat copy of the committed text for the
+ * version they were issued against. Owned and freed by its document.
+ */
+typedef struct edit_context {
+    edit *queue;                // staged edits, newest first
+    char *shared_flat;
+    char *base_flat;
+    uint64_t flat_version;      // version the flat copies belong to
+} edit_context;
 
 
 typedef struct document {
-    chunk *staged_head;
-    chunk *head;
+    piece *root;                // piece tree of the committed version
+    kept_version *kept;         // retained versions by version % kept_cap
+    size_t kept_cap;
+    uint32_t seed;              // for piece priorities
+    const char *original;       // read-only text the document was loaded from
+    size_t original_len;
+    add_block *add_buffer;      // newest block first
+    size_t length;              // total bytes in the committed version
     uint64_t version;
+    edit_context staging;
+    commit_hook_fn on_commit;   // optional, see markdown_set_commit_hook
+    void *on_commit_ctx;
 } document;
 
 
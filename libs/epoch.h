@@ -0,0 +1,25 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/**
+ * Epoch-based reclamation for objects published through atomic pointers.
+ *
+ * Readers bracket every access with epoch_enter()/epoch_exit() and never
+ * block. Writers swap the pointer first and then hand the old object to
+ * epoch_retire(), which frees it once no reader that could still see it
+ * is inside a critical section. Critical sections must not nest and
+ * should be short: load the pointer, take what you need, leave.
+ */
+
+typedef void (*epoch_free_fn)(void *ptr);
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+// Defers free_fn(ptr) until every reader that might hold ptr has left
+void epoch_retire(void *ptr, epoch_free_fn free_fn);
+
+// Blocks until every reader that was inside a critical section has left
+void epoch_synchronize(void);
+
+#endif
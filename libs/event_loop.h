@@ -0,0 +1,48 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A fixed pool of threads, each waiting on its own epoll instance. Callers
+ * pin every connection to one loop, so the handlers of one connection never
+ * run concurrently and need no lock of their own.
+ */
+
+typedef struct event_loop event_loop;
+
+// Runs on the loop thread with the epoll events that fired
+typedef void (*event_handler_fn)(void *ctx, uint32_t events);
+
+// One registered descriptor. Owned by the caller, must outlive its registration
+typedef struct event_watch {
+    int fd;
+    event_handler_fn handler;
+    void *ctx;
+} event_watch;
+
+/**
+ * Work run on the loop thread after the current batch of events. Freeing a
+ * connection from here is safe even if the batch still held events for it.
+ */
+typedef struct event_deferred {
+    void (*fn)(void *ctx);
+    void *ctx;
+    struct event_deferred *next;
+} event_deferred;
+
+// Starts count loop threads, returns 0 or -1
+int event_loop_pool_start(size_t count);
+// Returns the loops in turn, NULL before the pool was started
+event_loop *event_loop_pick(void);
+
+int event_loop_add(event_loop *loop, event_watch *watch, uint32_t events);
+int event_loop_modify(event_loop *loop, event_watch *watch, uint32_t events);
+void event_loop_remove(event_loop *loop, event_watch *watch);
+
+// Only from a handler running on loop
+void event_loop_defer(event_loop *loop, event_deferred *work);
+// From any thread: runs work on loop's thread as soon as it wakes up
+void event_loop_post(event_loop *loop, event_deferred *work);
+
+#endif
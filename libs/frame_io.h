@@ -0,0 +1,56 @@
+#ifndef FRAME_IO_H
+#define FRAME_IO_H
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Framed I/O shared by the client and the server. The protocol is header
+ * lines followed by fixed-length payloads. A frame_reader pulls large
+ * chunks from its descriptor and hands out whole lines and payload bytes
+ * from memory, so reading one request costs about one read() instead of
+ * one per header byte.
+ */
+
+#define FRAME_READER_BUF 4096
+
+struct shm_ring;
+
+typedef struct frame_reader {
+    int fd;
+    struct shm_ring *ring;  // reads come from this ring instead of fd when set
+    size_t start;           // first unread byte
+    size_t end;             // one past the last buffered byte
+    char buf[FRAME_READER_BUF];
+} frame_reader;
+
+void frame_reader_init(frame_reader *reader, int fd);
+
+// Bytes already buffered and not handed out yet
+size_t frame_buffered(const frame_reader *reader);
+
+// One read() (or ring read) into free buffer space: bytes read, 0 at EOF, -1 with errno set
+ssize_t frame_fill(frame_reader *reader);
+
+/**
+ * Copies the next buffered line, '\n' included, into line and returns its
+ * length, or 0 if no whole line is buffered yet. Lines longer than
+ * capacity - 1 are cut at that length. Never does I/O.
+ */
+size_t frame_next_line(frame_reader *reader, char *line, size_t capacity);
+
+// Copies up to count buffered bytes into buf and returns how many. Never does I/O.
+size_t frame_take(frame_reader *reader, void *buf, size_t count);
+
+// Blocking: like frame_next_line, reading as needed. 0 at EOF, -1 on error
+ssize_t frame_read_line(frame_reader *reader, char *line, size_t capacity);
+
+// Blocking: exactly count bytes, the rest read straight into buf. 0 at EOF, -1 on error
+ssize_t frame_read_exact(frame_reader *reader, void *buf, size_t count);
+
+// Unbuffered helpers for descriptors without a reader
+ssize_t write_full(int fd, const void *buf, size_t count);
+ssize_t read_full(int fd, void *buf, size_t count);
+// fsyncs the directory holding path
+int sync_parent_dir(const char *path);
+
+#endif
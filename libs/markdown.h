@@ -8,10 +8,20 @@
  * more helper functions to help assist you when creating the document. For the automated marking you can expect unit tests
  * for the following tests, verifying if the document functionalities are correctly implemented. All the commands are explained 
  * in detail in the assignment spec.
+ *
+ * Thread safety: every document owns all of its engine state, nothing is
+ * shared between documents, so different documents can be used from
+ * different threads at the same time. A single document is not locked
+ * internally. Staging commands and markdown_increment_version must be
+ * serialised by the caller. The read-only utilities (flatten, length,
+ * copy, span walk, print) may run together but not during a commit.
  */
 
 // Initialize and free a document
 document * markdown_init(void);
+// A document at "version" holding text, which is borrowed: it isn't copied
+// and must stay valid and unchanged until the document is freed
+document *markdown_load(const char *text, size_t len, uint64_t version);
 void markdown_free(document *doc);
 
 // === Edit Commands ===
@@ -33,7 +43,28 @@ int markdown_link(document *doc, uint64_t version, size_t start, size_t end, con
 // === Utilities ===
 void markdown_print(const document *doc, FILE *stream);
 char *markdown_flatten(const document *doc);
+size_t markdown_length(const document *doc);
+size_t markdown_copy(const document *doc, size_t pos, char *buf, size_t capacity);
+
+// Called once per piece of committed text, in order. A non-zero return stops the walk.
+typedef int (*markdown_span_fn)(const char *text, size_t len, void *ctx);
+int markdown_for_each_span(const document *doc, markdown_span_fn fn, void *ctx);
 
 // === Versioning ===
 void markdown_increment_version(document *doc);
+// Number of edits staged since the last commit
+size_t markdown_staged_count(const document *doc);
+// Drops the edits staged after the oldest "keep" ones, the version stays as it is
+void markdown_discard_staged(document *doc, size_t keep);
+void markdown_set_commit_hook(document *doc, commit_hook_fn hook, void *ctx);
+
+// === History ===
+// Keeps the latest "versions" committed versions readable, the current one included
+int markdown_set_history(document *doc, size_t versions);
+// Like markdown_for_each_span and markdown_length for a kept version, -1 if it isn't kept
+int markdown_for_each_span_at(const document *doc, uint64_t version,
+                              markdown_span_fn fn, void *ctx);
+int markdown_length_at(const document *doc, uint64_t version, size_t *len_out);
+// Commits the text of a kept version as the next version. Nothing may be staged
+int markdown_revert(document *doc, uint64_t version);
 #endif // MARKDOWN_H
\ No newline at end of file
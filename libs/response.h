@@ -0,0 +1,65 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Server responses are built while a document mutex is held and written to
+ * the client only after it is released. A response is a short header line
+ * plus an optional body. The body is immutable and reference counted, so the
+ * same bytes can be queued for many sessions without copying.
+ */
+
+struct shm_ring;
+
+#define RESPONSE_HEAD_MAX 128
+#define OUTBOUND_QUEUE_MAX 16
+
+typedef struct shared_buf {
+    atomic_size_t refs;
+    size_t len;
+    char *data;             // "bytes", or borrowed ones (shared_buf_wrap)
+    char bytes[];
+} shared_buf;
+
+typedef struct response {
+    char head[RESPONSE_HEAD_MAX];
+    size_t head_len;
+    shared_buf *body;       // NULL when the header is the whole response
+} response;
+
+/**
+ * Bounded FIFO of responses waiting to be written to one client. It is only
+ * used by the session that owns it, so it has no lock of its own.
+ */
+typedef struct outbound_queue {
+    response items[OUTBOUND_QUEUE_MAX];
+    size_t first;
+    size_t count;
+    size_t sent;            // bytes of items[first] already written
+} outbound_queue;
+
+// Returns a buffer with one reference and room for len bytes, or NULL
+shared_buf *shared_buf_new(size_t len);
+// A buffer around bytes it doesn't own, which must outlive every reference
+shared_buf *shared_buf_wrap(const char *data, size_t len);
+shared_buf *shared_buf_ref(shared_buf *buf);
+void shared_buf_release(shared_buf *buf);
+
+// Formats the header and takes over the caller's reference to body (may be NULL)
+int response_format(response *resp, shared_buf *body, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+// Same, with a header that is already encoded (binary protocol)
+int response_set_head(response *resp, shared_buf *body, const void *head, size_t len);
+
+void outq_init(outbound_queue *queue);
+// Appends resp, or releases its body and returns -1 when the queue is full
+int outq_push(outbound_queue *queue, response *resp);
+// Writes queued bytes: 0 once empty, 1 if the fd would block, -1 on error
+int outq_flush(outbound_queue *queue, int fd);
+// Same, into a shared-memory ring (1 when it is full and nonblocking)
+int outq_flush_ring(outbound_queue *queue, struct shm_ring *ring);
+void outq_clear(outbound_queue *queue);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef ROLES_H
+#define ROLES_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The user table from roles.txt ("<username> <read|write>" per line), kept
+ * in memory as an open-addressing hash table. Handshakes look a user up
+ * without any I/O or lock. A watcher thread rebuilds the table whenever
+ * the file is written, replaced or removed and publishes it with one
+ * atomic pointer swap; the old table is freed through epoch reclamation.
+ * As before, the first valid line for a user wins and a missing file
+ * means nobody is authorised.
+ */
+
+#define ROLES_NAME_MAX 64
+
+typedef enum {
+    ROLE_NONE = 0,
+    ROLE_READ,
+    ROLE_WRITE
+} client_role_t;
+
+// Loads path and starts watching it. Returns -1 if the watcher can't be started
+int roles_start(const char *path);
+
+// 1 and the user's role in role_out when username is listed, otherwise 0
+int roles_lookup(const char *username, client_role_t *role_out);
+
+// Users in the current table and how many times it was loaded
+void roles_stats(size_t *users_out, uint64_t *loads_out);
+
+#endif
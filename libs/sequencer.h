@@ -0,0 +1,28 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+#include <stdatomic.h>
+
+/**
+ * A single consumer thread fed by a lock-free multi-producer queue. Any
+ * thread may submit tasks and the sequencer runs them one at a time in
+ * the order they were queued, so state that only tasks touch needs no
+ * lock. Submitting costs one atomic exchange, the sequencer thread only
+ * sleeps while the queue is empty.
+ */
+
+typedef struct sequencer_task {
+    void (*fn)(void *ctx);
+    void *ctx;
+    _Atomic(struct sequencer_task *) next;
+} sequencer_task;
+
+// Pins the thread to cpu when cpu >= 0. Returns -1 if it can't be started
+int sequencer_start(int cpu);
+
+// The highest cpu sequencer_start can pin to
+int sequencer_max_cpu(void);
+
+// A task must not be submitted again before its fn has started running
+void sequencer_submit(sequencer_task *task);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Shared-memory transport. A client connected over the socket can ask for
+ * "shm=1" in its handshake; the server then hands it one memfd mapping that
+ * holds two single-producer single-consumer byte rings, one per direction.
+ * Bytes move with plain loads and stores. A side only makes a system call
+ * to go to sleep on an empty (or full) ring, and its peer wakes it through
+ * an eventfd, so a busy session costs no system calls per message. The
+ * socket stays open next to the rings so either side notices when the
+ * other one is gone.
+ *
+ * Right after a "shm=1" handshake the server sends one marker byte before
+ * anything else: 'S' with the channel's descriptors attached, after which
+ * both directions use the rings, or 'N' without any, and the session
+ * carries on over the socket. The client sends nothing until it has read
+ * the marker.
+ */
+
+#define SHM_RING_SIZE (1u << 20)     // bytes per direction, a power of two
+#define SHM_CHANNEL_FDS 5            // the memfd and four eventfds
+
+typedef struct shm_ring_shared shm_ring_shared;
+
+// One direction of a channel, as seen by this end of it
+typedef struct shm_ring {
+    shm_ring_shared *shared;
+    int wait_fd;            // eventfd this end sleeps on
+    int wake_fd;            // eventfd the other end sleeps on
+    int hangup_fd;          // the session socket, readable once the peer is gone
+    int nonblock;           // fail with EAGAIN instead of sleeping
+    int peer_gone;
+} shm_ring;
+
+typedef struct shm_channel {
+    void *map;
+    int memfd;              // only until it was offered to the client
+    shm_ring in;
+    shm_ring out;
+} shm_channel;
+
+// Server side: sets up a channel over the session socket sock
+int shm_channel_create(shm_channel *chan, int sock);
+// Server side: sends the marker, with chan's descriptors unless chan is NULL
+int shm_channel_offer(int sock, shm_channel *chan);
+// Client side: reads the marker. 1 when chan was set up, 0 if declined, -1 on error
+int shm_channel_accept(int sock, shm_channel *chan);
+// Unmaps and closes the eventfds, the socket stays open
+void shm_channel_close(shm_channel *chan);
+
+// Like read(): bytes copied, 0 once the peer is gone and nothing is left, -1 with errno
+ssize_t shm_ring_read(shm_ring *ring, void *buf, size_t count);
+// Like writev(): bytes copied, -1 with errno (EPIPE once the peer is gone)
+ssize_t shm_ring_writev(shm_ring *ring, const struct iovec *iov, int iov_count);
+// Blocking: writes all count bytes unless the peer goes away
+ssize_t shm_ring_write_full(shm_ring *ring, const void *buf, size_t count);
+
+/**
+ * For callers that poll wait_fd next to other descriptors: returns 1 if
+ * bytes can be read right away, otherwise 0 after asking the producer to
+ * ring wait_fd as soon as some arrive.
+ */
+int shm_ring_poll_prepare(shm_ring *ring);
+
+#endif
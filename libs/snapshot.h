@@ -0,0 +1,57 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "document.h"
+
+/**
+ * Background snapshots of every document, written by a forked child. The
+ * caller forks with its documents quiescent, which holds up edits only for
+ * the fork() itself. From then on the child sees memory exactly as it was
+ * at that moment: copy-on-write gives the parent a private copy of each
+ * page it changes, so the child walks the documents' pieces without any
+ * lock while the parent goes on committing.
+ *
+ * A snapshot directory holds "<name>.md" per document and a MANIFEST with
+ * one "<name> <version> <length>" line each, written last. Every file is
+ * written under a temporary name, synced and renamed into place.
+ *
+ * The child must not take locks, allocate or use stdio: any other thread
+ * of the parent may have held those at the fork. It closes every
+ * descriptor it inherited before writing, so the parent's sockets close
+ * when the parent closes them. It reports back through a pipe and a parent
+ * thread reaps it.
+ */
+
+// Runs in the child: calls snapshot_save_doc per document, returns -1 on failure
+typedef int (*snapshot_fn)(void *ctx);
+
+typedef struct snapshot_stats {
+    uint64_t taken;
+    uint64_t failed;
+    int running;
+    uint64_t fork_us;           // time the last one spent in the parent's fork()
+    // Of the last snapshot taken
+    double ms;                  // fork to the child's exit
+    uint64_t pages_copied;      // pages parent and child stopped sharing meanwhile
+    uint64_t bytes;
+    size_t docs;
+} snapshot_stats;
+
+// Creates dir if it doesn't exist. Snapshots are written there
+int snapshot_init(const char *dir);
+
+/**
+ * Forks a child that runs fn. The caller must keep everything fn reads
+ * unchanged across the call. Returns 0 once the child runs, 1 if the last
+ * snapshot hasn't finished yet and -1 if it can't be started.
+ */
+int snapshot_start(snapshot_fn fn, void *ctx, uint64_t *fork_us_out);
+
+// Child only: writes the committed text of doc as "<name>.md"
+int snapshot_save_doc(const char *name, uint64_t version, const document *doc);
+
+void snapshot_get_stats(snapshot_stats *stats);
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef WAL_H
+#define WAL_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "document.h"
+
+/**
+ * Write-ahead log of committed edits. Every commit of every document is
+ * appended as one binary record, written to the file before the commit is
+ * published, so a crashed server process loses nothing that a client was
+ * told about. A commit whose record can't be written is refused, and once
+ * a write or sync has failed every later one is too. When the record also
+ * reaches the disk depends on the sync policy:
+ *
+ *   WAL_SYNC_COMMIT  a reply showing the commit waits for fdatasync
+ *                    (wal_wait_durable). Commits made meanwhile, to any
+ *                    document, share that fdatasync.
+ *   WAL_SYNC_MS      a background thread syncs every N milliseconds.
+ *   WAL_SYNC_BYTES   a background thread syncs once N unsynced bytes
+ *                    have piled up.
+ *
+ * File layout: the 8-byte magic "MDWAL01\n", then records of
+ *
+ *   u32 body length, u32 CRC-32 of the body (both little-endian), body
+ *
+ * where the body is a kind byte and LEB128 varints:
+ *
+ *   WAL_RECORD_COMMIT    name_len name version count
+ *                        count * (type pos len [len inserted bytes])
+ *   WAL_RECORD_SNAPSHOT  name_len name version text_len text
+ *
+ * Change positions refer to the version before the commit, as in change.
+ * A snapshot record stands in for a commit whose changes weren't known.
+ *
+ * On restart the log is replayed from the offset a checkpoint names (see
+ * checkpoint.h). A crash can only tear the last write: a record cut short,
+ * a last record failing its CRC or a tail of zeros ends the log, and is
+ * dropped and the file truncated before appending resumes. Any other
+ * record that fails its CRC or doesn't decode is damage with durable
+ * records after it, and the replay fails rather than drop them.
+ */
+
+#define WAL_MAGIC "MDWAL01\n"
+#define WAL_MAGIC_LEN 8
+#define WAL_RECORD_COMMIT 1
+#define WAL_RECORD_SNAPSHOT 2
+
+typedef enum {
+    WAL_SYNC_COMMIT = 0,
+    WAL_SYNC_MS,
+    WAL_SYNC_BYTES
+} wal_sync_mode;
+
+typedef struct wal_stats {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t syncs;
+    int failed;             // a write or sync failed, commits are refused from then on
+} wal_stats;
+
+/**
+ * One replayed record. name and inserted text aren't NUL-terminated and
+ * point into the mapped log, which is only kept mapped if a snapshot
+ * record was replayed: snapshot text stays valid for the life of the
+ * process, everything else only during the callback.
+ */
+typedef struct wal_record {
+    int kind;                   // WAL_RECORD_COMMIT or WAL_RECORD_SNAPSHOT
+    const char *name;
+    size_t name_len;
+    uint64_t version;
+    const change *changes;      // commit only
+    size_t count;
+    const char *text;           // snapshot only
+    size_t len;
+} wal_record;
+
+typedef struct wal_replay_stats {
+    uint64_t records;
+    uint64_t bytes;             // of the records replayed
+    uint64_t end;               // where the last whole record ends, 0 for no log
+    uint64_t dropped;           // bytes of torn tail after it
+} wal_replay_stats;
+
+// Returns 0 to go on, -1 to stop the replay
+typedef int (*wal_replay_fn)(const wal_record *record, void *ctx);
+
+// Parses "commit", "<N>ms" or "<N>bytes". Returns -1 if spec is none of them
+int wal_parse_policy(const char *spec, wal_sync_mode *mode_out, uint64_t *every_out);
+
+/**
+ * Passes every record from offset "from" on to fn, in log order. A missing
+ * or empty log has no records. Returns -1 if path isn't a log, from lies
+ * past its end, a record before the tail is damaged (EBADMSG) or fn
+ * failed. stats->end is then where the record that stopped it starts.
+ */
+int wal_replay(const char *path, uint64_t from, wal_replay_fn fn, void *ctx,
+               wal_replay_stats *stats);
+
+/**
+ * Opens (or creates) path for appending after the first "end" bytes, as
+ * found by wal_replay, and starts the sync thread the policy needs.
+ */
+int wal_open(const char *path, wal_sync_mode mode, uint64_t every, uint64_t end);
+
+/**
+ * Logs one commit of document name and returns where its record ends, or
+ * 0 if it wasn't logged. Returns once the record is written, it may not be
+ * on disk yet.
+ */
+uint64_t wal_log_commit(const char *name, uint64_t version, const change *changes,
+                        size_t count);
+// Logs a document's whole text in place of a commit
+uint64_t wal_log_snapshot(const char *name, uint64_t version, const char *text, size_t len);
+
+// Where the next record will start
+uint64_t wal_offset(void);
+// Waits until everything logged so far is on disk. -1 once the log has failed
+int wal_flush(void);
+/**
+ * With WAL_SYNC_COMMIT, waits until the log is on disk up to offset, so a
+ * reply can tell of what it holds; returns at once with the other policies.
+ * Call it without any lock held. -1 if the log failed first.
+ */
+int wal_wait_durable(uint64_t offset);
+// 1 once a write or sync has failed
+int wal_failed(void);
+
+// 0 when no log is open
+int wal_enabled(void);
+void wal_get_stats(wal_stats *stats);
+
+#endif
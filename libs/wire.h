@@ -0,0 +1,89 @@
+#ifndef WIRE_H
+#define WIRE_H
+#include <stdint.h>
+
+/**
+ * Opcodes and the optional binary wire format, shared by client and server.
+ *
+ * The text protocol names commands ("REQUEST insert ...") and stays the
+ * default. A client that adds "proto=bin" to its handshake line switches
+ * the rest of the session to fixed-size little-endian headers:
+ *
+ *   request: u8 opcode | u64 version | u64 pos | u64 len | u32 payload length
+ *   reply:   u8 kind | u8 role | u64 from | u64 version | u64 body length
+ *
+ * each followed by its payload or body bytes. "from" is the base version
+ * of a DELTA and the document count of a LIST. An ERROR carries its code
+ * as the body.
+ *
+ * A "txn" request carries a run of edit requests, encoded the same way, as
+ * its payload. They are all staged against the txn's version, their own
+ * version fields are ignored, and committed together as one new version.
+ *
+ * "get_version" asks for the older version named by its pos field. "undo"
+ * goes back to the version before its own, or with a non-zero len to the
+ * version in pos.
+ */
+
+#define WIRE_REQUEST_SIZE 29
+#define WIRE_REPLY_SIZE 26
+
+typedef enum {
+    OP_INVALID = 0,
+    OP_GET,
+    OP_LIST,
+    OP_STATS,
+    OP_SUBSCRIBE,
+    OP_INSERT,
+    OP_DELETE,
+    OP_BOLD,
+    OP_ITALIC,
+    OP_HEADING,
+    OP_NEWLINE,
+    OP_DISCONNECT,
+    OP_TXN,
+    OP_SAVE,
+    OP_GET_VERSION,
+    OP_UNDO,
+    OP_COUNT
+} wire_op;
+
+typedef enum {
+    REPLY_SNAPSHOT = 1,
+    REPLY_DELTA,
+    REPLY_LIST,
+    REPLY_STATS,
+    REPLY_ERROR
+} wire_reply_kind;
+
+typedef struct {
+    wire_op op;
+    uint64_t version;
+    uint64_t pos;
+    uint64_t len;
+    uint32_t payload_len;
+} wire_request;
+
+typedef struct {
+    wire_reply_kind kind;
+    uint8_t role;           // 1 read, 2 write, 0 before authentication
+    uint64_t from;
+    uint64_t version;
+    uint64_t body_len;
+} wire_reply;
+
+// Text-protocol name of an opcode, and back. Unknown names give OP_INVALID
+const char *wire_op_name(wire_op op);
+wire_op wire_op_from_name(const char *name);
+
+const char *wire_role_name(uint8_t role);
+
+void wire_encode_request(const wire_request *req, unsigned char out[WIRE_REQUEST_SIZE]);
+// Unknown opcodes decode as OP_INVALID
+void wire_decode_request(const unsigned char in[WIRE_REQUEST_SIZE], wire_request *req);
+
+void wire_encode_reply(const wire_reply *reply, unsigned char out[WIRE_REPLY_SIZE]);
+// Returns -1 for an unknown reply kind
+int wire_decode_reply(const unsigned char in[WIRE_REPLY_SIZE], wire_reply *reply);
+
+#endif
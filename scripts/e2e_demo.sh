@@ -10,25 +10,54 @@ WRITER_OUT="$(mktemp)"
 READER_OUT="$(mktemp)"
 BAD_OUT="$(mktemp)"
 BAD_ERR="$(mktemp)"
+LIST_OUT="$(mktemp)"
+DELTA_OUT="$(mktemp)"
+SUB_OUT="$(mktemp)"
+BIN_OUT="$(mktemp)"
+BATCH_OUT="$(mktemp)"
+HISTORY_OUT="$(mktemp)"
+WAL_FILE="$(mktemp)"
+RESTART_OUT="$(mktemp)"
+SNAPSHOT_DIR="$(mktemp -d)"
 
 cleanup() {
     if [[ -n "${SERVER_PID:-}" ]]; then
         kill "$SERVER_PID" 2>/dev/null || true
         wait "$SERVER_PID" 2>/dev/null || true
     fi
-    rm -f "$SERVER_LOG" "$WRITER_OUT" "$READER_OUT" "$BAD_OUT" "$BAD_ERR"
+    rm -f "$SERVER_LOG" "$WRITER_OUT" "$READER_OUT" "$BAD_OUT" "$BAD_ERR" "$LIST_OUT" "$DELTA_OUT" "$SUB_OUT" "$BIN_OUT" "$BATCH_OUT" "$HISTORY_OUT" "$WAL_FILE" "$WAL_FILE.ckpt" "$RESTART_OUT"
+    rm -rf "$SNAPSHOT_DIR"
 }
 
 trap cleanup EXIT
 
-./server 2 >"$SERVER_LOG" 2>&1 &
+./server ${SERVER_ARGS:-} -w "$WAL_FILE" 2 >"$SERVER_LOG" 2>&1 &
 SERVER_PID=$!
 
 sleep 1
 
-./client "$SERVER_PID" daniel insert 0 "hello world" >"$WRITER_OUT"
+# The writer takes the signal handshake and FIFOs, everyone else the socket
+./client -f "$SERVER_PID" daniel insert 0 "hello world" >"$WRITER_OUT"
 ./client "$SERVER_PID" ryan get >"$READER_OUT"
 ./client "$SERVER_PID" unknown_user >"$BAD_OUT" 2>"$BAD_ERR" || true
+./client -d notes "$SERVER_PID" daniel insert 0 "notes" >/dev/null
+./client "$SERVER_PID" ryan list >"$LIST_OUT"
+./client -D "$SERVER_PID" daniel insert 11 "!" >"$DELTA_OUT"
+
+# Subscribe for one pushed update, then commit once the subscription is up
+./client -D "$SERVER_PID" ryan subscribe 1 >"$SUB_OUT" &
+SUB_PID=$!
+for _ in $(seq 1 50); do
+    [[ "$(grep -c '^version:' "$SUB_OUT")" -ge 2 ]] && break
+    sleep 0.1
+done
+./client "$SERVER_PID" daniel insert 0 ">> " >/dev/null
+wait "$SUB_PID"
+./client -b "$SERVER_PID" ryan get >"$BIN_OUT"
+# The batch moves onto shared-memory rings after the socket handshake
+printf 'insert 0 abc\ninsert 3 def\nbold 0 3\nget\nbegin\ndelete 0 2\ninsert 0 ++\nheading 1 0\ncommit\n' | ./client -m -D -d batch "$SERVER_PID" daniel batch >"$BATCH_OUT"
+# Older versions stay readable, undo commits one of them again
+printf 'insert 0 one\ninsert 3 two\nget_version 1\nundo\nundo 0\n' | ./client -D -d history "$SERVER_PID" daniel batch >"$HISTORY_OUT"
 
 echo "== Writer Session =="
 cat "$WRITER_OUT"
@@ -45,12 +74,68 @@ fi
 cat "$BAD_ERR"
 echo
 
+echo "== Document List =="
+cat "$LIST_OUT"
+echo
+
+echo "== Delta Session =="
+cat "$DELTA_OUT"
+echo
+
+echo "== Subscriber Session =="
+cat "$SUB_OUT"
+echo
+
+echo "== Binary Protocol Session =="
+cat "$BIN_OUT"
+echo
+
+echo "== Batch Session =="
+cat "$BATCH_OUT"
+echo
+
+echo "== History Session =="
+cat "$HISTORY_OUT"
+echo
+
 echo "== Assertions =="
 grep -q "role:write" "$WRITER_OUT" && echo "writer authenticated"
 grep -q "hello world" "$WRITER_OUT" && echo "writer edit applied"
 grep -q "role:read" "$READER_OUT" && echo "reader authenticated"
+[[ -S "SOCK_$SERVER_PID" ]] && echo "socket listener up alongside the FIFO handshake"
 grep -q "hello world" "$READER_OUT" && echo "reader saw latest snapshot"
 grep -q "UNAUTHORISED" "$BAD_ERR" && echo "unauthorized client rejected"
+grep -q "^default 1 11$" "$LIST_OUT" && grep -q "^notes 1 5$" "$LIST_OUT" && echo "documents versioned independently"
+grep -q "^hello world!$" "$DELTA_OUT" && echo "delta reply patched client copy"
+grep -q "^>> hello world!$" "$SUB_OUT" && echo "subscriber received pushed update"
+grep -q "^>> hello world!$" "$BIN_OUT" && grep -q "role:read" "$BIN_OUT" && echo "binary protocol session matched text output"
+grep -q "^#3 bold ok 3$" "$BATCH_OUT" && grep -q "^\*\*abc\*\*def$" "$BATCH_OUT" && echo "pipelined batch applied in order over shared memory"
+grep -q "^#9 txn ok 4$" "$BATCH_OUT" && grep -q "^# ++abc\*\*def$" "$BATCH_OUT" && echo "transaction committed as one version"
+grep -q "^#3 get_version ok 1$" "$HISTORY_OUT" && grep -q "^one$" "$HISTORY_OUT" && echo "older version read back"
+grep -q "^#4 undo ok 3$" "$HISTORY_OUT" && grep -q "^#5 undo ok 4$" "$HISTORY_OUT" && grep -q "^length:0$" "$HISTORY_OUT" && echo "undo committed earlier versions again"
+[[ "$(head -c 8 "$WAL_FILE")" == "MDWAL01" ]] && [[ "$(stat -c %s "$WAL_FILE")" -gt 8 ]] && echo "commits appended to the write-ahead log"
+
+kill "$SERVER_PID"
+wait "$SERVER_PID" 2>/dev/null || true
+[[ ! -e "SOCK_$SERVER_PID" ]] && echo "socket removed on shutdown"
+SERVER_PID=
+
+# A restarted server comes back from the log with every document as it was
+./server ${SERVER_ARGS:-} -w "$WAL_FILE" -S "$SNAPSHOT_DIR" 2 >"$SERVER_LOG" 2>&1 &
+SERVER_PID=$!
+sleep 1
+./client -d batch "$SERVER_PID" ryan get >"$RESTART_OUT"
+grep -q "^restore: " "$SERVER_LOG" && grep -q "^version:4$" "$RESTART_OUT" && grep -q "^# ++abc\*\*def$" "$RESTART_OUT" && echo "documents restored from the write-ahead log"
+# A forked child writes the snapshot, the MANIFEST goes last
+./client "$SERVER_PID" daniel save | grep -q "^snapshot "
+for _ in $(seq 1 50); do
+    [[ -f "$SNAPSHOT_DIR/MANIFEST" ]] && break
+    sleep 0.1
+done
+grep -q "^batch 4 12$" "$SNAPSHOT_DIR/MANIFEST" && [[ "$(cat "$SNAPSHOT_DIR/batch.md")" == "# ++abc**def" ]] && echo "documents saved by a forked snapshot"
+kill "$SERVER_PID"
+wait "$SERVER_PID" 2>/dev/null || true
+SERVER_PID=
 
 echo
 echo "Demo completed successfully."
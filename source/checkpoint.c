@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../libs/checkpoint.h"
+#include "../libs/frame_io.h"
+
+static void put_u64(unsigned char *out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_u64(const unsigned char *in) {
+    uint64_t value = 0;
+
+    for (int i = 7; i >= 0; --i) {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+static int write_docs(int fd, uint64_t wal_offset, const checkpoint_doc *docs, size_t count) {
+    unsigned char header[CHECKPOINT_MAGIC_LEN + 16];
+
+    memcpy(header, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN);
+    put_u64(header + CHECKPOINT_MAGIC_LEN, wal_offset);
+    put_u64(header + CHECKPOINT_MAGIC_LEN + 8, count);
+    if (write_full(fd, header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        unsigned char doc_header[1 + 255 + 16];
+        unsigned char *out = doc_header;
+
+        if (docs[i].name_len > 255) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        *out++ = (unsigned char)docs[i].name_len;
+        memcpy(out, docs[i].name, docs[i].name_len);
+        out += docs[i].name_len;
+        put_u64(out, docs[i].version);
+        put_u64(out + 8, docs[i].len);
+        out += 16;
+        if (write_full(fd, doc_header, (size_t)(out - doc_header)) < 0 ||
+            write_full(fd, docs[i].text, docs[i].len) < 0) {
+            return -1;
+        }
+    }
+    return write_full(fd, CHECKPOINT_END, CHECKPOINT_MAGIC_LEN) < 0 ? -1 : 0;
+}
+
+int checkpoint_write(const char *path, uint64_t wal_offset, const checkpoint_doc *docs,
+                     size_t count) {
+    char tmp_path[4096];
+    int fd;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write_docs(fd, wal_offset, docs, count) != 0 || fdatasync(fd) != 0) {
+        int saved = errno;
+
+        close(fd);
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) != 0) {
+        int saved = errno;
+
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    return sync_parent_dir(path);
+}
+
+int checkpoint_load(const char *path, uint64_t *wal_offset_out, checkpoint_fn fn, void *ctx) {
+    struct stat st;
+    const unsigned char *map;
+    const unsigned char *in;
+    const unsigned char *end;
+    uint64_t count;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    *wal_offset_out = 0;
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < 2 * CHECKPOINT_MAGIC_LEN + 16) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    in = map;
+    end = map + st.st_size - CHECKPOINT_MAGIC_LEN;
+    if (memcmp(in, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN) != 0 ||
+        memcmp(end, CHECKPOINT_END, CHECKPOINT_MAGIC_LEN) != 0) {
+        goto malformed;
+    }
+    *wal_offset_out = get_u64(in + CHECKPOINT_MAGIC_LEN);
+    count = get_u64(in + CHECKPOINT_MAGIC_LEN + 8);
+    in += CHECKPOINT_MAGIC_LEN + 16;
+
+    // Only the headers are touched here, the text is faulted in when read
+    for (uint64_t i = 0; i < count; ++i) {
+        checkpoint_doc doc;
+
+        if (in == end || (size_t)(end - in) < 1u + *in + 16) {
+            goto malformed;
+        }
+        doc.name_len = *in++;
+        doc.name = (const char *)in;
+        in += doc.name_len;
+        doc.version = get_u64(in);
+        doc.len = (size_t)get_u64(in + 8);
+        in += 16;
+        if (doc.len > (size_t)(end - in)) {
+            goto malformed;
+        }
+        doc.text = (const char *)in;
+        in += doc.len;
+        if (fn(&doc, ctx) != 0) {
+            return -1;
+        }
+    }
+    if (in != end) {
+        goto malformed;
+    }
+    return 1;
+
+malformed:
+    errno = EINVAL;
+    return -1;
+}
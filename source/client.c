@@ -1,193 +1,930 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "../libs/frame_io.h"
+#include "../libs/shm_ring.h"
+#include "../libs/wire.h"
+
 #define FIFO_NAME_MAX 128
 #define LINE_MAX 512
+#define BATCH_WINDOW 256
 
 static volatile sig_atomic_t g_server_ready = 0;
 
+// Set when the server handed us shared-memory rings (-m), requests go there
+static shm_channel g_shm;
+static shm_ring *g_ring_out = NULL;
+
+// The client's copy of the document, kept so DELTA replies can be applied
+typedef struct {
+    char *text;
+    size_t len;
+    uint64_t version;
+    uint8_t role;           // as reported with the last snapshot or delta
+} local_doc;
+
 static void ready_handler(int sig) {
     (void)sig;
     g_server_ready = 1;
 }
 
-static ssize_t write_full(int fd, const void *buf, size_t count) {
-    const char *cursor = (const char *)buf;
-    size_t written = 0;
+static void strip_newline(char *text) {
+    size_t len;
 
-    while (written < count) {
-        ssize_t rc = write(fd, cursor + written, count - written);
-        if (rc < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
+    if (!text) {
+        return;
+    }
+
+    len = strlen(text);
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        text[--len] = '\0';
+    }
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage:\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> get\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> list\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> stats\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> save\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> get_version <version>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> undo [version]\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> subscribe [count]\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> insert <pos> <text>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> delete <pos> <len>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> bold <start> <end>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> italic <start> <end>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> heading <level> <pos>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> newline <pos>\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> txn \"<edit>\" ...\n"
+            "  %s [-b] [-D] [-f | -m] [-d document] <server_pid> <username> batch [file]\n"
+            "  -D asks the server for deltas instead of full snapshots\n"
+            "  -b talks the binary protocol instead of text\n"
+            "  -f connects with the signal handshake and FIFOs instead of the socket\n"
+            "  -m moves requests and replies onto shared memory after the socket handshake\n"
+            "  save has the server write every document to its snapshot directory\n"
+            "  get_version prints an older version the server still keeps\n"
+            "  undo commits the previous version's text again, or that of <version>\n"
+            "  subscribe prints every new version, or only the next <count>\n"
+            "  txn commits all the quoted edits as one version, or none of them\n"
+            "  batch pipelines one command per line from file (default stdin),\n"
+            "    edits between \"begin\" and \"commit\" lines form one txn\n",
+            prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog,
+            prog);
+}
+
+// Reads a body of body_len bytes into a new NUL-terminated buffer
+static int read_body(frame_reader *in, uint64_t body_len, char **body_out) {
+    char *body = malloc((size_t)body_len + 1);
+
+    if (!body) {
+        perror("malloc");
+        return -1;
+    }
+    if (body_len > 0 && frame_read_exact(in, body, (size_t)body_len) <= 0) {
+        free(body);
+        return -1;
+    }
+    body[body_len] = '\0';
+    *body_out = body;
+    return 0;
+}
+
+static uint8_t role_from_name(const char *name) {
+    if (strcmp(name, "read") == 0) {
+        return 1;
+    }
+    if (strcmp(name, "write") == 0) {
+        return 2;
+    }
+    return 0;
+}
+
+// Parses one text reply header line into the same form as a binary header
+static int parse_text_reply(char *header, wire_reply *reply, char *message, size_t capacity) {
+    char role[32];
+    unsigned long long from = 0;
+    unsigned long long version = 0;
+    unsigned long long body_len = 0;
+
+    memset(reply, 0, sizeof(*reply));
+    strip_newline(header);
+
+    if (strncmp(header, "ERROR ", 6) == 0) {
+        reply->kind = REPLY_ERROR;
+        snprintf(message, capacity, "%s", header + 6);
+        return 0;
+    }
+    if (sscanf(header, "LIST %llu %llu", &from, &body_len) == 2) {
+        reply->kind = REPLY_LIST;
+    } else if (sscanf(header, "STATS %llu", &body_len) == 1) {
+        reply->kind = REPLY_STATS;
+    } else if (sscanf(header, "DELTA %31s %llu %llu %llu", role, &from, &version, &body_len) == 4) {
+        reply->kind = REPLY_DELTA;
+        reply->role = role_from_name(role);
+    } else if (sscanf(header, "SNAPSHOT %31s %llu %llu", role, &version, &body_len) == 3) {
+        reply->kind = REPLY_SNAPSHOT;
+        reply->role = role_from_name(role);
+    } else {
+        fprintf(stderr, "Malformed server response: %s\n", header);
+        return -1;
+    }
+
+    reply->from = from;
+    reply->version = version;
+    reply->body_len = body_len;
+    return 0;
+}
+
+/*
+ * Reads the next reply header in the session's protocol. For an error the
+ * code ends up in message, in binary mode it is the reply body.
+ */
+static int read_reply_header(frame_reader *in, int binary, wire_reply *reply,
+                             char *message, size_t capacity) {
+    char header[LINE_MAX];
+    unsigned char head[WIRE_REPLY_SIZE];
+
+    if (!binary) {
+        if (frame_read_line(in, header, sizeof(header)) <= 0) {
             return -1;
         }
-        written += (size_t)rc;
+        return parse_text_reply(header, reply, message, capacity);
     }
 
-    return (ssize_t)written;
+    if (frame_read_exact(in, head, sizeof(head)) <= 0) {
+        return -1;
+    }
+    if (wire_decode_reply(head, reply) != 0) {
+        fprintf(stderr, "Malformed server response: kind %u\n", head[0]);
+        return -1;
+    }
+    if (reply->kind == REPLY_ERROR) {
+        if (reply->body_len >= capacity ||
+            frame_read_exact(in, message, (size_t)reply->body_len) <= 0) {
+            return -1;
+        }
+        message[reply->body_len] = '\0';
+    }
+    return 0;
 }
 
-static ssize_t read_full(int fd, void *buf, size_t count) {
-    char *cursor = (char *)buf;
-    size_t total = 0;
+/*
+ * Applies one DELTA body (a run of "C <version> <ops>" commits, see the
+ * server) to the local copy. The result replaces doc->text only if every
+ * commit applied cleanly.
+ */
+static int apply_delta(local_doc *doc, const char *body, size_t body_len,
+                       uint64_t to_version) {
+    const char *cursor = body;
+    const char *end = body + body_len;
+    char *text = doc->text;
+    size_t len = doc->len;
+    uint64_t version = doc->version;
 
-    while (total < count) {
-        ssize_t rc = read(fd, cursor + total, count - total);
-        if (rc < 0) {
-            if (errno == EINTR) {
-                continue;
+    while (cursor < end) {
+        unsigned long long commit_version = 0;
+        unsigned long long ops = 0;
+        char *next = NULL;
+        char *out;
+        size_t src = 0;
+        size_t out_len = 0;
+        size_t cap = len;
+
+        if (sscanf(cursor, "C %llu %llu", &commit_version, &ops) != 2 ||
+            commit_version != version + 1 ||
+            !(cursor = memchr(cursor, '\n', (size_t)(end - cursor)))) {
+            goto malformed;
+        }
+        cursor++;
+
+        out = malloc(cap + 1);
+        if (!out) {
+            goto malformed;
+        }
+        for (unsigned long long i = 0; i < ops; ++i) {
+            char op;
+            unsigned long long n;
+
+            if (cursor >= end) {
+                free(out);
+                goto malformed;
+            }
+            op = *cursor;
+            n = strtoull(cursor + 1, &next, 10);
+            if (!next || next >= end || *next != '\n') {
+                free(out);
+                goto malformed;
+            }
+            cursor = next + 1;
+
+            if (op == 'I') {
+                char *grown;
+
+                if ((size_t)(end - cursor) < n) {
+                    free(out);
+                    goto malformed;
+                }
+                cap += (size_t)n;
+                grown = realloc(out, cap + 1);
+                if (!grown) {
+                    free(out);
+                    goto malformed;
+                }
+                out = grown;
+                memcpy(out + out_len, cursor, (size_t)n);
+                out_len += (size_t)n;
+                cursor += n;
+            } else if ((op == 'R' || op == 'D') && n <= len - src) {
+                if (op == 'R') {
+                    memcpy(out + out_len, text + src, (size_t)n);
+                    out_len += (size_t)n;
+                }
+                src += (size_t)n;
+            } else {
+                free(out);
+                goto malformed;
             }
-            return -1;
         }
-        if (rc == 0) {
-            return 0;
+        memcpy(out + out_len, text + src, len - src);
+        out_len += len - src;
+        out[out_len] = '\0';
+
+        if (text != doc->text) {
+            free(text);
         }
-        total += (size_t)rc;
+        text = out;
+        len = out_len;
+        version = commit_version;
     }
 
-    return (ssize_t)total;
+    if (version != to_version) {
+        goto malformed;
+    }
+    if (text != doc->text) {
+        free(doc->text);
+    }
+    doc->text = text;
+    doc->len = len;
+    doc->version = version;
+    return 0;
+
+malformed:
+    if (text != doc->text) {
+        free(text);
+    }
+    return -1;
 }
 
-static ssize_t read_line(int fd, char *buf, size_t capacity) {
-    size_t used = 0;
+/*
+ * Reads one reply. Snapshots and deltas update the local copy, the body of
+ * a LIST or STATS reply is handed back in text_out. Returns 0 on success,
+ * 1 for an error reply (code in message), 2 for a delta that doesn't start
+ * at the local copy's version (the copy is left as is) and -1 once the
+ * session is unusable.
+ */
+static int read_response(frame_reader *in, int binary, local_doc *doc, wire_reply *reply,
+                         char **text_out, char *message, size_t capacity) {
+    char *body = NULL;
+    int rc;
 
-    if (capacity < 2) {
-        errno = EINVAL;
+    *text_out = NULL;
+    if (read_reply_header(in, binary, reply, message, capacity) != 0) {
+        return -1;
+    }
+    if (reply->kind == REPLY_ERROR) {
+        return 1;
+    }
+    if (read_body(in, reply->body_len, &body) != 0) {
         return -1;
     }
 
-    while (used < capacity - 1) {
-        char ch;
-        ssize_t rc = read(fd, &ch, 1);
-        if (rc < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
+    switch (reply->kind) {
+    case REPLY_LIST:
+    case REPLY_STATS:
+        *text_out = body;
+        return 0;
+    case REPLY_SNAPSHOT:
+        free(doc->text);
+        doc->text = body;
+        doc->len = (size_t)reply->body_len;
+        doc->version = reply->version;
+        doc->role = reply->role;
+        return 0;
+    default:
+        rc = 2;
+        if (reply->from == doc->version &&
+            apply_delta(doc, body, (size_t)reply->body_len, reply->version) == 0) {
+            doc->role = reply->role;
+            rc = 0;
+        }
+        free(body);
+        return rc;
+    }
+}
+
+static void print_doc(const local_doc *doc) {
+    printf("role:%s\nversion:%llu\nlength:%zu\n%s\n",
+           wire_role_name(doc->role), (unsigned long long)doc->version, doc->len,
+           doc->text ? doc->text : "");
+}
+
+// Prints what a successful reply carried: a document list, stats or the local copy
+static void print_response(const wire_reply *reply, const char *text, const local_doc *doc) {
+    if (reply->kind == REPLY_LIST) {
+        printf("documents:%llu\n", (unsigned long long)reply->from);
+    }
+    if (text) {
+        fputs(text, stdout);
+    } else {
+        print_doc(doc);
+    }
+}
+
+static int read_and_print_response(frame_reader *in, int binary, local_doc *doc) {
+    wire_reply reply;
+    char message[LINE_MAX];
+    char *text = NULL;
+    int rc = read_response(in, binary, doc, &reply, &text, message, sizeof(message));
+
+    if (rc == 1) {
+        fprintf(stderr, "Server error: %s\n", message);
+    } else if (rc == 2) {
+        fprintf(stderr, "Cannot apply server delta %llu -> %llu\n",
+                (unsigned long long)reply.from, (unsigned long long)reply.version);
+    } else if (rc == 0) {
+        print_response(&reply, text, doc);
+    }
+    free(text);
+    return rc == 0 ? 0 : -1;
+}
+
+// write_full, unless the session runs on shared memory
+static ssize_t send_bytes(int fd_c2s, const void *buf, size_t count) {
+    if (g_ring_out) {
+        return shm_ring_write_full(g_ring_out, buf, count);
+    }
+    return write_full(fd_c2s, buf, count);
+}
+
+static void send_disconnect(int fd_c2s, int binary) {
+    if (binary) {
+        wire_request req = {OP_DISCONNECT, 0, 0, 0, 0};
+        unsigned char head[WIRE_REQUEST_SIZE];
+
+        wire_encode_request(&req, head);
+        (void)send_bytes(fd_c2s, head, sizeof(head));
+    } else {
+        (void)send_bytes(fd_c2s, "DISCONNECT\n", 11);
+    }
+}
+
+/*
+ * Fills req from a command name and its arguments, as given on the command
+ * line or on one batch line. The insert text is used as is. Returns -1 for
+ * an unknown command (req->op is OP_INVALID) or arguments that don't fit.
+ */
+static int build_request(const char *command, char **args, int nargs,
+                         wire_request *req, const char **payload) {
+    memset(req, 0, sizeof(*req));
+    *payload = "";
+    req->op = wire_op_from_name(command);
+
+    switch (req->op) {
+    case OP_GET:
+    case OP_LIST:
+    case OP_STATS:
+    case OP_SAVE:
+        return nargs == 0 ? 0 : -1;
+    case OP_SUBSCRIBE:
+        return nargs <= 1 ? 0 : -1;
+    case OP_GET_VERSION:
+        if (nargs != 1) {
             return -1;
         }
-        if (rc == 0) {
-            if (used == 0) {
-                return 0;
-            }
-            break;
+        req->pos = strtoull(args[0], NULL, 10);
+        return 0;
+    case OP_UNDO:
+        if (nargs > 1) {
+            return -1;
+        }
+        if (nargs == 1) {
+            req->pos = strtoull(args[0], NULL, 10);
+            req->len = 1;
+        }
+        return 0;
+    case OP_INSERT:
+        if (nargs != 2 || strlen(args[1]) > UINT32_MAX) {
+            return -1;
         }
+        req->pos = strtoull(args[0], NULL, 10);
+        *payload = args[1];
+        req->payload_len = (uint32_t)strlen(args[1]);
+        return 0;
+    case OP_DELETE:
+    case OP_BOLD:
+    case OP_ITALIC:
+        if (nargs != 2) {
+            return -1;
+        }
+        req->pos = strtoull(args[0], NULL, 10);
+        req->len = strtoull(args[1], NULL, 10);
+        return 0;
+    case OP_HEADING:
+        if (nargs != 2) {
+            return -1;
+        }
+        req->len = strtoull(args[0], NULL, 10);
+        req->pos = strtoull(args[1], NULL, 10);
+        return 0;
+    case OP_NEWLINE:
+        if (nargs != 1) {
+            return -1;
+        }
+        req->pos = strtoull(args[0], NULL, 10);
+        return 0;
+    default:
+        req->op = OP_INVALID;
+        return -1;
+    }
+}
 
-        buf[used++] = ch;
-        if (ch == '\n') {
-            break;
+/*
+ * Splits one batch line into a command and its arguments, in place. The
+ * insert text is the rest of the line after the position and the single
+ * space following it, so it may contain spaces of its own.
+ */
+static int split_batch_line(char *line, char **command, char **args, int max_args) {
+    char *cursor = line + strspn(line, " \t");
+    int insert;
+    int nargs = 0;
+
+    *command = cursor;
+    cursor += strcspn(cursor, " \t");
+    if (*cursor != '\0') {
+        *cursor++ = '\0';
+    }
+    insert = strcmp(*command, "insert") == 0;
+
+    while (1) {
+        cursor += strspn(cursor, " \t");
+        if (*cursor == '\0') {
+            return nargs;
+        }
+        if (nargs == max_args) {
+            return -1;
+        }
+        args[nargs++] = cursor;
+        cursor += strcspn(cursor, " \t");
+        if (*cursor == '\0') {
+            return nargs;
+        }
+        *cursor++ = '\0';
+        if (insert && nargs == 1) {
+            args[nargs++] = cursor;
+            return nargs;
         }
     }
+}
 
-    buf[used] = '\0';
-    return (ssize_t)used;
+// Encodes the request header in the session's protocol, returns its length
+static size_t encode_request(int binary, const wire_request *req, char *out, size_t capacity) {
+    if (binary) {
+        wire_encode_request(req, (unsigned char *)out);
+        return WIRE_REQUEST_SIZE;
+    }
+    snprintf(out, capacity, "REQUEST %s %llu %llu %llu %lu\n",
+             wire_op_name(req->op),
+             (unsigned long long)req->version,
+             (unsigned long long)req->pos,
+             (unsigned long long)req->len,
+             (unsigned long)req->payload_len);
+    return strlen(out);
 }
 
-static void strip_newline(char *text) {
+static int send_request(int fd_c2s, int binary, const wire_request *req, const char *payload) {
+    char request[LINE_MAX];
+    size_t request_len = encode_request(binary, req, request, sizeof(request));
+
+    if (send_bytes(fd_c2s, request, request_len) < 0) {
+        perror("write request");
+        return -1;
+    }
+    if (req->payload_len > 0 && send_bytes(fd_c2s, payload, req->payload_len) < 0) {
+        perror("write payload");
+        return -1;
+    }
+    return 0;
+}
+
+// Edits packed one after another as the payload of a txn request
+typedef struct {
+    char *data;
     size_t len;
+    size_t cap;
+    size_t count;
+} txn_builder;
 
-    if (!text) {
-        return;
+static int txn_append(txn_builder *txn, int binary, const wire_request *req, const char *payload) {
+    char head[LINE_MAX];
+    size_t head_len = encode_request(binary, req, head, sizeof(head));
+    size_t need = txn->len + head_len + req->payload_len;
+
+    if (need > UINT32_MAX) {
+        return -1;
     }
+    if (need > txn->cap) {
+        size_t cap = txn->cap ? txn->cap : 256;
+        char *grown;
 
-    len = strlen(text);
-    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
-        text[--len] = '\0';
+        while (cap < need) {
+            cap *= 2;
+        }
+        grown = realloc(txn->data, cap);
+        if (!grown) {
+            return -1;
+        }
+        txn->data = grown;
+        txn->cap = cap;
     }
+    memcpy(txn->data + txn->len, head, head_len);
+    memcpy(txn->data + txn->len + head_len, payload, req->payload_len);
+    txn->len = need;
+    txn->count++;
+    return 0;
 }
 
-static void print_usage(const char *prog) {
-    fprintf(stderr,
-            "Usage:\n"
-            "  %s <server_pid> <username>\n"
-            "  %s <server_pid> <username> get\n"
-            "  %s <server_pid> <username> insert <pos> <text>\n"
-            "  %s <server_pid> <username> delete <pos> <len>\n"
-            "  %s <server_pid> <username> bold <start> <end>\n"
-            "  %s <server_pid> <username> italic <start> <end>\n"
-            "  %s <server_pid> <username> heading <level> <pos>\n"
-            "  %s <server_pid> <username> newline <pos>\n",
-            prog, prog, prog, prog, prog, prog, prog, prog);
-}
-
-static int read_and_print_response(int fd_s2c, uint64_t *version_out) {
-    char header[LINE_MAX];
-    char role[32];
-    unsigned long long version_value = 0;
-    unsigned long long doc_len = 0;
+/*
+ * Parses one command line of a txn and appends it. Only edits can be
+ * part of a txn. Returns -1 for anything else.
+ */
+static int txn_add_command(txn_builder *txn, int binary, char *line) {
+    char *command;
+    char *args[2];
+    int nargs = split_batch_line(line, &command, args, 2);
+    wire_request req;
+    const char *payload;
 
-    if (read_line(fd_s2c, header, sizeof(header)) <= 0) {
+    if (nargs < 0 || build_request(command, args, nargs, &req, &payload) != 0 ||
+        req.op < OP_INSERT || req.op > OP_NEWLINE) {
         return -1;
     }
-    strip_newline(header);
+    return txn_append(txn, binary, &req, payload);
+}
 
-    if (strncmp(header, "ERROR ", 6) == 0) {
-        fprintf(stderr, "Server error: %s\n", header + 6);
-        return -1;
+static void txn_finish(const txn_builder *txn, wire_request *req) {
+    memset(req, 0, sizeof(*req));
+    req->op = OP_TXN;
+    req->payload_len = (uint32_t)txn->len;
+}
+
+static void txn_reset(txn_builder *txn) {
+    txn->len = 0;
+    txn->count = 0;
+}
+
+// Every edit, txn and undo that succeeds makes exactly one new version
+static int op_commits(wire_op op) {
+    return (op >= OP_INSERT && op <= OP_NEWLINE) || op == OP_TXN || op == OP_UNDO;
+}
+
+/*
+ * Batch mode sends requests without waiting for their replies, up to
+ * BATCH_WINDOW at a time, while a reader thread matches each reply to its
+ * request in order. Since every edit that succeeds bumps the version by
+ * one, the sender predicts the version each request needs from the edits
+ * still in flight. A reply that breaks the prediction (a rejected edit or
+ * another writer's commit) makes the sender wait for the requests in
+ * flight, which may fail as stale, and catch the local copy up with one
+ * get of its own before it carries on.
+ */
+typedef struct {
+    size_t line_no;         // 0 for the client's own catch-up get
+    wire_op op;
+    uint64_t expect;        // version the sender assumed the reply would bring
+} batch_request;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    batch_request window[BATCH_WINDOW];
+    size_t head;
+    size_t in_flight;
+    int resync;             // a reply broke the version predictions
+    int done;               // the sender has nothing more to send
+    int broken;             // the session failed, stop sending
+    size_t failures;
+    frame_reader *in;
+    int binary;
+    local_doc *doc;         // the reader's while requests are in flight
+} batch_session;
+
+static void print_batch_result(const batch_request *req, int rc, const wire_reply *reply,
+                               const char *text, const char *message, const local_doc *doc) {
+    const char *command = wire_op_name(req->op);
+
+    if (rc == 1) {
+        printf("#%zu %s error %s\n", req->line_no, command, message);
+    } else if (rc == 2 && req->op == OP_GET) {
+        printf("#%zu %s error OUT_OF_SYNC\n", req->line_no, command);
+    } else if (req->op == OP_LIST || req->op == OP_STATS || req->op == OP_SAVE) {
+        printf("#%zu %s ok\n", req->line_no, command);
+        print_response(reply, text, doc);
+    } else if (req->op == OP_GET || req->op == OP_GET_VERSION) {
+        printf("#%zu %s ok %llu\n", req->line_no, command, (unsigned long long)reply->version);
+        print_response(reply, text, doc);
+    } else {
+        printf("#%zu %s ok %llu\n", req->line_no, command, (unsigned long long)reply->version);
     }
+}
 
-    if (sscanf(header, "SNAPSHOT %31s %llu %llu", role, &version_value, &doc_len) != 3) {
-        fprintf(stderr, "Malformed server response: %s\n", header);
+static void *batch_reader_main(void *arg) {
+    batch_session *batch = arg;
+
+    while (1) {
+        batch_request req;
+        wire_reply reply;
+        char message[LINE_MAX];
+        char *text = NULL;
+        local_doc old = {NULL, 0, 0, 0};
+        local_doc *target;
+        int rc;
+        int failed;
+        int mismatch;
+
+        pthread_mutex_lock(&batch->mutex);
+        while (batch->in_flight == 0 && !batch->done) {
+            pthread_cond_wait(&batch->cond, &batch->mutex);
+        }
+        if (batch->in_flight == 0) {
+            pthread_mutex_unlock(&batch->mutex);
+            break;
+        }
+        req = batch->window[batch->head];
+        pthread_mutex_unlock(&batch->mutex);
+
+        // An older version must not replace the local copy
+        target = req.op == OP_GET_VERSION ? &old : batch->doc;
+        rc = read_response(batch->in, batch->binary, target, &reply, &text,
+                           message, sizeof(message));
+        if (rc < 0) {
+            pthread_mutex_lock(&batch->mutex);
+            batch->broken = 1;
+            pthread_cond_broadcast(&batch->cond);
+            pthread_mutex_unlock(&batch->mutex);
+            break;
+        }
+        if (req.line_no > 0) {
+            print_batch_result(&req, rc, &reply, text, message, target);
+        }
+        free(text);
+        free(old.text);
+        old.text = NULL;
+
+        failed = rc == 1 || (rc == 2 && req.op == OP_GET);
+        mismatch = rc != 0 || (req.line_no > 0 && reply.kind != REPLY_LIST &&
+                               reply.kind != REPLY_STATS && reply.version != req.expect);
+
+        pthread_mutex_lock(&batch->mutex);
+        batch->head = (batch->head + 1) % BATCH_WINDOW;
+        batch->in_flight--;
+        if (failed && req.line_no > 0) {
+            batch->failures++;
+        }
+        if (mismatch) {
+            batch->resync = 1;
+        }
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+    return NULL;
+}
+
+// Called with the mutex held. Returns -1 once the session is broken
+static int batch_wait(batch_session *batch, size_t max_in_flight) {
+    while (batch->in_flight > max_in_flight && !batch->broken) {
+        pthread_cond_wait(&batch->cond, &batch->mutex);
+    }
+    return batch->broken ? -1 : 0;
+}
+
+// Takes a window slot and sends req with the version the sender predicts
+static int batch_send(batch_session *batch, int fd_c2s, size_t line_no,
+                      wire_request *req, const char *payload, uint64_t *next_version) {
+    int is_edit = op_commits(req->op);
+
+    pthread_mutex_lock(&batch->mutex);
+    if (batch_wait(batch, BATCH_WINDOW - 1) != 0) {
+        pthread_mutex_unlock(&batch->mutex);
         return -1;
     }
+    req->version = *next_version;
+    batch->window[(batch->head + batch->in_flight) % BATCH_WINDOW] = (batch_request){
+        .line_no = line_no,
+        .op = req->op,
+        .expect = req->op == OP_GET_VERSION ? req->pos : *next_version + (is_edit ? 1 : 0),
+    };
+    batch->in_flight++;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+
+    if (is_edit) {
+        ++*next_version;
+    }
+    return send_request(fd_c2s, batch->binary, req, payload);
+}
+
+// Drains the window and catches the local copy up if a prediction broke
+static int batch_resync(batch_session *batch, int fd_c2s, uint64_t *next_version) {
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->resync) {
+        wire_request req = {.op = OP_GET};
 
-    if (doc_len > 0) {
-        char *doc = malloc((size_t)doc_len + 1);
-        if (!doc) {
-            perror("malloc");
+        if (batch_wait(batch, 0) != 0) {
+            pthread_mutex_unlock(&batch->mutex);
             return -1;
         }
+        batch->resync = 0;
+        *next_version = batch->doc->version;
+        pthread_mutex_unlock(&batch->mutex);
 
-        if (read_full(fd_s2c, doc, (size_t)doc_len) <= 0) {
-            free(doc);
+        if (batch_send(batch, fd_c2s, 0, &req, "", next_version) != 0) {
             return -1;
         }
-        doc[doc_len] = '\0';
 
-        printf("role:%s\nversion:%llu\nlength:%llu\n%s\n",
-               role, version_value, doc_len, doc);
-        free(doc);
-    } else {
-        printf("role:%s\nversion:%llu\nlength:%llu\n\n",
-               role, version_value, doc_len);
+        pthread_mutex_lock(&batch->mutex);
+        if (batch_wait(batch, 0) != 0) {
+            pthread_mutex_unlock(&batch->mutex);
+            return -1;
+        }
+        *next_version = batch->doc->version;
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    return 0;
+}
+
+// Reports a line that can't be sent. Local errors don't wait for the replies in flight
+static void batch_usage(batch_session *batch, size_t line_no, const char *command) {
+    fprintf(stderr, "#%zu %s error USAGE\n", line_no, command);
+    pthread_mutex_lock(&batch->mutex);
+    batch->failures++;
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+/*
+ * Runs every command in input over this one session and prints one result
+ * line per command, "#<line> <command> ok <version>" or "#<line> <command>
+ * error <code>", followed by what get, list and stats return. The edits
+ * between a "begin" and a "commit" line are sent as one txn, reported on
+ * the commit line. Ends with the final local copy. Returns the number of failed commands, -1 if the
+ * session broke.
+ */
+static long run_batch(int fd_c2s, frame_reader *in, int binary, local_doc *doc, FILE *input) {
+    batch_session batch = {
+        .in = in,
+        .binary = binary,
+        .doc = doc,
+    };
+    pthread_t reader;
+    uint64_t next_version = doc->version;
+    char *line = NULL;
+    size_t line_cap = 0;
+    size_t line_no = 0;
+    txn_builder txn = {NULL, 0, 0, 0};
+    size_t txn_line = 0;    // line of the open "begin", 0 outside a txn
+    int txn_bad = 0;
+    int broken = 0;
+
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+    if (pthread_create(&reader, NULL, batch_reader_main, &batch) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    while (!broken && getline(&line, &line_cap, input) != -1) {
+        char *command;
+        char *args[2];
+        int nargs;
+        wire_request req;
+        const char *payload;
+
+        ++line_no;
+        strip_newline(line);
+        nargs = split_batch_line(line, &command, args, 2);
+        if (*command == '\0' || *command == '#') {
+            continue;
+        }
+
+        // Edits between "begin" and "commit" go out as one txn request
+        if (strcmp(command, "begin") == 0 && nargs == 0 && !txn_line) {
+            txn_line = line_no;
+            txn_bad = 0;
+            txn_reset(&txn);
+            continue;
+        }
+        if (strcmp(command, "commit") == 0 && nargs == 0 && txn_line) {
+            txn_line = 0;
+            if (txn_bad || txn.count == 0) {
+                batch_usage(&batch, line_no, "txn");
+                continue;
+            }
+            txn_finish(&txn, &req);
+            payload = txn.data;
+        } else if (nargs < 0 || build_request(command, args, nargs, &req, &payload) != 0 ||
+                   req.op == OP_SUBSCRIBE ||
+                   (txn_line && (req.op < OP_INSERT || req.op > OP_NEWLINE ||
+                                 txn_append(&txn, binary, &req, payload) != 0))) {
+            batch_usage(&batch, line_no, command);
+            txn_bad = txn_line != 0;
+            continue;
+        } else if (txn_line) {
+            continue;
+        }
+
+        broken = batch_resync(&batch, fd_c2s, &next_version) != 0 ||
+                 batch_send(&batch, fd_c2s, line_no, &req, payload, &next_version) != 0;
+    }
+    free(line);
+    free(txn.data);
+    if (txn_line) {
+        batch_usage(&batch, txn_line, "begin");
     }
 
-    if (version_out) {
-        *version_out = (uint64_t)version_value;
+    // A prediction broken by the last replies still leaves the copy behind
+    if (!broken) {
+        broken = batch_resync(&batch, fd_c2s, &next_version) != 0;
+    }
+
+    pthread_mutex_lock(&batch.mutex);
+    batch.done = 1;
+    if (broken) {
+        batch.broken = 1;
+    }
+    pthread_cond_broadcast(&batch.cond);
+    pthread_mutex_unlock(&batch.mutex);
+    pthread_join(reader, NULL);
+
+    pthread_mutex_destroy(&batch.mutex);
+    pthread_cond_destroy(&batch.cond);
+    if (batch.broken) {
+        fprintf(stderr, "Session failed during batch\n");
+        return -1;
+    }
+    print_doc(doc);
+    return (long)batch.failures;
+}
+
+/*
+ * Connects to the server's "SOCK_<pid>" socket. Both descriptors refer to
+ * the same connection. Fails if the server has no socket listening.
+ */
+static int connect_socket(pid_t server_pid, int *fd_c2s, int *fd_s2c) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
     }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "SOCK_%d", server_pid);
 
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    *fd_s2c = dup(fd);
+    if (*fd_s2c < 0) {
+        close(fd);
+        return -1;
+    }
+    *fd_c2s = fd;
     return 0;
 }
 
-int main(int argc, char **argv) {
-    pid_t server_pid;
-    pid_t client_pid;
+// Signal handshake: asks the server for a FIFO pair and opens our ends of it
+static int connect_fifos(pid_t server_pid, int *fd_c2s, int *fd_s2c) {
+    pid_t client_pid = getpid();
     char fifo_c2s[FIFO_NAME_MAX];
     char fifo_s2c[FIFO_NAME_MAX];
-    int fd_c2s = -1;
-    int fd_s2c = -1;
     struct sigaction sa;
     sigset_t wait_mask;
     sigset_t old_mask;
-    uint64_t version = 0;
-
-    if (argc < 3) {
-        print_usage(argv[0]);
-        return 1;
-    }
-
-    server_pid = (pid_t)atoi(argv[1]);
-    client_pid = getpid();
 
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = ready_handler;
@@ -195,19 +932,19 @@ int main(int argc, char **argv) {
 
     if (sigaction(SIGUSR2, &sa, NULL) == -1) {
         perror("sigaction");
-        return 1;
+        return -1;
     }
 
     sigemptyset(&wait_mask);
     sigaddset(&wait_mask, SIGUSR2);
     if (sigprocmask(SIG_BLOCK, &wait_mask, &old_mask) == -1) {
         perror("sigprocmask");
-        return 1;
+        return -1;
     }
 
     if (kill(server_pid, SIGUSR1) == -1) {
         perror("kill");
-        return 1;
+        return -1;
     }
 
     while (!g_server_ready) {
@@ -218,123 +955,221 @@ int main(int argc, char **argv) {
 
     if (sigprocmask(SIG_SETMASK, &old_mask, NULL) == -1) {
         perror("sigprocmask restore");
-        return 1;
+        return -1;
     }
 
     snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", client_pid);
     snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", client_pid);
 
-    fd_c2s = open(fifo_c2s, O_WRONLY);
-    if (fd_c2s < 0) {
+    *fd_c2s = open(fifo_c2s, O_WRONLY);
+    if (*fd_c2s < 0) {
         perror("open FIFO_C2S");
-        return 1;
+        return -1;
     }
 
-    fd_s2c = open(fifo_s2c, O_RDONLY);
-    if (fd_s2c < 0) {
+    *fd_s2c = open(fifo_s2c, O_RDONLY);
+    if (*fd_s2c < 0) {
         perror("open FIFO_S2C");
-        close(fd_c2s);
+        close(*fd_c2s);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_connection(int fd_c2s, int fd_s2c) {
+    if (g_ring_out) {
+        shm_channel_close(&g_shm);
+        g_ring_out = NULL;
+    }
+    close(fd_c2s);
+    close(fd_s2c);
+}
+
+int main(int argc, char **argv) {
+    pid_t server_pid;
+    int fd_c2s = -1;
+    int fd_s2c = -1;
+    local_doc doc = {NULL, 0, 0, 0};
+    frame_reader in;
+    char handshake[LINE_MAX];
+    int handshake_len;
+    const char *doc_name = NULL;
+    const char *prog = argv[0];
+    int want_delta = 0;
+    int binary = 0;
+    int use_fifos = 0;
+    int use_shm = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+d:Dbfm")) != -1) {
+        if (opt == 'd') {
+            doc_name = optarg;
+        } else if (opt == 'D') {
+            want_delta = 1;
+        } else if (opt == 'b') {
+            binary = 1;
+        } else if (opt == 'f') {
+            use_fifos = 1;
+        } else if (opt == 'm') {
+            use_shm = 1;
+        } else {
+            print_usage(prog);
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 3 || (use_fifos && use_shm)) {
+        print_usage(prog);
+        return 1;
+    }
+
+    server_pid = (pid_t)atoi(argv[1]);
+
+    // Servers without a socket still take the signal handshake, minus shared memory
+    if (!use_fifos && connect_socket(server_pid, &fd_c2s, &fd_s2c) != 0) {
+        use_fifos = 1;
+        use_shm = 0;
+    }
+    if (use_fifos && connect_fifos(server_pid, &fd_c2s, &fd_s2c) != 0) {
         return 1;
     }
 
-    if (write_full(fd_c2s, argv[2], strlen(argv[2])) < 0 ||
-        write_full(fd_c2s, "\n", 1) < 0) {
+    frame_reader_init(&in, fd_s2c);
+
+    handshake_len = snprintf(handshake, sizeof(handshake), "%s%s%s%s%s%s\n",
+                             argv[2],
+                             doc_name ? " doc=" : "",
+                             doc_name ? doc_name : "",
+                             want_delta ? " delta=1" : "",
+                             binary ? " proto=bin" : "",
+                             use_shm ? " shm=1" : "");
+    if (handshake_len < 0 || (size_t)handshake_len >= sizeof(handshake) ||
+        write_full(fd_c2s, handshake, (size_t)handshake_len) < 0) {
         perror("write username");
-        close(fd_c2s);
-        close(fd_s2c);
+        close_connection(fd_c2s, fd_s2c);
         return 1;
     }
 
-    if (read_and_print_response(fd_s2c, &version) != 0) {
-        close(fd_c2s);
-        close(fd_s2c);
+    // The server answers "shm=1" with a marker first; declined means the socket carries on
+    if (use_shm) {
+        int rc = shm_channel_accept(fd_c2s, &g_shm);
+
+        if (rc < 0) {
+            fprintf(stderr, "Shared-memory handshake failed\n");
+            close_connection(fd_c2s, fd_s2c);
+            return 1;
+        }
+        if (rc > 0) {
+            in.ring = &g_shm.in;
+            g_ring_out = &g_shm.out;
+        }
+    }
+
+    if (read_and_print_response(&in, binary, &doc) != 0) {
+        close_connection(fd_c2s, fd_s2c);
+        free(doc.text);
         return 1;
     }
 
     if (argc == 3) {
-        write_full(fd_c2s, "DISCONNECT\n", 11);
-        close(fd_c2s);
-        close(fd_s2c);
+        send_disconnect(fd_c2s, binary);
+        close_connection(fd_c2s, fd_s2c);
+        free(doc.text);
         return 0;
     }
 
-    {
-        const char *command = argv[3];
-        char request[LINE_MAX];
-        const char *payload = "";
-        size_t pos = 0;
-        size_t len = 0;
-        size_t payload_len = 0;
-
-        if (strcmp(command, "get") == 0) {
-            if (argc != 4) {
-                print_usage(argv[0]);
-                goto fail;
-            }
-        } else if (strcmp(command, "insert") == 0) {
-            if (argc != 6) {
-                print_usage(argv[0]);
+    if (strcmp(argv[3], "batch") == 0) {
+        FILE *input = stdin;
+        long failures;
+
+        if (argc > 5) {
+            print_usage(prog);
+            goto fail;
+        }
+        if (argc == 5 && strcmp(argv[4], "-") != 0) {
+            input = fopen(argv[4], "r");
+            if (!input) {
+                perror("fopen");
                 goto fail;
             }
-            pos = (size_t)strtoull(argv[4], NULL, 10);
-            payload = argv[5];
-            payload_len = strlen(payload);
-        } else if (strcmp(command, "delete") == 0 ||
-                   strcmp(command, "bold") == 0 ||
-                   strcmp(command, "italic") == 0) {
-            if (argc != 6) {
-                print_usage(argv[0]);
-                goto fail;
+        }
+        failures = run_batch(fd_c2s, &in, binary, &doc, input);
+        if (input != stdin) {
+            fclose(input);
+        }
+        if (failures != 0) {
+            goto fail;
+        }
+    } else {
+        const char *command = argv[3];
+        wire_request req;
+        const char *payload;
+        txn_builder txn = {NULL, 0, 0, 0};
+        long updates = -1;
+        int rc;
+
+        if (strcmp(command, "txn") == 0) {
+            for (int i = 4; i < argc; ++i) {
+                if (txn_add_command(&txn, binary, argv[i]) != 0) {
+                    fprintf(stderr, "Not an edit: %s\n", argv[i]);
+                    free(txn.data);
+                    goto fail;
+                }
             }
-            pos = (size_t)strtoull(argv[4], NULL, 10);
-            len = (size_t)strtoull(argv[5], NULL, 10);
-        } else if (strcmp(command, "heading") == 0) {
-            if (argc != 6) {
-                print_usage(argv[0]);
+            if (txn.count == 0) {
+                print_usage(prog);
                 goto fail;
             }
-            len = (size_t)strtoull(argv[4], NULL, 10);
-            pos = (size_t)strtoull(argv[5], NULL, 10);
-        } else if (strcmp(command, "newline") == 0) {
-            if (argc != 5) {
-                print_usage(argv[0]);
-                goto fail;
+            txn_finish(&txn, &req);
+            payload = txn.data;
+        } else if (build_request(command, argv + 4, argc - 4, &req, &payload) != 0) {
+            if (req.op == OP_INVALID) {
+                fprintf(stderr, "Unknown command: %s\n", command);
+            } else {
+                print_usage(prog);
             }
-            pos = (size_t)strtoull(argv[4], NULL, 10);
-        } else {
-            fprintf(stderr, "Unknown command: %s\n", command);
             goto fail;
         }
+        if (req.op == OP_SUBSCRIBE && argc == 5) {
+            updates = strtol(argv[4], NULL, 10);
+        }
 
-        snprintf(request, sizeof(request), "REQUEST %s %llu %zu %zu %zu\n",
-                 command,
-                 (unsigned long long)version,
-                 pos,
-                 len,
-                 payload_len);
-
-        if (write_full(fd_c2s, request, strlen(request)) < 0) {
-            perror("write request");
+        req.version = doc.version;
+        rc = send_request(fd_c2s, binary, &req, payload);
+        free(txn.data);
+        if (rc != 0) {
             goto fail;
         }
-        if (payload_len > 0 && write_full(fd_c2s, payload, payload_len) < 0) {
-            perror("write payload");
+
+        if (read_and_print_response(&in, binary, &doc) != 0) {
             goto fail;
         }
 
-        if (read_and_print_response(fd_s2c, &version) != 0) {
-            goto fail;
+        // A subscription keeps the session open, the server pushes each new version
+        if (req.op == OP_SUBSCRIBE) {
+            fflush(stdout);
+            while (updates != 0) {
+                if (read_and_print_response(&in, binary, &doc) != 0) {
+                    goto fail;
+                }
+                fflush(stdout);
+                if (updates > 0) {
+                    --updates;
+                }
+            }
         }
     }
 
-    write_full(fd_c2s, "DISCONNECT\n", 11);
-    close(fd_c2s);
-    close(fd_s2c);
+    send_disconnect(fd_c2s, binary);
+    close_connection(fd_c2s, fd_s2c);
+    free(doc.text);
     return 0;
 
 fail:
-    write_full(fd_c2s, "DISCONNECT\n", 11);
-    close(fd_c2s);
-    close(fd_s2c);
+    send_disconnect(fd_c2s, binary);
+    close_connection(fd_c2s, fd_s2c);
+    free(doc.text);
     return 1;
 }
@@ -0,0 +1,160 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../libs/epoch.h"
+
+/*
+ * Every thread that reads gets a slot announcing the epoch it entered at,
+ * 0 meaning "not reading". Slots are never freed, a thread that exits gives
+ * its slot back for the next thread to reuse.
+ */
+typedef struct epoch_slot {
+    atomic_uint_fast64_t active;
+    atomic_int in_use;
+    struct epoch_slot *next;
+} epoch_slot;
+
+typedef struct retired {
+    void *ptr;
+    epoch_free_fn free_fn;
+    uint64_t epoch;
+    struct retired *next;
+} retired;
+
+static atomic_uint_fast64_t g_epoch = 1;
+static _Atomic(epoch_slot *) g_slots = NULL;
+static _Thread_local epoch_slot *t_slot = NULL;
+static pthread_key_t g_slot_key;
+static pthread_once_t g_slot_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t g_retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static retired *g_retired = NULL;
+
+static void slot_release(void *arg) {
+    epoch_slot *slot = arg;
+
+    atomic_store(&slot->active, 0);
+    atomic_store(&slot->in_use, 0);
+}
+
+static void make_slot_key(void) {
+    (void)pthread_key_create(&g_slot_key, slot_release);
+}
+
+static epoch_slot *slot_get(void) {
+    epoch_slot *slot;
+
+    if (t_slot) {
+        return t_slot;
+    }
+    pthread_once(&g_slot_key_once, make_slot_key);
+
+    for (slot = atomic_load(&g_slots); slot != NULL; slot = slot->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&slot->in_use, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (!slot) {
+        slot = calloc(1, sizeof(*slot));
+        if (!slot) {
+            abort();
+        }
+        atomic_init(&slot->active, 0);
+        atomic_init(&slot->in_use, 1);
+        slot->next = atomic_load(&g_slots);
+        while (!atomic_compare_exchange_weak(&g_slots, &slot->next, slot)) {
+        }
+    }
+
+    t_slot = slot;
+    (void)pthread_setspecific(g_slot_key, slot);
+    return slot;
+}
+
+void epoch_enter(void) {
+    epoch_slot *slot = slot_get();
+
+    // seq_cst so the announcement is visible before the protected load
+    atomic_store(&slot->active, atomic_load(&g_epoch));
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&t_slot->active, 0, memory_order_release);
+}
+
+// Oldest epoch any reader is still inside, or UINT64_MAX when none is
+static uint64_t min_active_epoch(void) {
+    uint64_t min = UINT64_MAX;
+
+    for (epoch_slot *slot = atomic_load(&g_slots); slot != NULL; slot = slot->next) {
+        uint64_t active = atomic_load(&slot->active);
+        if (active != 0 && active < min) {
+            min = active;
+        }
+    }
+    return min;
+}
+
+void epoch_synchronize(void) {
+    uint64_t target = atomic_fetch_add(&g_epoch, 1);
+
+    while (min_active_epoch() <= target) {
+        sched_yield();
+    }
+}
+
+void epoch_retire(void *ptr, epoch_free_fn free_fn) {
+    retired *node;
+    retired *ready = NULL;
+    uint64_t min;
+
+    if (!ptr) {
+        return;
+    }
+
+    node = malloc(sizeof(*node));
+    if (!node) {
+        epoch_synchronize();
+        free_fn(ptr);
+        return;
+    }
+
+    /*
+     * A reader that saw ptr announced an epoch no later than this one,
+     * because it read g_epoch before loading the pointer we just replaced.
+     */
+    node->ptr = ptr;
+    node->free_fn = free_fn;
+    node->epoch = atomic_fetch_add(&g_epoch, 1);
+
+    pthread_mutex_lock(&g_retired_mutex);
+    node->next = g_retired;
+    g_retired = node;
+
+    min = min_active_epoch();
+    for (retired **link = &g_retired; *link != NULL;) {
+        retired *curr = *link;
+        if (curr->epoch < min) {
+            *link = curr->next;
+            curr->next = ready;
+            ready = curr;
+        } else {
+            link = &curr->next;
+        }
+    }
+    pthread_mutex_unlock(&g_retired_mutex);
+
+    while (ready) {
+        retired *next = ready->next;
+        ready->free_fn(ready->ptr);
+        free(ready);
+        ready = next;
+    }
+}
@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "../libs/event_loop.h"
+
+#define EVENT_BATCH_MAX 64
+
+struct event_loop {
+    int epoll_fd;
+    pthread_t thread;
+    event_deferred *deferred;   // only touched by the loop's own thread
+
+    // Work handed over by other threads, announced through wake_fd
+    pthread_mutex_t posted_mutex;
+    event_deferred *posted;
+    event_watch wake_watch;
+};
+
+static event_loop *g_loops = NULL;
+static size_t g_loop_count = 0;
+static atomic_size_t g_next_loop = 0;
+
+static void run_deferred(event_loop *loop) {
+    while (loop->deferred) {
+        event_deferred *work = loop->deferred;
+
+        loop->deferred = work->next;
+        work->fn(work->ctx);
+    }
+}
+
+// Moves work posted by other threads over to the loop's own deferred list
+static void on_wake(void *ctx, uint32_t events) {
+    event_loop *loop = ctx;
+    uint64_t count;
+    event_deferred *posted;
+
+    (void)events;
+    (void)read(loop->wake_watch.fd, &count, sizeof(count));
+
+    pthread_mutex_lock(&loop->posted_mutex);
+    posted = loop->posted;
+    loop->posted = NULL;
+    pthread_mutex_unlock(&loop->posted_mutex);
+
+    while (posted) {
+        event_deferred *next = posted->next;
+
+        event_loop_defer(loop, posted);
+        posted = next;
+    }
+}
+
+static void *event_loop_main(void *arg) {
+    event_loop *loop = arg;
+    struct epoll_event events[EVENT_BATCH_MAX];
+
+    while (1) {
+        int ready = epoll_wait(loop->epoll_fd, events, EVENT_BATCH_MAX, -1);
+
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return NULL;
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            event_watch *watch = events[i].data.ptr;
+            watch->handler(watch->ctx, events[i].events);
+        }
+        run_deferred(loop);
+    }
+}
+
+int event_loop_pool_start(size_t count) {
+    if (count == 0 || g_loops) {
+        return -1;
+    }
+
+    g_loops = calloc(count, sizeof(*g_loops));
+    if (!g_loops) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        event_loop *loop = &g_loops[i];
+
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            return -1;
+        }
+        pthread_mutex_init(&loop->posted_mutex, NULL);
+        loop->wake_watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop->wake_watch.handler = on_wake;
+        loop->wake_watch.ctx = loop;
+        if (loop->wake_watch.fd < 0 || event_loop_add(loop, &loop->wake_watch, EPOLLIN) != 0) {
+            return -1;
+        }
+        if (pthread_create(&loop->thread, NULL, event_loop_main, loop) != 0) {
+            return -1;
+        }
+        pthread_detach(loop->thread);
+        g_loop_count++;
+    }
+
+    return 0;
+}
+
+event_loop *event_loop_pick(void) {
+    if (g_loop_count == 0) {
+        return NULL;
+    }
+    return &g_loops[atomic_fetch_add(&g_next_loop, 1) % g_loop_count];
+}
+
+int event_loop_add(event_loop *loop, event_watch *watch, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = watch};
+
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watch->fd, &ev);
+}
+
+int event_loop_modify(event_loop *loop, event_watch *watch, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = watch};
+
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev);
+}
+
+void event_loop_remove(event_loop *loop, event_watch *watch) {
+    (void)epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+void event_loop_defer(event_loop *loop, event_deferred *work) {
+    work->next = loop->deferred;
+    loop->deferred = work;
+}
+
+void event_loop_post(event_loop *loop, event_deferred *work) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->posted_mutex);
+    work->next = loop->posted;
+    loop->posted = work;
+    pthread_mutex_unlock(&loop->posted_mutex);
+    (void)write(loop->wake_watch.fd, &one, sizeof(one));
+}
@@ -0,0 +1,194 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libs/frame_io.h"
+#include "../libs/shm_ring.h"
+
+void frame_reader_init(frame_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->ring = NULL;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+size_t frame_buffered(const frame_reader *reader) {
+    return reader->end - reader->start;
+}
+
+ssize_t frame_fill(frame_reader *reader) {
+    ssize_t rc;
+
+    // Move the unread tail to the front so each read() gets as much room as possible
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == sizeof(reader->buf)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (reader->ring) {
+        rc = shm_ring_read(reader->ring, reader->buf + reader->end,
+                           sizeof(reader->buf) - reader->end);
+    } else {
+        rc = read(reader->fd, reader->buf + reader->end, sizeof(reader->buf) - reader->end);
+    }
+    if (rc > 0) {
+        reader->end += (size_t)rc;
+    }
+    return rc;
+}
+
+size_t frame_next_line(frame_reader *reader, char *line, size_t capacity) {
+    size_t avail = frame_buffered(reader);
+    size_t scan = avail < capacity - 1 ? avail : capacity - 1;
+    char *newline = memchr(reader->buf + reader->start, '\n', scan);
+    size_t len;
+
+    if (newline) {
+        len = (size_t)(newline - (reader->buf + reader->start)) + 1;
+    } else if (avail >= capacity - 1) {
+        len = capacity - 1;
+    } else {
+        return 0;
+    }
+
+    memcpy(line, reader->buf + reader->start, len);
+    line[len] = '\0';
+    reader->start += len;
+    return len;
+}
+
+size_t frame_take(frame_reader *reader, void *buf, size_t count) {
+    size_t avail = frame_buffered(reader);
+    size_t len = count < avail ? count : avail;
+
+    memcpy(buf, reader->buf + reader->start, len);
+    reader->start += len;
+    return len;
+}
+
+ssize_t frame_read_line(frame_reader *reader, char *line, size_t capacity) {
+    if (capacity < 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (1) {
+        size_t len = frame_next_line(reader, line, capacity);
+        ssize_t rc;
+
+        if (len > 0) {
+            return (ssize_t)len;
+        }
+
+        rc = frame_fill(reader);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            // A last line without '\n' is still handed out
+            len = frame_take(reader, line, capacity - 1);
+            line[len] = '\0';
+            return (ssize_t)len;
+        }
+    }
+}
+
+ssize_t frame_read_exact(frame_reader *reader, void *buf, size_t count) {
+    size_t got = frame_take(reader, buf, count);
+    ssize_t rc;
+
+    if (got == count) {
+        return (ssize_t)count;
+    }
+
+    if (reader->ring) {
+        while (got < count) {
+            rc = shm_ring_read(reader->ring, (char *)buf + got, count - got);
+            if (rc <= 0) {
+                return rc;
+            }
+            got += (size_t)rc;
+        }
+        return (ssize_t)count;
+    }
+
+    rc = read_full(reader->fd, (char *)buf + got, count - got);
+    if (rc <= 0) {
+        return rc;
+    }
+    return (ssize_t)count;
+}
+
+ssize_t write_full(int fd, const void *buf, size_t count) {
+    const char *cursor = (const char *)buf;
+    size_t written = 0;
+
+    while (written < count) {
+        ssize_t rc = write(fd, cursor + written, count - written);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += (size_t)rc;
+    }
+
+    return (ssize_t)written;
+}
+
+ssize_t read_full(int fd, void *buf, size_t count) {
+    char *cursor = (char *)buf;
+    size_t total = 0;
+
+    while (total < count) {
+        ssize_t rc = read(fd, cursor + total, count - total);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            return 0;
+        }
+        total += (size_t)rc;
+    }
+
+    return (ssize_t)total;
+}
+
+// A new or renamed file is only durable once its directory entry is
+int sync_parent_dir(const char *path) {
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    int fd;
+    int rc;
+
+    if (slash == path) {
+        snprintf(dir, sizeof(dir), "/");
+    } else if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    fd = open(dir, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
@@ -5,12 +5,10 @@
 #include <sys/types.h>
 
 
-static edit *edit_queue = NULL;
-static char *shared_flat = NULL;
-static char *base_flat = NULL; 
-static uint64_t flat_version = (uint64_t)(-1); 
 #define SUCCESS 0 
 
+static void piece_release(piece *p);
+
 
 // === Init and Free ===
 
@@ -19,30 +17,53 @@ document *markdown_init(void) {
     if (new_doc == NULL) {
         return NULL;
     }
-    new_doc->head = NULL;
-    new_doc->staged_head = NULL;
+    new_doc->root = NULL;
+    new_doc->kept = NULL;
+    new_doc->kept_cap = 0;
+    new_doc->seed = 2463534242u;
+    new_doc->original = "";
+    new_doc->original_len = 0;
+    new_doc->add_buffer = NULL;
+    new_doc->length = 0;
     new_doc->version = 0;
+    new_doc->staging.queue = NULL;
+    new_doc->staging.shared_flat = NULL;
+    new_doc->staging.base_flat = NULL;
+    new_doc->staging.flat_version = UINT64_MAX;
+    new_doc->on_commit = NULL;
+    new_doc->on_commit_ctx = NULL;
     return new_doc;
 }
 
+// Helper: drop every staged edit
+static void clear_edit_queue(edit_context *ctx) {
+    while (ctx->queue) {
+        edit *next = ctx->queue->next;
+        if (ctx->queue->text) free(ctx->queue->text);
+        free(ctx->queue);
+        ctx->queue = next;
+    }
+}
+
 void markdown_free(document *doc) {
     if (!doc) return;
 
-    chunk *curr = doc->head;
-    while (curr){
-        chunk *next = curr->next;
-        free(curr->text);
-        free(curr);
-        curr = next;
+    clear_edit_queue(&doc->staging);
+    free(doc->staging.shared_flat);
+    free(doc->staging.base_flat);
+
+    // Pieces only borrow their text, the add buffer owns it
+    piece_release(doc->root);
+    for (size_t i = 0; i < doc->kept_cap; i++) {
+        piece_release(doc->kept[i].root);
     }
+    free(doc->kept);
 
-    //Traverse through staged_head and free 
-    curr = doc->staged_head;
-    while (curr) {
-        chunk *next = curr->next;
-        free(curr->text);
-        free(curr);
-        curr = next;
+    add_block *block = doc->add_buffer;
+    while (block) {
+        add_block *next = block->next;
+        free(block);
+        block = next;
     }
 
     free(doc);
@@ -71,150 +92,350 @@ char *strndup_safe(const char *s, size_t n) {
 
 
 
-//Helper function: create deep copy of chunks
-chunk *deep_copy_chunks(chunk *head) {
-    if (!head) {
-        // Create a dummy empty chunk
-        chunk *empty = malloc(sizeof(chunk));
-        if (!empty) return NULL;
-        empty->text = strdup_safe("");
-        if (!empty->text) {
-            free(empty);
-            return NULL;
-        }
-        empty->next = NULL;
-        return empty;
+// === Piece table ===
+
+#define ADD_BLOCK_MIN (64 * 1024)
+
+/**
+ * Copies text into the append-only add buffer and returns its stable address.
+ * A new block is only started when the newest one is full, so consecutive
+ * inserts land next to each other and their pieces can be coalesced.
+ */
+static const char *add_buffer_append(document *doc, const char *text, size_t len) {
+    add_block *block = doc->add_buffer;
+
+    if (!block || block->cap - block->used < len) {
+        size_t cap = len > ADD_BLOCK_MIN ? len : ADD_BLOCK_MIN;
+        block = malloc(sizeof(add_block) + cap);
+        if (!block) return NULL;
+        block->used = 0;
+        block->cap = cap;
+        block->next = doc->add_buffer;
+        doc->add_buffer = block;
     }
 
-    chunk *new_head = malloc(sizeof(chunk));
-    if (!new_head) return NULL;
+    char *dest = block->data + block->used;
+    memcpy(dest, text, len);
+    block->used += len;
+    return dest;
+}
+
+/*
+ * Piece trees are used by value: every function below takes over the
+ * reference it is passed to a tree and hands back a reference to the tree
+ * it made. A node is only changed in place while that reference is the
+ * only one to it, anything shared is copied first. On failure a function
+ * has released what it was given, so the caller's tree is simply gone and
+ * the committed version it came from is untouched.
+ */
+
+static size_t piece_total(const piece *p) {
+    return p ? p->total : 0;
+}
+
+static void piece_update(piece *p) {
+    p->total = piece_total(p->left) + p->len + piece_total(p->right);
+}
+
+static piece *piece_new(document *doc, const char *text, size_t len) {
+    piece *p = malloc(sizeof(piece));
+    if (!p) return NULL;
+
+    // xorshift32
+    doc->seed ^= doc->seed << 13;
+    doc->seed ^= doc->seed >> 17;
+    doc->seed ^= doc->seed << 5;
+
+    p->text = text;
+    p->len = len;
+    p->total = len;
+    p->priority = doc->seed;
+    p->refs = 1;
+    p->left = NULL;
+    p->right = NULL;
+    return p;
+}
+
+static piece *piece_ref(piece *p) {
+    if (p) p->refs++;
+    return p;
+}
 
-    //copy content from head into new_head 
-    new_head->text = strdup_safe(head->text);
-    if (!new_head->text) {
-        free(new_head);
+static void piece_release(piece *p) {
+    if (!p || --p->refs > 0) return;
+    piece_release(p->left);
+    piece_release(p->right);
+    free(p);
+}
+
+// Returns a node the caller may change: p itself if nobody else has it, else a copy
+static piece *piece_own(piece *p) {
+    if (p->refs == 1) return p;
+
+    piece *copy = malloc(sizeof(piece));
+    if (!copy) {
+        piece_release(p);
         return NULL;
     }
+    *copy = *p;
+    copy->refs = 1;
+    piece_ref(copy->left);
+    piece_ref(copy->right);
+    p->refs--;
+    return copy;
+}
 
-    new_head->next = deep_copy_chunks(head->next);
-    return new_head;
+// Splits t into the text before "pos" and the rest, cutting at most one piece in two
+static int piece_split(document *doc, piece *t, size_t pos, piece **l, piece **r) {
+    *l = NULL;
+    *r = NULL;
+    if (!t) return 0;
+    if (pos == 0) {
+        *r = t;
+        return 0;
+    }
+    if (pos >= t->total) {
+        *l = t;
+        return 0;
+    }
+
+    t = piece_own(t);
+    if (!t) return -1;
+
+    size_t left_len = piece_total(t->left);
+    if (pos <= left_len) {
+        piece *rest;
+        if (piece_split(doc, t->left, pos, l, &rest) != 0) {
+            t->left = NULL;
+            piece_release(t);
+            return -1;
+        }
+        t->left = rest;
+        piece_update(t);
+        *r = t;
+    } else if (pos >= left_len + t->len) {
+        piece *before;
+        if (piece_split(doc, t->right, pos - left_len - t->len, &before, r) != 0) {
+            t->right = NULL;
+            piece_release(t);
+            return -1;
+        }
+        t->right = before;
+        piece_update(t);
+        *l = t;
+    } else {
+        size_t keep = pos - left_len;
+        piece *tail = piece_new(doc, t->text + keep, t->len - keep);
+        if (!tail) {
+            piece_release(t);
+            return -1;
+        }
+        // Both halves keep the priority the node had, so both still fit the heap order
+        tail->priority = t->priority;
+        tail->right = t->right;
+        t->right = NULL;
+        t->len = keep;
+        piece_update(tail);
+        piece_update(t);
+        *l = t;
+        *r = tail;
+    }
+    return 0;
 }
 
+// Concatenates a and b. NULL on failure
+static piece *piece_join(piece *a, piece *b) {
+    if (!a) return b;
+    if (!b) return a;
 
-/*
- * Helper: Ensures that the shared edit buffer shared_flat is initialised
- * for the current version, allowing deferred edits to be staged
- * against a consistent snapshot base_flat of the document.
- */
-void ensure_shared_flat_initialized(document *doc) {
-    if (flat_version == doc->version) {
-        // already initialized for this version
-        return;
+    if (a->priority >= b->priority) {
+        a = piece_own(a);
+        if (!a) {
+            piece_release(b);
+            return NULL;
+        }
+        piece *joined = piece_join(a->right, b);
+        a->right = joined;
+        if (!joined) {
+            piece_release(a);
+            return NULL;
+        }
+        piece_update(a);
+        return a;
     }
-    // Clear previous state
-    if (shared_flat) { free(shared_flat); shared_flat = NULL; }
-    if (base_flat)   { free(base_flat);   base_flat = NULL; }
-
-    base_flat = markdown_flatten(doc);  // snapshot of committed head
-    if (!base_flat) return;
-
-    shared_flat = strdup_safe(base_flat);
-    if (!shared_flat) return;
-
-    // Rebuild staged_head from shared_flat
-        if (!doc->staged_head) {
-        chunk *new_chunk = malloc(sizeof(chunk));
-        if (!new_chunk) return;
-        new_chunk->text = strdup_safe(shared_flat);
-        if (!new_chunk->text) {
-            free(new_chunk);
-            return;
+
+    b = piece_own(b);
+    if (!b) {
+        piece_release(a);
+        return NULL;
+    }
+    piece *joined = piece_join(a, b->left);
+    b->left = joined;
+    if (!joined) {
+        piece_release(b);
+        return NULL;
+    }
+    piece_update(b);
+    return b;
+}
+
+// Grows the last piece of t by len bytes that follow it in memory. NULL on failure
+static piece *piece_extend_last(piece *t, size_t len) {
+    t = piece_own(t);
+    if (!t) return NULL;
+
+    if (t->right) {
+        t->right = piece_extend_last(t->right, len);
+        if (!t->right) {
+            piece_release(t);
+            return NULL;
         }
-        new_chunk->next = NULL;
-
-        // Free old staged_head (ALWAYS)
-        chunk *curr = doc->staged_head;
-        while (curr) {
-            chunk *next = curr->next;
-            free(curr->text);
-            free(curr);
-            curr = next;
+    } else {
+        t->len += len;
+    }
+    piece_update(t);
+    return t;
+}
+
+static const piece *piece_last(const piece *t) {
+    while (t && t->right) t = t->right;
+    return t;
+}
+
+// Puts stored text in at "pos". Typing lands right after the previous piece's bytes: just grow it
+static piece *piece_insert(document *doc, piece *t, size_t pos, const char *stored, size_t len) {
+    piece *l;
+    piece *r;
+
+    if (piece_split(doc, t, pos, &l, &r) != 0) return NULL;
+
+    const piece *last = piece_last(l);
+    if (last && last->text + last->len == stored) {
+        l = piece_extend_last(l, len);
+    } else {
+        piece *p = piece_new(doc, stored, len);
+        if (!p) {
+            piece_release(l);
+            l = NULL;
+        } else {
+            l = piece_join(l, p);
         }
-        doc->staged_head = new_chunk;
+    }
+    if (!l) {
+        piece_release(r);
+        return NULL;
+    }
+    return piece_join(l, r);
+}
+
+// Cuts len bytes out at "pos"
+static piece *piece_remove(document *doc, piece *t, size_t pos, size_t len) {
+    piece *l;
+    piece *rest;
+    piece *gone;
+    piece *r;
 
+    if (piece_split(doc, t, pos, &l, &rest) != 0) return NULL;
+    if (piece_split(doc, rest, len, &gone, &r) != 0) {
+        piece_release(l);
+        return NULL;
     }
-    flat_version = doc->version;  //update version tracker
-    printf("[DEBUG ensure] base_flat = \"%s\"\n", base_flat);
-    printf("[DEBUG ensure] shared_flat initialized = \"%s\"\n", shared_flat);
+    piece_release(gone);
+    return piece_join(l, r);
 }
 
+static int piece_for_each(const piece *p, markdown_span_fn fn, void *ctx) {
+    if (!p) return 0;
 
-//Helper function to retrieve a string presentation of doc in its staged version
-char *flatten_staged(const document *doc) {
-    if (!doc || !doc->staged_head) return strdup_safe("");
+    int rc = piece_for_each(p->left, fn, ctx);
+    if (rc != 0) return rc;
+    if (p->len > 0) {
+        rc = fn(p->text, p->len, ctx);
+        if (rc != 0) return rc;
+    }
+    return piece_for_each(p->right, fn, ctx);
+}
 
-    return markdown_flatten(doc);
+// Copies the text of p from "pos" on, at most capacity bytes
+static size_t piece_copy(const piece *p, size_t pos, char *buf, size_t capacity) {
+    if (!p || capacity == 0 || pos >= p->total) return 0;
+
+    size_t left_len = piece_total(p->left);
+    size_t copied = 0;
+    if (pos < left_len) {
+        copied = piece_copy(p->left, pos, buf, capacity);
+    }
+    if (copied < capacity && pos < left_len + p->len) {
+        size_t skip = pos > left_len ? pos - left_len : 0;
+        size_t take = p->len - skip;
+        if (take > capacity - copied) take = capacity - copied;
+        memcpy(buf + copied, p->text + skip, take);
+        copied += take;
+    }
+    if (copied < capacity) {
+        size_t right_pos = pos > left_len + p->len ? pos - left_len - p->len : 0;
+        copied += piece_copy(p->right, right_pos, buf + copied, capacity - copied);
+    }
+    return copied;
 }
 
+/*
+ * The loaded text becomes the original buffer: the first piece points
+ * straight at it, so nothing is copied however large it is.
+ */
+document *markdown_load(const char *text, size_t len, uint64_t version) {
+    document *doc = markdown_init();
+    if (!doc) return NULL;
 
-/**
- * Insert directly to the shared_flat string at the position.
- * Used after version increment to update the shared copy of shared_flat with inserted content
- * It rebuilds staged_head based on the modified flat string.
-*/
-int apply_flat_insert(document *doc, size_t pos, const char *content) {
-    if (!doc || !shared_flat || !content) return -1;
-
-    printf("[DEBUG apply_flat_insert] BEFORE insert: shared_flat = \"%s\"\n", shared_flat);
-    printf("[DEBUG apply_flat_insert] inserting \"%s\" at pos %zu\n", content, pos);
-
-    size_t len = strlen(shared_flat);
-    size_t insert_len = strlen(content);
-
-    if (pos > len) {
-        pos = len;
-        printf("%s", "[DEBUG apply_flat_insert] pos > len, FIX RANGE\n");
-    }
-    // Clamp insertion position if it goes beyond current buffer
-    size_t new_len = len + insert_len;
-    char *new_doc = malloc(new_len + 1);
-    if (!new_doc) return -1;
-
-    // copy parts before, content to insert, and parts after into new buffer
-    memcpy(new_doc, shared_flat, pos);
-    memcpy(new_doc + pos, content, insert_len);
-    memcpy(new_doc + pos + insert_len, shared_flat + pos, len - pos);
-    new_doc[new_len] = '\0';
-
-    free(shared_flat);
-    shared_flat = new_doc;
-
-    // Rebuild staged_head, the new chunk contains updated content of shared_flat
-    chunk *new_chunk = malloc(sizeof(chunk));
-    if (!new_chunk) return -1;
-    new_chunk->text = strdup_safe(shared_flat);
-    if (!new_chunk->text) {
-        free(new_chunk);
-        return -1;
+    if (len > 0) {
+        doc->root = piece_new(doc, text, len);
+        if (!doc->root) {
+            markdown_free(doc);
+            return NULL;
+        }
     }
+    doc->original = text;
+    doc->original_len = len;
+    doc->length = len;
+    doc->version = version;
+    return doc;
+}
 
-    printf("[DEBUG apply_flat_insert] AFTER insert: shared_flat = \"%s\"\n", shared_flat);
 
-    new_chunk->next = NULL;
 
-    chunk *curr = doc->staged_head;
-    while (curr) {
-        chunk *next = curr->next;
-        free(curr->text);
-        free(curr);
-        curr = next;
+/*
+ * Helper: Ensures that the document's shared_flat buffer is initialised
+ * for the current version, allowing deferred edits to be staged
+ * against a consistent snapshot base_flat of the document.
+ */
+void ensure_shared_flat_initialized(document *doc) {
+    if (doc->staging.flat_version == doc->version) {
+        // already initialized for this version
+        return;
     }
+    // Clear previous state
+    if (doc->staging.shared_flat) { free(doc->staging.shared_flat); doc->staging.shared_flat = NULL; }
+    if (doc->staging.base_flat)   { free(doc->staging.base_flat);   doc->staging.base_flat = NULL; }
 
-    doc->staged_head = new_chunk;
-    return 0;
+    doc->staging.base_flat = markdown_flatten(doc);  // snapshot of committed head
+    if (!doc->staging.base_flat) return;
+
+    doc->staging.shared_flat = strdup_safe(doc->staging.base_flat);
+    if (!doc->staging.shared_flat) return;
+
+    doc->staging.flat_version = doc->version;  //update version tracker
+    printf("[DEBUG ensure] base_flat = \"%s\"\n", doc->staging.base_flat);
+    printf("[DEBUG ensure] shared_flat initialized = \"%s\"\n", doc->staging.shared_flat);
 }
 
 
+//Helper function to retrieve a string presentation of doc in its staged version
+char *flatten_staged(const document *doc) {
+    if (!doc) return strdup_safe("");
+
+    return markdown_flatten(doc);
+}
+
 
 /**
  * Stages an insert operation in the document at the given version
@@ -232,8 +453,8 @@ int markdown_insert(document *doc, uint64_t version, size_t pos, const char *con
     e->pos = pos;
     e->text = strdup_safe(content);
     e->len = 0;
-    e->next = edit_queue;
-    edit_queue = e;
+    e->next = doc->staging.queue;
+    doc->staging.queue = e;
     return 0;
 }
 
@@ -257,11 +478,6 @@ int markdown_newline(document *doc, size_t version, size_t pos) {
 int markdown_heading(document *doc, uint64_t version, size_t level, size_t pos) {
     if (!doc || doc->version != version || level < 1 || level > 6) return -1;
 
-    if (!doc->staged_head){
-        doc->staged_head = deep_copy_chunks(doc->head);
-        if (!doc->staged_head) return -1;
-    }
-
     char prefix[8]; // max: 6 "#" + 1 space + 1 null terminator 
     memset(prefix, '#', level);
     prefix[level] = ' '; //add space after the '#' level 
@@ -281,11 +497,6 @@ int markdown_heading(document *doc, uint64_t version, size_t level, size_t pos)
 int markdown_bold(document *doc, uint64_t version, size_t start, size_t end) {
     if (!doc || doc->version != version || start >= end) return -1;
 
-    if (!doc->staged_head) {
-        doc->staged_head = deep_copy_chunks(doc->head);
-        if (!doc->staged_head) return -1;
-    }
-
     // Insert "**" at the end first to avoid shifting start position
     if (markdown_insert(doc, version, end, "**") != 0) {
         printf("%s", "make bold text fail");
@@ -317,8 +528,8 @@ int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len) {
     e->pos = pos;
     e->len = len;
     e->text = NULL;
-    e->next = edit_queue;
-    edit_queue = e;
+    e->next = doc->staging.queue;
+    doc->staging.queue = e;
     return 0;
 }
 
@@ -330,13 +541,6 @@ int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len) {
 int markdown_italic(document *doc, uint64_t version, size_t start, size_t end) {
     if (!doc || doc->version != version || start >= end) return -1;
 
-    if (!doc->staged_head){
-        doc->staged_head = deep_copy_chunks(doc->head);
-        if (!doc->staged_head) {
-            printf("%s", "ITALIC: unable to create deep copy of head");
-            return -1;
-        }
-    }
     // Insert "*" at the end first to avoid shifting start position
     if (markdown_insert(doc, version, end, "*") != 0) {
         printf("%s", "ITALIC: unable to italicise");
@@ -357,86 +561,68 @@ int markdown_italic(document *doc, uint64_t version, size_t start, size_t end) {
  *
  * Finds the start of the line containing "pos", remove if there is prefix, 
  * and prepends it with the blockquote "> ". 
- * If not already on a newline, it inserts one before the blockquote.
- * All changes are staged and applied at version increment.
+ * Both edits use positions in the committed text, so the rest of the line
+ * is left where it is. All changes are staged and applied at version increment.
 */
 int markdown_blockquote(document *doc, uint64_t version, size_t pos) {
     if (!doc || doc->version != version) return -1;
 
     ensure_shared_flat_initialized(doc);
-    if (!base_flat) return -1;
+    if (!doc->staging.base_flat) return -1;
 
-    char *flat = strdup_safe(base_flat);
-    if (!flat) return -1;
+    const char *flat = doc->staging.base_flat;
+    size_t flat_len = markdown_length(doc);
+    if (pos > flat_len) pos = flat_len;
 
     size_t line_start = pos;
     while (line_start > 0 && flat[line_start - 1] != '\n') {
         line_start--;
     }
 
-    // Skip teh prefix 
+    // Skip the ordered list prefix
     size_t i = line_start;
-    while (isdigit(flat[i])) i++;
-    if (flat[i] == '.' && flat[i + 1] == ' ') {
+    while (isdigit((unsigned char)flat[i])) i++;
+    if (i > line_start && flat[i] == '.' && flat[i + 1] == ' ') {
         i += 2;
+    } else {
+        i = line_start;
     }
 
-    // Find end of line
-    size_t line_end = i;
-    while (flat[line_end] != '\n' && flat[line_end] != '\0') line_end++;
-
-    size_t delete_len = (flat[line_end] == '\n') ? (line_end - line_start + 1) : (line_end - line_start);
-    char *cleaned = strndup_safe(&flat[i], line_end - i);
-    if (!cleaned) {
-        free(flat);
-        return -1;
-    }
-
-    printf("[DEBUG blockquote] base_flat:\n%s\n", base_flat);
-    printf("[DEBUG blockquote] Found line start: %zu\n", line_start);
-    printf("[DEBUG blockquote] Line content: '%.*s'\n", (int)(line_end - line_start), &flat[line_start]);
-    printf("[DEBUG blockquote] Cleaned content: '%s'\n", cleaned);
-    printf("[DEBUG blockquote] Deleting %zu chars from pos %zu\n", delete_len, line_start);
-
-    if (markdown_delete(doc, version, line_start, delete_len) != 0) {
+    if (i > line_start && markdown_delete(doc, version, line_start, i - line_start) != 0) {
         printf("[DEBUG blockquote] Failed delete\n");
-        free(flat);
-        free(cleaned);
         return -1;
     }
 
-    //inserts newline before the blockquote if it does not have
-    if (line_start != 0 && flat[line_start - 1] != '\n') {
-        if (markdown_insert(doc, version, line_start, "\n") != 0) {
-            printf("[DEBUG blockquote] Failed insert newline before blockquote\n");
-            free(flat);
-            free(cleaned);
-            return -1;
-        }
-        line_start += 1;  // shift right because inserted a char
-    }
-
-    //insert thethe blockquote "> " at the start of the line 
+    //insert the blockquote "> " at the start of the line 
     if (markdown_insert(doc, version, line_start, "> ") != 0) {
         printf("[DEBUG blockquote] Failed insert '> '\n");
-        free(flat);
-        free(cleaned);
         return -1;
     }
 
-    if (markdown_insert(doc, version, line_start + 2, cleaned) != 0) {
-        printf("[DEBUG blockquote] Failed insert cleaned content\n");
-        free(flat);
-        free(cleaned);
-        return -1;
-    }
-
-    free(flat);
-    free(cleaned);
     return SUCCESS;
 }
 
 
+// Looks through committed text for the first '\n' at or after "from"
+typedef struct {
+    size_t from;
+    size_t seen;
+    size_t found;  // just after the newline
+} newline_search;
+
+static int find_newline(const char *text, size_t len, void *ctx) {
+    newline_search *search = ctx;
+    for (size_t i = 0; i < len; ++i) {
+        if (search->seen + i >= search->from && text[i] == '\n') {
+            search->found = search->seen + i + 1;
+            return 1;
+        }
+    }
+    search->seen += len;
+    return 0;
+}
+
+
 /**
  * Converts multiple lines starting at a given position into an ordered list.
  * 
@@ -446,11 +632,6 @@ int markdown_blockquote(document *doc, uint64_t version, size_t pos) {
 int markdown_ordered_list(document *doc, uint64_t version, size_t pos) {
     if (!doc || doc->version != version) return -1;
 
-    if (!doc->staged_head) {
-        doc->staged_head = deep_copy_chunks(doc->head);
-        if (!doc->staged_head) return -1;
-    }
-
     size_t offset = pos;
     int index = 1;
 
@@ -464,23 +645,9 @@ int markdown_ordered_list(document *doc, uint64_t version, size_t pos) {
         offset += strlen(prefix);
 
         // Search for the next newline
-        chunk *curr = doc->staged_head;
-        size_t chars_seen = 0;
-        int found = 0;
-
-        while (curr) {
-            size_t len = strlen(curr->text);
-            for (size_t i = 0; i < len; ++i) {
-                if (chars_seen + i >= offset && curr->text[i] == '\n') {
-                    offset = chars_seen + i + 1;  // after \n
-                    found = 1;
-                    break;
-                }
-            }
-            if (found) break;
-            chars_seen += len;
-            curr = curr->next;
-        }
+        newline_search search = { offset, 0, 0 };
+        int found = piece_for_each(doc->root, find_newline, &search) == 1;
+        if (found) offset = search.found;
 
         if (!found) break;
         index++;
@@ -501,16 +668,10 @@ int markdown_ordered_list(document *doc, uint64_t version, size_t pos) {
 int markdown_unordered_list(document *doc, uint64_t version, size_t pos) {
     if (!doc || doc->version != version) return -1;
 
-    //copy the head chunk into staged_head
-    if (!doc->staged_head) {
-        doc->staged_head = deep_copy_chunks(doc->head);
-        if (!doc->staged_head) return -1;
-    }
-
     char *str_flat = flatten_staged(doc);
     if (!str_flat) return -1;
 
-    size_t len = strlen(str_flat);
+    size_t len = markdown_length(doc);
     size_t shift = 0;
 
     printf("staged content before list formatting: \n%s\n", str_flat);
@@ -562,10 +723,6 @@ int markdown_code(document *doc, uint64_t version, size_t start, size_t end) {
         return -1;
     }
 
-    if (!doc->staged_head) {
-        doc->staged_head = deep_copy_chunks(doc->head);
-        if (!doc->staged_head) return -1;
-    }
 
     // Insert opening backtick first to prevent shifting
     if (markdown_insert(doc, version, end, "`") != 0) {
@@ -591,10 +748,11 @@ int markdown_horizontal_rule(document *doc, uint64_t version, size_t pos) {
     if (!doc || doc->version != version) return -1;
 
     ensure_shared_flat_initialized(doc);
-    size_t len = strlen(shared_flat);
+    if (!doc->staging.shared_flat) return -1;
+    size_t len = markdown_length(doc);
 
     // Insert newline before if not at start of line
-    if (pos > 0 && shared_flat[pos - 1] != '\n') {
+    if (pos > 0 && doc->staging.shared_flat[pos - 1] != '\n') {
         if (markdown_insert(doc, version, pos, "\n") != 0) return -1;
         pos++; // adjust position for next insert
     }
@@ -604,7 +762,7 @@ int markdown_horizontal_rule(document *doc, uint64_t version, size_t pos) {
     pos += 3;
 
     // Insert newline after if not already present
-    if (pos >= len || shared_flat[pos] != '\n') {
+    if (pos >= len || doc->staging.shared_flat[pos] != '\n') {
         if (markdown_insert(doc, version, pos, "\n") != 0) return -1;
     }
 
@@ -620,9 +778,9 @@ int markdown_link(document *doc, uint64_t version, size_t start, size_t end, con
     if (!doc || doc->version != version || start >= end || !url) return -1;
 
     ensure_shared_flat_initialized(doc);
-    if (!shared_flat) return -1;
+    if (!doc->staging.shared_flat) return -1;
 
-    char *flat = strdup_safe(shared_flat);
+    char *flat = strdup_safe(doc->staging.shared_flat);
     if (!flat) return -1;
 
     printf("[DEBUG link] shared_flat before insert: \"%s\"\n", flat);
@@ -653,33 +811,62 @@ int markdown_link(document *doc, uint64_t version, size_t start, size_t end, con
 
 
 // === Utilities ===
+static int print_span(const char *text, size_t len, void *ctx) {
+    return fwrite(text, 1, len, (FILE *)ctx) == len ? 0 : -1;
+}
+
 void markdown_print(const document *doc, FILE *stream) {
-    (void)doc; (void)stream;
+    if (!doc || !stream) return;
+    (void)markdown_for_each_span(doc, print_span, stream);
+}
+
+
+// Length of the committed version, kept up to date by every commit
+size_t markdown_length(const document *doc) {
+    return doc ? doc->length : 0;
+}
+
+
+/**
+ * Walks the committed version piece by piece without building a flat copy.
+ * Returns 0 once every piece was visited, or the first non-zero value
+ * returned by "fn".
+ */
+int markdown_for_each_span(const document *doc, markdown_span_fn fn, void *ctx) {
+    if (!doc || !fn) return -1;
+
+    return piece_for_each(doc->root, fn, ctx);
+}
+
+
+/**
+ * Copies committed text starting at "pos" into a caller owned buffer.
+ * At most "capacity" bytes are copied and no NUL terminator is added.
+ * Returns the number of bytes copied.
+ */
+size_t markdown_copy(const document *doc, size_t pos, char *buf, size_t capacity) {
+    if (!doc || !buf) return 0;
+
+    return piece_copy(doc->root, pos, buf, capacity);
 }
 
 
 /**
  * Flattens the committed version of the document into a single string.
  *
- * Traverses the linked list of chunks in the "head" field and concatenates
- * contents into a new allocated string. Used for generating output or 
+ * The result is allocated once at the exact size, using the running length,
+ * and filled by copying each piece. Used for generating output or 
  * computing positions for future edits. This function reflects the committed state.
+ * Callers that only stream the text should use markdown_for_each_span instead.
  */
 char *markdown_flatten(const document *doc) {
-    if (!doc || !doc->head) return strdup_safe("");
-
-    size_t total_len = 0;
-    for (chunk *curr = doc->head; curr != NULL; curr = curr->next){
-        total_len += strlen(curr->text);
-    }
+    if (!doc) return strdup_safe("");
 
-    char *res = malloc(total_len + 1);
+    char *res = malloc(doc->length + 1);
     if (!res) return NULL;
-    res[0] = '\0';
 
-    for (chunk *curr = doc->head; curr != NULL; curr = curr->next){
-        strcat(res, curr->text);
-    }
+    size_t copied = markdown_copy(doc, 0, res, doc->length);
+    res[copied] = '\0';
 
     return res;
 }
@@ -687,144 +874,300 @@ char *markdown_flatten(const document *doc) {
 
 
 // === Versioning ===
-/**
- * Comparator used to sort insert edits in ascending position order.
- * Used when applying edits in a consistent order, ensures that earlier 
- * insertions are applied first to maintain semantic correctness.
- */
-int compare_insert(const void *a, const void *b) {
-    const edit *ea = *(const edit **)a;
-    const edit *eb = *(const edit **)b;
-    return (int)(ea->pos - eb->pos);
-}
+
+// An edit tagged with its place in the staging queue, so the sort below is stable
+typedef struct {
+    edit *e;
+    size_t order;
+} queued_edit;
 
 /**
- * Comparator used to sort delete edits in descending position order.
- * Reversing the delete order ensures that subsequent deletes don't shift the
- * positions of earlier ones, which would corrupt range of edits.
+ * Comparator used to sort the staged edits by their position in the committed
+ * text. Edits at the same position keep their queue order (newest first),
+ * which lets formatting helpers stack several inserts at one position.
  */
-int compare_delete(const void *a, const void *b) {
-    const edit *ea = *(const edit **)a;
-    const edit *eb = *(const edit **)b;
-    return (int)(eb->pos - ea->pos);  // reverse order
+int compare_edit_order(const void *a, const void *b) {
+    const queued_edit *qa = (const queued_edit *)a;
+    const queued_edit *qb = (const queued_edit *)b;
+    if (qa->e->pos != qb->e->pos) return qa->e->pos < qb->e->pos ? -1 : 1;
+    if (qa->order != qb->order) return qa->order < qb->order ? -1 : 1;
+    return 0;
 }
 
 // Helper: count edits
-static int count_edits(edit *e) {
-    int count = 0;
+static size_t count_edits(edit *e) {
+    size_t count = 0;
     while (e) { count++; e = e->next; }
     return count;
 }
 
+// Retained root of "version", or NULL with *found = 0 if it isn't kept
+static piece *kept_root(const document *doc, uint64_t version, int *found) {
+    *found = 1;
+    if (version == doc->version) return doc->root;
+    // An empty slot says UINT64_MAX, which is never a kept version
+    if (version > doc->version) {
+        *found = 0;
+        return NULL;
+    }
+    if (doc->kept_cap > 0) {
+        const kept_version *slot = &doc->kept[version % doc->kept_cap];
+        if (slot->version == version) return slot->root;
+    }
+    *found = 0;
+    return NULL;
+}
+
+/*
+ * Makes root the committed version: the next version number, retained if
+ * history is on. If the commit hook refuses it, everything is put back as
+ * it was and -1 returned. Takes over the reference to root either way.
+ */
+static int commit_root(document *doc, piece *root, const change *changes, size_t count) {
+    piece *old_root = doc->root;
+    size_t old_length = doc->length;
+    kept_version *slot = NULL;
+    kept_version evicted = { UINT64_MAX, NULL };
+
+    doc->root = root;
+    doc->length = piece_total(root);
+    doc->version++;
+
+    if (doc->kept_cap > 0) {
+        // The slot held the version that just fell out of the history
+        slot = &doc->kept[doc->version % doc->kept_cap];
+        evicted = *slot;
+        slot->version = doc->version;
+        slot->root = piece_ref(root);
+    }
+
+    if (doc->on_commit && doc->on_commit(doc, changes, count, doc->on_commit_ctx) != 0) {
+        if (slot) {
+            piece_release(slot->root);
+            *slot = evicted;
+        }
+        doc->root = old_root;
+        doc->length = old_length;
+        doc->version--;
+        piece_release(root);
+        return -1;
+    }
+
+    piece_release(old_root);
+    piece_release(evicted.root);
+    return 0;
+}
+
 
 /*
  * Commits all staged edits into the document.
- * First applies deletions in reverse order.
- * Then applies insertions in ascending order, adjusting for offset.
- * Updates head and resets the staging buffer and edit queue.
+ *
+ * Every staged position refers to the committed text the edit was staged
+ * against. The staging queue is sorted once and applied in that order to a
+ * new version of the piece tree, so a commit of k edits costs
+ * O(k log pieces + k log k) and the previous version stays intact. The
+ * positions are made consistent on the way: anything past the end is
+ * clamped to the end, overlapping deletes are merged and an insert inside
+ * a deleted range lands where that range was. If memory runs out halfway,
+ * or the commit hook refuses the commit, nothing is committed and the
+ * edits stay staged.
  */
 void markdown_increment_version(document *doc) {
     if (!doc) return;
 
     printf("INC_VERSION: Committing staged to head\n");
 
-    // Snapshot the current commited state
-    if (base_flat) free(base_flat);
-    base_flat = markdown_flatten(doc);
-    if (!base_flat) return;
-
-    // Prepare the flat representation to apply edits on
-    if (shared_flat) free(shared_flat);
-    shared_flat = strdup_safe(base_flat);
-
-    // Apply deletes in reverse order
-    edit *curr = edit_queue;
-    while (curr) {
-        if (curr->type == EDIT_DELETE) {
-            size_t total_len = strlen(shared_flat);
-            if (curr->pos >= total_len) {
-                curr = curr->next;
-                continue;
-            }
+    size_t n = count_edits(doc->staging.queue);
+    queued_edit *sorted = n > 0 ? malloc(n * sizeof(queued_edit)) : NULL;
+    if (n > 0 && !sorted) return;  // keep the queue staged, nothing is lost
 
-            //calculate length to prevent overflow
-            size_t actual_len = curr->len;
-            if (curr->pos + actual_len > total_len)
-                actual_len = total_len - curr->pos;
-
-            //delete using memmove
-            memmove(shared_flat + curr->pos, shared_flat + curr->pos + actual_len, total_len - curr->pos - actual_len + 1);
-        }
-        curr = curr->next;
-    }
-
-    // Collect inserts into array
-    int n = count_edits(edit_queue);
-    edit **insert_edits = malloc(n * sizeof(edit*));
-    int idx = 0;
-    curr = edit_queue;
-    while (curr) {
-        if (curr->type == EDIT_INSERT)
-            insert_edits[idx++] = curr;
-        curr = curr->next;
-    }
-
-    // Sort insert_edits by position 
-    for (int i = 0; i < idx - 1; i++) {
-        for (int j = i + 1; j < idx; j++) {
-            if (insert_edits[i]->pos > insert_edits[j]->pos) {
-                edit *tmp = insert_edits[i];
-                insert_edits[i] = insert_edits[j];
-                insert_edits[j] = tmp;
+    size_t idx = 0;
+    for (edit *curr = doc->staging.queue; curr; curr = curr->next) {
+        sorted[idx].e = curr;
+        sorted[idx].order = idx;
+        idx++;
+    }
+    if (n > 1) qsort(sorted, n, sizeof(queued_edit), compare_edit_order);
+
+    // What actually happened is only recorded when someone listens for it
+    change *changes = doc->on_commit ? malloc((n > 0 ? n : 1) * sizeof(change)) : NULL;
+    size_t change_count = 0;
+
+    /*
+     * "at" walks the version the edits were staged against, it only moves
+     * forward. The same place in the new tree lies "added - removed" further.
+     */
+    piece *root = piece_ref(doc->root);
+    size_t old_len = doc->length;
+    size_t at = 0;
+    size_t added = 0;
+    size_t removed = 0;
+    int failed = 0;
+    for (size_t i = 0; i < n && !failed; i++) {
+        edit *e = sorted[i].e;
+
+        if (e->pos > at) at = e->pos < old_len ? e->pos : old_len;
+
+        if (e->type == EDIT_INSERT) {
+            size_t len = strlen(e->text);
+            if (len == 0) continue;
+
+            const char *stored = add_buffer_append(doc, e->text, len);
+            if (!stored) {
+                failed = 1;
+                break;
             }
+            root = piece_insert(doc, root, at + added - removed, stored, len);
+            added += len;
+            failed = !root;
+            if (changes) {
+                changes[change_count++] = (change){ EDIT_INSERT, at, len, stored };
+            }
+        } else {
+            // Overlaps with an earlier delete only remove what is left
+            size_t end = e->pos + e->len < e->pos ? SIZE_MAX : e->pos + e->len;
+            if (end > old_len) end = old_len;
+            if (end <= at) continue;
+
+            root = piece_remove(doc, root, at + added - removed, end - at);
+            removed += end - at;
+            // Only a tree with text left can't be empty
+            failed = !root && old_len + added - removed > 0;
+            if (changes) {
+                changes[change_count++] = (change){ EDIT_DELETE, at, end - at, NULL };
+            }
+            at = end;
         }
     }
 
-    // Apply insertions with shifting offset
-    size_t offset = 0;
-    for (int i = 0; i < idx; i++) {
-        edit *e = insert_edits[i];
-        size_t insert_len = strlen(e->text);
-        size_t old_len = strlen(shared_flat);
+    free(sorted);
 
-        // Clamp position to prevent writing past end
-        if (e->pos + offset > old_len) e->pos = old_len - offset;
+    if (failed) {
+        piece_release(root);
+        free(changes);
+        return;
+    }
 
-        // allocate new buffer for result
-        char *new_flat = malloc(old_len + insert_len + 1);
-        memcpy(new_flat, shared_flat, e->pos + offset);
-        memcpy(new_flat + e->pos + offset, e->text, insert_len);
-        strcpy(new_flat + e->pos + offset + insert_len, shared_flat + e->pos + offset);
-        free(shared_flat);
-        shared_flat = new_flat;
-        offset += insert_len;
+    if (commit_root(doc, root, changes, change_count) == 0) {
+        clear_edit_queue(&doc->staging);
     }
+    free(changes);
+}
 
-    free(insert_edits);
 
-    // Rebuild committed document - head
-    chunk *new_chunk = malloc(sizeof(chunk));
-    new_chunk->text = strdup_safe(shared_flat);
-    new_chunk->next = NULL;
+/**
+ * Keeps the latest "versions" committed versions readable, the current one
+ * included. Each one only costs the nodes its commit copied. Versions that
+ * no longer fit are dropped, newer ones are kept. Returns -1 on allocation
+ * failure, leaving the history as it was.
+ */
+int markdown_set_history(document *doc, size_t versions) {
+    if (!doc) return -1;
+
+    kept_version *slots = NULL;
+    if (versions > 0) {
+        slots = malloc(versions * sizeof(kept_version));
+        if (!slots) return -1;
+        for (size_t i = 0; i < versions; i++) {
+            slots[i] = (kept_version){ UINT64_MAX, NULL };
+        }
+    }
 
-    chunk *old = doc->head;
-    while (old) {
-        chunk *next = old->next;
-        free(old->text);
-        free(old);
-        old = next;
+    for (size_t i = 0; i < doc->kept_cap; i++) {
+        kept_version *old = &doc->kept[i];
+        if (old->version != UINT64_MAX && doc->version - old->version < versions) {
+            slots[old->version % versions] = *old;
+        } else {
+            piece_release(old->root);
+        }
     }
-    doc->head = new_chunk;
+    free(doc->kept);
+    doc->kept = slots;
+    doc->kept_cap = versions;
 
-    // Clear edit queue
-    while (edit_queue) {
-        edit *next = edit_queue->next;
-        if (edit_queue->text) free(edit_queue->text);
-        free(edit_queue);
-        edit_queue = next;
+    if (versions > 0 && slots[doc->version % versions].version != doc->version) {
+        slots[doc->version % versions] = (kept_version){ doc->version, piece_ref(doc->root) };
     }
+    return 0;
+}
 
-    doc->version++;
+
+// Walks the text of a retained version like markdown_for_each_span. -1 if it isn't kept
+int markdown_for_each_span_at(const document *doc, uint64_t version,
+                              markdown_span_fn fn, void *ctx) {
+    if (!doc || !fn) return -1;
+
+    int found;
+    const piece *root = kept_root(doc, version, &found);
+    if (!found) return -1;
+    return piece_for_each(root, fn, ctx);
+}
+
+
+// Length of a retained version. -1 if it isn't kept
+int markdown_length_at(const document *doc, uint64_t version, size_t *len_out) {
+    if (!doc) return -1;
+
+    int found;
+    const piece *root = kept_root(doc, version, &found);
+    if (!found) return -1;
+    *len_out = piece_total(root);
+    return 0;
+}
+
+
+/**
+ * Commits a new version with the text of the retained "version": undo in
+ * O(1), the new version shares that version's tree. The commit hook gets
+ * NULL changes since nothing says how the two trees differ. Fails if the
+ * version isn't kept, edits are staged or the hook refuses the commit.
+ */
+int markdown_revert(document *doc, uint64_t version) {
+    if (!doc || doc->staging.queue) return -1;
+
+    int found;
+    piece *root = kept_root(doc, version, &found);
+    if (!found) return -1;
+
+    return commit_root(doc, piece_ref(root), NULL, 0);
+}
+
+
+size_t markdown_staged_count(const document *doc) {
+    return doc ? count_edits(doc->staging.queue) : 0;
+}
+
+/**
+ * Throws away the newest staged edits without committing them, so a group
+ * of commands that fails halfway leaves nothing behind for the next commit
+ * while edits staged before it (keep = markdown_staged_count() taken
+ * before the group) stay queued.
+ */
+void markdown_discard_staged(document *doc, size_t keep) {
+    if (!doc) return;
+
+    size_t count = count_edits(doc->staging.queue);
+    while (count > keep) {
+        edit *newest = doc->staging.queue;
+        doc->staging.queue = newest->next;
+        free(newest->text);
+        free(newest);
+        count--;
+    }
+}
+
+
+/**
+ * Registers a function that is told about every commit of "doc". It runs
+ * inside markdown_increment_version, under whatever lock the caller holds,
+ * with the changes of that commit, or with NULL if they could not be
+ * recorded. A hook that returns non-zero refuses the commit: the document
+ * stays at the version before. Pass NULL as the hook to remove it.
+ */
+void markdown_set_commit_hook(document *doc, commit_hook_fn hook, void *ctx) {
+    if (!doc) return;
+    doc->on_commit = hook;
+    doc->on_commit_ctx = ctx;
 }
 
 
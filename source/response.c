@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../libs/response.h"
+#include "../libs/shm_ring.h"
+
+shared_buf *shared_buf_new(size_t len) {
+    shared_buf *buf = malloc(sizeof(shared_buf) + len);
+
+    if (!buf) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    buf->data = buf->bytes;
+    return buf;
+}
+
+shared_buf *shared_buf_wrap(const char *data, size_t len) {
+    shared_buf *buf = malloc(sizeof(shared_buf));
+
+    if (!buf) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    buf->data = (char *)data;
+    return buf;
+}
+
+shared_buf *shared_buf_ref(shared_buf *buf) {
+    if (buf) {
+        atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    }
+    return buf;
+}
+
+void shared_buf_release(shared_buf *buf) {
+    if (buf && atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+        free(buf);
+    }
+}
+
+int response_format(response *resp, shared_buf *body, const char *fmt, ...) {
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(resp->head, sizeof(resp->head), fmt, args);
+    va_end(args);
+
+    resp->body = body;
+    if (len < 0 || (size_t)len >= sizeof(resp->head)) {
+        resp->head_len = 0;
+        return -1;
+    }
+    resp->head_len = (size_t)len;
+    return 0;
+}
+
+int response_set_head(response *resp, shared_buf *body, const void *head, size_t len) {
+    resp->body = body;
+    if (len > sizeof(resp->head)) {
+        resp->head_len = 0;
+        return -1;
+    }
+    memcpy(resp->head, head, len);
+    resp->head_len = len;
+    return 0;
+}
+
+void outq_init(outbound_queue *queue) {
+    queue->first = 0;
+    queue->count = 0;
+    queue->sent = 0;
+}
+
+int outq_push(outbound_queue *queue, response *resp) {
+    if (queue->count == OUTBOUND_QUEUE_MAX) {
+        shared_buf_release(resp->body);
+        resp->body = NULL;
+        return -1;
+    }
+
+    queue->items[(queue->first + queue->count) % OUTBOUND_QUEUE_MAX] = *resp;
+    queue->count++;
+    resp->body = NULL;
+    return 0;
+}
+
+static void outq_pop(outbound_queue *queue) {
+    shared_buf_release(queue->items[queue->first].body);
+    queue->first = (queue->first + 1) % OUTBOUND_QUEUE_MAX;
+    queue->count--;
+    queue->sent = 0;
+}
+
+// Drains the queue into ring when it is set, otherwise into fd
+static int flush_to(outbound_queue *queue, int fd, shm_ring *ring) {
+    while (queue->count > 0) {
+        response *resp = &queue->items[queue->first];
+        size_t body_len = resp->body ? resp->body->len : 0;
+        size_t total = resp->head_len + body_len;
+        struct iovec iov[2];
+        int iov_count = 0;
+        ssize_t rc;
+
+        // Header and body go out in one writev, resuming after a partial write
+        if (queue->sent < resp->head_len) {
+            iov[iov_count].iov_base = resp->head + queue->sent;
+            iov[iov_count].iov_len = resp->head_len - queue->sent;
+            iov_count++;
+        }
+        if (body_len > 0) {
+            size_t body_sent = queue->sent > resp->head_len ? queue->sent - resp->head_len : 0;
+            iov[iov_count].iov_base = resp->body->data + body_sent;
+            iov[iov_count].iov_len = body_len - body_sent;
+            iov_count++;
+        }
+
+        if (iov_count == 0) {
+            outq_pop(queue);
+            continue;
+        }
+
+        rc = ring ? shm_ring_writev(ring, iov, iov_count) : writev(fd, iov, iov_count);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+
+        queue->sent += (size_t)rc;
+        if (queue->sent == total) {
+            outq_pop(queue);
+        }
+    }
+
+    return 0;
+}
+
+int outq_flush(outbound_queue *queue, int fd) {
+    return flush_to(queue, fd, NULL);
+}
+
+int outq_flush_ring(outbound_queue *queue, shm_ring *ring) {
+    return flush_to(queue, -1, ring);
+}
+
+void outq_clear(outbound_queue *queue) {
+    while (queue->count > 0) {
+        outq_pop(queue);
+    }
+}
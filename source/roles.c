@@ -0,0 +1,256 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "../libs/epoch.h"
+#include "../libs/roles.h"
+
+#define ROLES_LINE_MAX 512
+#define ROLES_MIN_SLOTS 16
+
+typedef struct role_slot {
+    uint32_t hash;
+    client_role_t role;     // ROLE_NONE marks an empty slot
+    char name[ROLES_NAME_MAX];
+} role_slot;
+
+// Immutable once published. At most half full, so probes stay short.
+typedef struct role_table {
+    size_t mask;
+    size_t count;
+    role_slot slots[];
+} role_table;
+
+static char g_path[4096];
+static const char *g_base;              // file name within the watched directory
+static _Atomic(role_table *) g_table = NULL;
+static atomic_uint_fast64_t g_loads = 0;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static role_table *table_new(size_t users) {
+    size_t capacity = ROLES_MIN_SLOTS;
+    role_table *table;
+
+    while (capacity < users * 2) {
+        capacity *= 2;
+    }
+    table = calloc(1, sizeof(*table) + capacity * sizeof(role_slot));
+    if (table) {
+        table->mask = capacity - 1;
+    }
+    return table;
+}
+
+static role_slot *table_find(role_table *table, const char *name, uint32_t hash) {
+    size_t i = hash & table->mask;
+
+    while (table->slots[i].role != ROLE_NONE) {
+        if (table->slots[i].hash == hash && strcmp(table->slots[i].name, name) == 0) {
+            break;
+        }
+        i = (i + 1) & table->mask;
+    }
+    return &table->slots[i];
+}
+
+// Adds a user unless it is already in the table: earlier lines win
+static void table_add(role_table *table, const char *name, client_role_t role) {
+    uint32_t hash = hash_name(name);
+    role_slot *slot = table_find(table, name, hash);
+
+    if (slot->role != ROLE_NONE) {
+        return;
+    }
+    slot->hash = hash;
+    slot->role = role;
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    table->count++;
+}
+
+/*
+ * Parses the roles file into a new table, an empty one if it can't be
+ * opened. The lines are kept until the user count is known, so the table
+ * is sized once.
+ */
+static role_table *table_load(void) {
+    FILE *file = fopen(g_path, "r");
+    char line[ROLES_LINE_MAX];
+    struct {
+        char name[ROLES_NAME_MAX];
+        client_role_t role;
+    } *users = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    role_table *table;
+
+    while (file && fgets(line, sizeof(line), file) != NULL) {
+        char name[ROLES_NAME_MAX];
+        char role[16];
+
+        if (sscanf(line, "%63s %15s", name, role) != 2 ||
+            (strcmp(role, "read") != 0 && strcmp(role, "write") != 0)) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t grown = capacity ? capacity * 2 : 64;
+            void *more = realloc(users, grown * sizeof(*users));
+
+            if (!more) {
+                break;
+            }
+            users = more;
+            capacity = grown;
+        }
+        snprintf(users[count].name, sizeof(users[count].name), "%s", name);
+        users[count].role = strcmp(role, "write") == 0 ? ROLE_WRITE : ROLE_READ;
+        count++;
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    table = table_new(count);
+    for (size_t i = 0; table && i < count; ++i) {
+        table_add(table, users[i].name, users[i].role);
+    }
+    free(users);
+    return table;
+}
+
+// Only the thread that started the watcher, then the watcher itself, reloads
+static void roles_reload(void) {
+    role_table *table = table_load();
+    role_table *old;
+
+    if (!table) {
+        perror("roles: reload");
+        return;
+    }
+    old = atomic_exchange_explicit(&g_table, table, memory_order_acq_rel);
+    atomic_fetch_add(&g_loads, 1);
+    if (old) {
+        epoch_retire(old, free);
+    }
+}
+
+/*
+ * The directory is watched rather than the file, so editors that save by
+ * writing a new file and renaming it over the old one are noticed too.
+ */
+static void *roles_watch_main(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        int touched = 0;
+
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            perror("roles: inotify read");
+            return NULL;
+        }
+
+        for (char *cursor = buf; cursor < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)cursor;
+
+            if (event->len > 0 && strcmp(event->name, g_base) == 0) {
+                touched = 1;
+            }
+            cursor += sizeof(*event) + event->len;
+        }
+        // One reload covers every event of the batch
+        if (touched) {
+            roles_reload();
+        }
+    }
+}
+
+int roles_start(const char *path) {
+    char dir[sizeof(g_path)];
+    const char *slash;
+    pthread_t thread;
+    int fd;
+
+    if (strlen(path) >= sizeof(g_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(g_path, sizeof(g_path), "%s", path);
+    slash = strrchr(g_path, '/');
+    g_base = slash ? slash + 1 : g_path;
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - g_path), g_path);
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+
+    // Watch first, so a change made while loading is not missed
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                                  IN_DELETE) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    roles_reload();
+    if (!atomic_load(&g_table)) {
+        return -1;
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, roles_watch_main, (void *)(intptr_t)fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int roles_lookup(const char *username, client_role_t *role_out) {
+    uint32_t hash = hash_name(username);
+    role_table *table;
+    int found = 0;
+
+    epoch_enter();
+    table = atomic_load_explicit(&g_table, memory_order_acquire);
+    if (table) {
+        role_slot *slot = table_find(table, username, hash);
+
+        if (slot->role != ROLE_NONE) {
+            *role_out = slot->role;
+            found = 1;
+        }
+    }
+    epoch_exit();
+    return found;
+}
+
+void roles_stats(size_t *users_out, uint64_t *loads_out) {
+    role_table *table;
+
+    epoch_enter();
+    table = atomic_load_explicit(&g_table, memory_order_acquire);
+    *users_out = table ? table->count : 0;
+    epoch_exit();
+    *loads_out = atomic_load(&g_loads);
+}
@@ -0,0 +1,120 @@
+// pthread_setaffinity_np and the CPU_* macros are GNU extensions
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../libs/sequencer.h"
+
+/*
+ * Intrusive MPSC queue (Vyukov). Producers swap themselves in at the head
+ * and then link the previous head to themselves; the consumer walks from
+ * the tail. A stub node keeps the queue from ever becoming truly empty, so
+ * neither side needs a lock. The semaphore counts submitted tasks and lets
+ * the sequencer sleep; glibc only makes a system call when someone waits.
+ */
+static sequencer_task g_stub;
+static _Atomic(sequencer_task *) g_head = &g_stub;
+static sequencer_task *g_tail = &g_stub;   // sequencer thread only
+static sem_t g_pending;
+
+static void push(sequencer_task *task) {
+    sequencer_task *prev;
+
+    atomic_store_explicit(&task->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&g_head, task, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, task, memory_order_release);
+}
+
+/*
+ * Takes the oldest task, or returns NULL if there is none yet. NULL is also
+ * returned for the moment a producer has swapped the head but not linked
+ * its predecessor yet.
+ */
+static sequencer_task *pop(void) {
+    sequencer_task *tail = g_tail;
+    sequencer_task *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &g_stub) {
+        if (!next) {
+            return NULL;
+        }
+        g_tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next) {
+        g_tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&g_head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    // tail is the last task: put the stub behind it so it can be handed out
+    push(&g_stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        g_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void *sequencer_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sequencer_task *task;
+
+        if (sem_wait(&g_pending) != 0) {
+            continue;   // EINTR
+        }
+        // The post came after the link, only a producer still mid-push can hide it
+        while (!(task = pop())) {
+            sched_yield();
+        }
+        task->fn(task->ctx);
+    }
+    return NULL;
+}
+
+int sequencer_start(int cpu) {
+    pthread_t thread;
+
+    if (sem_init(&g_pending, 0, 0) != 0) {
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, sequencer_main, NULL) != 0) {
+        return -1;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        int rc;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (rc != 0) {
+            // Still correct unpinned, just without the cache locality
+            fprintf(stderr, "sequencer: can't pin to CPU %d: %s\n", cpu, strerror(rc));
+        }
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int sequencer_max_cpu(void) {
+    return CPU_SETSIZE - 1;
+}
+
+void sequencer_submit(sequencer_task *task) {
+    push(task);
+    sem_post(&g_pending);
+}
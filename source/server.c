@@ -2,279 +2,2559 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../libs/checkpoint.h"
+#include "../libs/epoch.h"
+#include "../libs/event_loop.h"
+#include "../libs/frame_io.h"
 #include "../libs/markdown.h"
+#include "../libs/response.h"
+#include "../libs/roles.h"
+#include "../libs/sequencer.h"
+#include "../libs/shm_ring.h"
+#include "../libs/snapshot.h"
+#include "../libs/wal.h"
+#include "../libs/wire.h"
 
 #define USERNAME_MAX 64
 #define ROLE_MAX 16
 #define FIFO_NAME_MAX 128
 #define LINE_MAX 512
+#define DOC_NAME_MAX 64
+#define DOC_SHARD_COUNT 16
+#define DOC_MAX 4096              // documents are never freed, so their number is capped
+#define DEFAULT_DOC_NAME "default"
+#define HISTORY_MAX 1024
+
+// A session thread serves either a FIFO pair or an accepted socket
+typedef struct {
+    pid_t client_pid;       // FIFO transport, 0 for a socket
+    int fd;                 // the accepted socket
+} client_thread_arg_t;
+
+// Options a client picks in its handshake line
+typedef struct {
+    char username[USERNAME_MAX];
+    char doc_name[DOC_NAME_MAX];
+    int delta;
+    int binary;
+    int shm;                // "shm=1": wants the shared-memory rings (socket only)
+} handshake_t;
+
+/*
+ * An immutable committed version. Writers publish a new one after every
+ * commit and readers pick it up without taking the document mutex.
+ */
+typedef struct published_snapshot {
+    uint64_t version;
+    uint64_t wal_offset;    // the log holds this version once it is this long
+    shared_buf *body;
+} published_snapshot;
+
+/*
+ * What one commit changed, serialized once for delta replies as
+ * "C <version> <op count>\n" followed by "R <n>\n" (keep n bytes),
+ * "I <n>\n<n bytes>" (insert) and "D <n>\n" (delete) lines.
+ * Whatever follows the last op is kept. The change positions are kept as
+ * well, to rebase edits made against older versions.
+ */
+typedef struct commit_record {
+    uint64_t version;       // version this commit produced
+    uint64_t author;        // id of the session that made it
+    shared_buf *delta;
+    size_t change_count;
+    change changes[];       // as reported by the commit hook, text left out
+} commit_record;
+
+/*
+ * A session that asked to be pushed new versions. The commit path only
+ * writes one byte to notify_pipe when "pending" was clear, so any number of
+ * commits made while the session is busy collapse into one wakeup.
+ */
+typedef struct subscriber {
+    int notify_pipe[2];
+    atomic_int pending;
+    struct subscriber *next;
+} subscriber;
+
+/*
+ * One hosted document. Each document has its own mutex, so sessions on
+ * different documents never wait for each other. The mutex only serialises
+ * writers: readers load "current" inside an epoch critical section instead.
+ * Entries are created on first use and live until the server exits, so
+ * pointers to them stay valid.
+ */
+typedef struct doc_entry {
+    char name[DOC_NAME_MAX];
+    document *doc;
+    pthread_mutex_t mutex;
+    struct doc_entry *next;
+
+    _Atomic(published_snapshot *) current;
+    atomic_uint_fast64_t snapshot_hits;      // reads served from "current"
+    atomic_uint_fast64_t snapshot_misses;    // versions serialized for publishing
+
+    // Recent commits by version % HISTORY_MAX, read lock-free like "current"
+    _Atomic(commit_record *) history[HISTORY_MAX];
+    atomic_uint_fast64_t delta_replies;
+    atomic_uint_fast64_t delta_fallbacks;    // base too old, full snapshot sent
+    uint64_t commit_author;                  // session committing, under "mutex"
+    uint64_t wal_offset;                     // log end after the last commit, under "mutex"
+    atomic_uint_fast64_t wal_logging;        // version being logged, set before it is written
+    atomic_uint_fast64_t rebased;            // stale edits moved onto the latest version
+
+    // Group commit (-g): requests staged since the last tick, under "mutex"
+    size_t group_size;
+    uint64_t groups_closed;                  // committed or refused, threaded writers watch it
+    pthread_cond_t group_done;               // threaded writers wait here
+    struct client_session *group_waiters;    // parked sessions
+    atomic_uint_fast64_t group_commits;
+    atomic_uint_fast64_t group_requests;
+    atomic_uint_fast64_t group_max;          // largest group committed so far
+
+    // Never held across client I/O, the commit path only takes it to notify
+    pthread_mutex_t subscribers_mutex;
+    subscriber *subscribers;
+    atomic_uint_fast64_t pushes;
+    atomic_uint_fast64_t pushes_coalesced;   // commits folded into a pending push
+} doc_entry;
+
+// Per-connection state shared by every request of one client
+typedef struct client_session {
+    uint64_t id;            // tells this session's commits from others'
+    client_role_t role;
+    doc_entry *entry;
+    int delta;              // reply with DELTA instead of SNAPSHOT when possible
+    int binary;             // "proto=bin": fixed binary headers both ways
+    subscriber *sub;        // set once the session sent "subscribe"
+    uint64_t sent_version;  // latest version this session was sent
+    outbound_queue out;
+    uint64_t durable_at;    // log offset the queued replies wait for, see session_flush
+    int want_shm;           // the handshake asked for shared memory
+    shm_channel *shm;       // requests and replies go through its rings when set
+
+    // A parked request is answered by another thread: the group commit or the sequencer
+    int input_pending;      // the client already sent more, don't wait for the tick
+    event_loop *loop;       // the session's loop thread, NULL in thread mode
+    event_deferred resume;  // posted to loop once a parked request is answered
+    sem_t answered;         // thread mode with -s: posted once a parked request is answered
+    int parked_rc;          // what dispatching the parked request returned in the end
+    struct client_session *group_next;  // in entry->group_waiters
+    uint64_t reply_base;    // version the parked request was sent against
+
+    // Sequencer (-s): the request handed to the sequencer thread
+    sequencer_task seq_task;
+    const wire_request *seq_req;
+    const char *seq_payload;
+} client_session;
 
 typedef enum {
-    ROLE_NONE = 0,
-    ROLE_READ,
-    ROLE_WRITE
-} client_role_t;
+    SESSION_HANDSHAKE = 0,
+    SESSION_REQUEST,
+    SESSION_PAYLOAD,
+    SESSION_CLOSED
+} session_state_t;
+
+// A session driven by an event loop thread instead of its own thread
+typedef struct {
+    client_session session;
+    event_loop *loop;
+    pid_t client_pid;
+    session_state_t state;
+    event_watch c2s_watch;
+    event_watch s2c_watch;
+    event_watch notify_watch;
+    event_watch hangup_watch;   // shared memory: the socket, readable once the client is gone
+    uint32_t s2c_events;    // EPOLLOUT on a FIFO or socket, EPOLLIN on a ring's eventfd
+    int s2c_watched;
+    int notify_watched;
+    int hangup_watched;
+    int output_blocked;     // waiting for EPOLLOUT, input is paused
+    int push_wanted;        // a subscriber wakeup arrived while output was blocked
+    int close_after_flush;
+    int parked;             // the reply is up to the group commit or the sequencer
+    frame_reader in;
+    wire_request req;       // the request whose payload is being read
+    char *payload;
+    size_t payload_got;
+    event_deferred release;
+} loop_session;
+
+/*
+ * The document table is split into shards by name hash. A shard mutex only
+ * guards lookup and creation, never document operations.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    doc_entry *head;
+} doc_shard;
+
+static int g_signal_pipe[2] = {-1, -1};
+static char g_socket_path[FIFO_NAME_MAX];   // "SOCK_<server pid>", removed on SIGINT/SIGTERM
+static atomic_size_t g_sessions = 0;     // connected clients, either mode
+static atomic_size_t g_shm_sessions = 0; // the ones on shared-memory rings
+static atomic_uint_fast64_t g_next_session_id = 1;
+
+// Group commit (-g): edits wait for the next tick of the time interval
+static int g_group_commit = 0;
+static struct timespec g_group_tick;
+static size_t g_group_max = 0;           // commit early at this many requests, 0 for no limit
+// Sequencer (-s): one thread applies every edit, the document mutexes go unused
+static int g_sequencer = 0;
+static int g_sequencer_cpu = -1;
+static sequencer_task g_tick_task;
+static atomic_int g_tick_queued = 0;    // g_tick_task is waiting in the sequencer queue
+static const char *g_mode = "threads";
+static doc_shard g_shards[DOC_SHARD_COUNT];
+static atomic_size_t g_doc_count = 0;
+
+// Checkpoints (-w): written next to the log whenever it grew by g_checkpoint_every bytes
+static char g_checkpoint_path[4096];
+static uint64_t g_checkpoint_every = 8 * 1024 * 1024;
+static atomic_uint_fast64_t g_checkpoints = 0;
+static int g_snapshots = 0;             // -S: a snapshot directory was given
+static sequencer_task g_save_task;
+static atomic_int g_save_queued = 0;    // g_save_task is waiting in the sequencer queue
+static uint64_t g_autosaved = 0;        // versions_seen() at the last snapshot started
+static size_t g_history = 1024;         // -H: versions each document keeps readable
+static struct {
+    size_t docs;                // documents loaded from the checkpoint
+    uint64_t replayed;          // log records applied on top
+    uint64_t skipped;           // log records the checkpoint already covered
+    double ms;                  // checkpoint load, replay and publish
+    double records_per_sec;     // replay alone
+} g_restore;
+
+static void strip_newline(char *text) {
+    size_t len;
+
+    if (!text) {
+        return;
+    }
+
+    len = strlen(text);
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        text[--len] = '\0';
+    }
+}
+
+static void unlink_fifo_if_exists(const char *path) {
+    if (unlink(path) == -1 && errno != ENOENT) {
+        perror("unlink");
+    }
+}
+
+static void unlink_session_fifos(pid_t client_pid) {
+    char fifo_name[FIFO_NAME_MAX];
+
+    snprintf(fifo_name, sizeof(fifo_name), "FIFO_C2S_%d", client_pid);
+    unlink_fifo_if_exists(fifo_name);
+    snprintf(fifo_name, sizeof(fifo_name), "FIFO_S2C_%d", client_pid);
+    unlink_fifo_if_exists(fifo_name);
+}
+
+static const char *role_to_string(client_role_t role) {
+    if (role == ROLE_WRITE) {
+        return "write";
+    }
+    if (role == ROLE_READ) {
+        return "read";
+    }
+    return "unknown";
+}
+
+static void init_doc_shards(void) {
+    for (size_t i = 0; i < DOC_SHARD_COUNT; ++i) {
+        pthread_mutex_init(&g_shards[i].mutex, NULL);
+        g_shards[i].head = NULL;
+    }
+}
+
+static int doc_name_valid(const char *name) {
+    size_t len = strlen(name);
+
+    if (len == 0 || len >= DOC_NAME_MAX) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        char ch = name[i];
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+              (ch >= '0' && ch <= '9') || ch == '_' || ch == '-' || ch == '.')) {
+            return 0;
+        }
+    }
+    return name[0] != '.';
+}
+
+static doc_shard *shard_for_name(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return &g_shards[hash % DOC_SHARD_COUNT];
+}
+
+static void free_published(void *ptr) {
+    published_snapshot *snap = ptr;
+
+    shared_buf_release(snap->body);
+    free(snap);
+}
+
+/*
+ * Serializes the committed version once and publishes it for lock-free
+ * readers. Must be called with the document mutex held (or before the
+ * document is visible). The replaced snapshot is freed once no reader can
+ * still be looking at it.
+ */
+static int publish_snapshot_locked(doc_entry *entry) {
+    const document *doc = entry->doc;
+    size_t len = markdown_length(doc);
+    published_snapshot *snap = malloc(sizeof(*snap));
+    published_snapshot *old;
+
+    if (!snap) {
+        return -1;
+    }
+    // A document still exactly as loaded is published without copying it
+    if (len > 0 && len == doc->original_len && doc->root->text == doc->original &&
+        doc->root->len == len) {
+        snap->body = shared_buf_wrap(doc->original, len);
+    } else {
+        snap->body = shared_buf_new(len);
+        if (snap->body) {
+            snap->body->len = markdown_copy(doc, 0, snap->body->data, len);
+        }
+    }
+    if (!snap->body) {
+        free(snap);
+        return -1;
+    }
+    snap->version = doc->version;
+    snap->wal_offset = entry->wal_offset;
+
+    old = atomic_exchange(&entry->current, snap);
+    atomic_fetch_add_explicit(&entry->snapshot_misses, 1, memory_order_relaxed);
+    epoch_retire(old, free_published);
+    return 0;
+}
+
+/*
+ * Returns a reference to the latest published text, its version and where
+ * the log holds it. Never blocks on the document mutex.
+ */
+static shared_buf *read_snapshot(doc_entry *entry, uint64_t *version_out,
+                                 uint64_t *wal_offset_out) {
+    published_snapshot *snap;
+    shared_buf *body;
+
+    epoch_enter();
+    snap = atomic_load(&entry->current);
+    body = shared_buf_ref(snap->body);
+    *version_out = snap->version;
+    *wal_offset_out = snap->wal_offset;
+    epoch_exit();
+
+    atomic_fetch_add_explicit(&entry->snapshot_hits, 1, memory_order_relaxed);
+    return body;
+}
+
+static void free_commit_record(void *ptr) {
+    commit_record *record = ptr;
+
+    shared_buf_release(record->delta);
+    free(record);
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} text_builder;
+
+static int builder_append(text_builder *builder, const char *text, size_t len) {
+    if (builder->len + len > builder->cap) {
+        size_t new_cap = builder->cap ? builder->cap * 2 : LINE_MAX;
+        char *grown;
+
+        while (new_cap < builder->len + len) {
+            new_cap *= 2;
+        }
+        grown = realloc(builder->data, new_cap);
+        if (!grown) {
+            return -1;
+        }
+        builder->data = grown;
+        builder->cap = new_cap;
+    }
+    memcpy(builder->data + builder->len, text, len);
+    builder->len += len;
+    return 0;
+}
+
+static int builder_op(text_builder *builder, char op, size_t n) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), "%c %zu\n", op, n);
+
+    return builder_append(builder, line, (size_t)len);
+}
+
+// Serializes a commit's changes into the delta format of commit_record
+static shared_buf *serialize_changes(uint64_t version, const change *changes, size_t count) {
+    text_builder builder = {NULL, 0, 0};
+    char line[64];
+    size_t cursor = 0;
+    size_t ops = 0;
+    shared_buf *delta = NULL;
+    int rc = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        ops += (changes[i].pos > cursor) ? 2 : 1;
+        cursor = changes[i].pos + (changes[i].type == EDIT_DELETE ? changes[i].len : 0);
+    }
+    snprintf(line, sizeof(line), "C %llu %zu\n", (unsigned long long)version, ops);
+    rc = builder_append(&builder, line, strlen(line));
+
+    cursor = 0;
+    for (size_t i = 0; i < count && rc == 0; ++i) {
+        const change *c = &changes[i];
+
+        if (c->pos > cursor) {
+            rc = builder_op(&builder, 'R', c->pos - cursor);
+            cursor = c->pos;
+        }
+        if (rc != 0) {
+            break;
+        }
+        if (c->type == EDIT_INSERT) {
+            rc = builder_op(&builder, 'I', c->len);
+            if (rc == 0) {
+                rc = builder_append(&builder, c->text, c->len);
+            }
+        } else {
+            rc = builder_op(&builder, 'D', c->len);
+            cursor += c->len;
+        }
+    }
+
+    if (rc == 0) {
+        delta = shared_buf_new(builder.len);
+        if (delta) {
+            memcpy(delta->data, builder.data, builder.len);
+        }
+    }
+    free(builder.data);
+    return delta;
+}
+
+/*
+ * Commit hook: records what the commit changed in the history ring before
+ * the new version is published. If the changes can't be recorded the slot
+ * is cleared, and clients older than this version get a full snapshot.
+ * With -w the commit is also logged first, so nothing is published that
+ * the log doesn't have: a commit the log didn't take is refused.
+ */
+static int record_commit(const document *doc, const change *changes, size_t count, void *ctx) {
+    doc_entry *entry = ctx;
+    commit_record *record = NULL;
+    commit_record *old;
+
+    if (wal_enabled()) {
+        uint64_t logged = 0;
+
+        atomic_store(&entry->wal_logging, doc->version);
+        if (changes) {
+            logged = wal_log_commit(entry->name, doc->version, changes, count);
+        } else {
+            char *text = markdown_flatten(doc);
+
+            if (text) {
+                logged = wal_log_snapshot(entry->name, doc->version, text, markdown_length(doc));
+            }
+            free(text);
+        }
+        if (logged == 0) {
+            return -1;
+        }
+        entry->wal_offset = logged;
+    }
+
+    if (changes) {
+        record = malloc(sizeof(*record) + count * sizeof(change));
+    }
+    if (record) {
+        record->version = doc->version;
+        record->author = entry->commit_author;
+        record->change_count = count;
+        for (size_t i = 0; i < count; ++i) {
+            record->changes[i] = (change){changes[i].type, changes[i].pos, changes[i].len, NULL};
+        }
+        record->delta = serialize_changes(doc->version, changes, count);
+        if (!record->delta) {
+            free(record);
+            record = NULL;
+        }
+    }
+
+    old = atomic_exchange(&entry->history[doc->version % HISTORY_MAX], record);
+    epoch_retire(old, free_commit_record);
+    return 0;
+}
+
+// Why a commit was refused: the log failed, or memory ran out
+static const char *commit_error(void) {
+    return wal_failed() ? "WAL_FAILED" : "INTERNAL";
+}
+
+/*
+ * Returns the document called "name". If there is none, an empty one is
+ * created when create is set. Returns NULL with errno ENOENT for a missing
+ * document, ENOSPC once DOC_MAX documents exist and ENOMEM.
+ */
+static doc_entry *acquire_doc(const char *name, int create) {
+    doc_shard *shard = shard_for_name(name);
+    doc_entry *entry;
+
+    pthread_mutex_lock(&shard->mutex);
+    for (entry = shard->head; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            pthread_mutex_unlock(&shard->mutex);
+            return entry;
+        }
+    }
+
+    if (!create) {
+        pthread_mutex_unlock(&shard->mutex);
+        errno = ENOENT;
+        return NULL;
+    }
+    if (atomic_fetch_add(&g_doc_count, 1) >= DOC_MAX) {
+        atomic_fetch_sub(&g_doc_count, 1);
+        pthread_mutex_unlock(&shard->mutex);
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry) {
+        entry->doc = markdown_init();
+        if (!entry->doc) {
+            free(entry);
+            entry = NULL;
+        }
+    }
+    if (entry) {
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        // Its first commit is logged after this point
+        entry->wal_offset = wal_offset();
+        atomic_init(&entry->wal_logging, 0);
+        pthread_mutex_init(&entry->mutex, NULL);
+        atomic_init(&entry->current, NULL);
+        atomic_init(&entry->snapshot_hits, 0);
+        atomic_init(&entry->snapshot_misses, 0);
+        atomic_init(&entry->delta_replies, 0);
+        atomic_init(&entry->delta_fallbacks, 0);
+        atomic_init(&entry->rebased, 0);
+        pthread_cond_init(&entry->group_done, NULL);
+        atomic_init(&entry->group_commits, 0);
+        atomic_init(&entry->group_requests, 0);
+        atomic_init(&entry->group_max, 0);
+        pthread_mutex_init(&entry->subscribers_mutex, NULL);
+        entry->subscribers = NULL;
+        atomic_init(&entry->pushes, 0);
+        atomic_init(&entry->pushes_coalesced, 0);
+        for (size_t i = 0; i < HISTORY_MAX; ++i) {
+            atomic_init(&entry->history[i], NULL);
+        }
+        markdown_set_commit_hook(entry->doc, record_commit, entry);
+        if (markdown_set_history(entry->doc, g_history) != 0 ||
+            publish_snapshot_locked(entry) != 0) {
+            markdown_free(entry->doc);
+            free(entry);
+            entry = NULL;
+        }
+    }
+    if (entry) {
+        entry->next = shard->head;
+        shard->head = entry;
+    } else {
+        atomic_fetch_sub(&g_doc_count, 1);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (!entry) {
+        errno = ENOMEM;
+    }
+    return entry;
+}
+
+/*
+ * Queues one reply in the session's protocol, taking over the reference to
+ * body. "from" is the base version of a DELTA or the document count of a
+ * LIST. message is only used by errors.
+ */
+static int queue_reply(client_session *session, wire_reply_kind kind, uint64_t from,
+                       uint64_t version, shared_buf *body, const char *message) {
+    const char *role = role_to_string(session->role);
+    size_t body_len = body ? body->len : 0;
+    response resp;
+
+    if (session->binary) {
+        unsigned char head[WIRE_REPLY_SIZE];
+        wire_reply reply = {kind, (uint8_t)session->role, from, version, body_len};
+
+        if (kind == REPLY_ERROR) {
+            body = shared_buf_new(strlen(message));
+            if (!body) {
+                return -1;
+            }
+            memcpy(body->data, message, body->len);
+            reply.body_len = body->len;
+        }
+        wire_encode_reply(&reply, head);
+        (void)response_set_head(&resp, body, head, sizeof(head));
+        return outq_push(&session->out, &resp);
+    }
+
+    switch (kind) {
+    case REPLY_SNAPSHOT:
+        (void)response_format(&resp, body, "SNAPSHOT %s %llu %zu\n",
+                              role, (unsigned long long)version, body_len);
+        break;
+    case REPLY_DELTA:
+        (void)response_format(&resp, body, "DELTA %s %llu %llu %zu\n",
+                              role, (unsigned long long)from, (unsigned long long)version,
+                              body_len);
+        break;
+    case REPLY_LIST:
+        (void)response_format(&resp, body, "LIST %llu %zu\n", (unsigned long long)from, body_len);
+        break;
+    case REPLY_STATS:
+        (void)response_format(&resp, body, "STATS %zu\n", body_len);
+        break;
+    case REPLY_ERROR:
+    default:
+        (void)response_format(&resp, body, "ERROR %s\n", message);
+        break;
+    }
+    return outq_push(&session->out, &resp);
+}
+
+static int queue_error(client_session *session, const char *message) {
+    return queue_reply(session, REPLY_ERROR, 0, 0, NULL, message);
+}
+
+// The queued replies show a version the log holds once it is this long
+static void wait_durable(client_session *session, uint64_t wal_offset) {
+    if (wal_offset > session->durable_at) {
+        session->durable_at = wal_offset;
+    }
+}
+
+/*
+ * Queues the latest published version. Every session asking for the same
+ * version shares one body, only the short header is formatted per session.
+ */
+static int queue_snapshot(client_session *session, uint64_t *version_out) {
+    uint64_t version;
+    uint64_t wal_offset;
+    shared_buf *body = read_snapshot(session->entry, &version, &wal_offset);
+
+    wait_durable(session, wal_offset);
+    if (version_out) {
+        *version_out = version;
+    }
+    return queue_reply(session, REPLY_SNAPSHOT, 0, version, body, NULL);
+}
+
+/*
+ * Queues the changes from base_version to the latest published version as
+ * one DELTA reply. Falls back to a full snapshot when base_version is no
+ * longer in the history ring. Lock-free, like queue_snapshot.
+ */
+static int queue_delta(client_session *session, uint64_t base_version, uint64_t *version_out) {
+    doc_entry *entry = session->entry;
+    shared_buf *parts[HISTORY_MAX];
+    size_t part_count = 0;
+    size_t total = 0;
+    published_snapshot *snap;
+    uint64_t to;
+    uint64_t wal_offset;
+    int complete = 1;
+    shared_buf *body = NULL;
+
+    epoch_enter();
+    snap = atomic_load(&entry->current);
+    to = snap->version;
+    wal_offset = snap->wal_offset;
+    if (base_version > to || to - base_version >= HISTORY_MAX) {
+        complete = 0;
+    }
+    for (uint64_t v = base_version + 1; complete && v <= to; ++v) {
+        commit_record *record = atomic_load(&entry->history[v % HISTORY_MAX]);
+        if (!record || record->version != v) {
+            complete = 0;
+            break;
+        }
+        parts[part_count++] = shared_buf_ref(record->delta);
+        total += record->delta->len;
+    }
+    epoch_exit();
+
+    if (complete && total > 0) {
+        body = shared_buf_new(total);
+        if (body) {
+            size_t offset = 0;
+            for (size_t i = 0; i < part_count; ++i) {
+                memcpy(body->data + offset, parts[i]->data, parts[i]->len);
+                offset += parts[i]->len;
+            }
+        } else {
+            complete = 0;
+        }
+    }
+    for (size_t i = 0; i < part_count; ++i) {
+        shared_buf_release(parts[i]);
+    }
+
+    if (!complete) {
+        atomic_fetch_add_explicit(&entry->delta_fallbacks, 1, memory_order_relaxed);
+        return queue_snapshot(session, version_out);
+    }
+
+    wait_durable(session, wal_offset);
+    if (version_out) {
+        *version_out = to;
+    }
+    atomic_fetch_add_explicit(&entry->delta_replies, 1, memory_order_relaxed);
+    return queue_reply(session, REPLY_DELTA, base_version, to, body, NULL);
+}
+
+/*
+ * Queues the latest version in the form this session asked for. Deltas
+ * start from the version the client sent, except for subscribers, whose
+ * copy may already be ahead of it through pushes.
+ */
+static int queue_version(client_session *session, uint64_t client_version) {
+    uint64_t base = session->sub ? session->sent_version : client_version;
+
+    if (session->delta) {
+        return queue_delta(session, base, &session->sent_version);
+    }
+    return queue_snapshot(session, &session->sent_version);
+}
+
+/*
+ * Wakes every subscriber of a document after a new version was published.
+ * Never blocks: a subscriber that hasn't consumed its last wakeup yet just
+ * picks up this version along with the earlier ones.
+ */
+static void notify_subscribers(doc_entry *entry) {
+    pthread_mutex_lock(&entry->subscribers_mutex);
+    for (subscriber *sub = entry->subscribers; sub; sub = sub->next) {
+        if (atomic_exchange(&sub->pending, 1) == 0) {
+            (void)write(sub->notify_pipe[1], "", 1);
+        } else {
+            atomic_fetch_add_explicit(&entry->pushes_coalesced, 1, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&entry->subscribers_mutex);
+}
+
+static int subscribe_session(client_session *session) {
+    subscriber *sub = calloc(1, sizeof(*sub));
+
+    if (!sub) {
+        return -1;
+    }
+    if (pipe(sub->notify_pipe) == -1) {
+        free(sub);
+        return -1;
+    }
+    (void)fcntl(sub->notify_pipe[0], F_SETFL, O_NONBLOCK);
+    (void)fcntl(sub->notify_pipe[1], F_SETFL, O_NONBLOCK);
+    atomic_init(&sub->pending, 0);
+
+    pthread_mutex_lock(&session->entry->subscribers_mutex);
+    sub->next = session->entry->subscribers;
+    session->entry->subscribers = sub;
+    pthread_mutex_unlock(&session->entry->subscribers_mutex);
+
+    session->sub = sub;
+    return 0;
+}
+
+static void unsubscribe_session(client_session *session) {
+    subscriber *sub = session->sub;
+    subscriber **link;
+
+    if (!sub) {
+        return;
+    }
+
+    pthread_mutex_lock(&session->entry->subscribers_mutex);
+    for (link = &session->entry->subscribers; *link; link = &(*link)->next) {
+        if (*link == sub) {
+            *link = sub->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session->entry->subscribers_mutex);
+
+    close(sub->notify_pipe[0]);
+    close(sub->notify_pipe[1]);
+    free(sub);
+    session->sub = NULL;
+}
+
+/*
+ * Consumes a wakeup and queues one reply covering every version published
+ * since the last one this subscriber was sent.
+ */
+static int queue_push(client_session *session) {
+    char drain[64];
+    uint64_t latest;
+
+    // Clear "pending" before reading the version so a later commit wakes us again
+    atomic_store(&session->sub->pending, 0);
+    while (read(session->sub->notify_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    epoch_enter();
+    latest = atomic_load(&session->entry->current)->version;
+    epoch_exit();
+    if (latest == session->sent_version) {
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&session->entry->pushes, 1, memory_order_relaxed);
+    return queue_version(session, session->sent_version);
+}
+
+// Formats one line about a document from its published snapshot
+typedef int (*doc_line_fn)(const doc_entry *entry, const published_snapshot *snap,
+                           char *line, size_t capacity);
+
+static int format_list_line(const doc_entry *entry, const published_snapshot *snap,
+                            char *line, size_t capacity) {
+    return snprintf(line, capacity, "%s %llu %zu\n",
+                    entry->name,
+                    (unsigned long long)snap->version,
+                    snap->body->len);
+}
+
+static int format_stats_line(const doc_entry *entry, const published_snapshot *snap,
+                             char *line, size_t capacity) {
+    return snprintf(line, capacity,
+                    "doc %s version=%llu length=%zu snapshot_hits=%llu snapshot_misses=%llu"
+                    " delta_replies=%llu delta_fallbacks=%llu pushes=%llu pushes_coalesced=%llu"
+                    " rebased=%llu group_commits=%llu group_requests=%llu group_max=%llu\n",
+                    entry->name,
+                    (unsigned long long)snap->version,
+                    snap->body->len,
+                    (unsigned long long)atomic_load(&entry->snapshot_hits),
+                    (unsigned long long)atomic_load(&entry->snapshot_misses),
+                    (unsigned long long)atomic_load(&entry->delta_replies),
+                    (unsigned long long)atomic_load(&entry->delta_fallbacks),
+                    (unsigned long long)atomic_load(&entry->pushes),
+                    (unsigned long long)atomic_load(&entry->pushes_coalesced),
+                    (unsigned long long)atomic_load(&entry->rebased),
+                    (unsigned long long)atomic_load(&entry->group_commits),
+                    (unsigned long long)atomic_load(&entry->group_requests),
+                    (unsigned long long)atomic_load(&entry->group_max));
+}
+
+/*
+ * Builds a body with one line per hosted document. Takes each shard mutex
+ * in turn but no document mutex, the lines come from published snapshots.
+ * Returns -1 on allocation failure.
+ */
+static int build_doc_table(doc_line_fn format_line, shared_buf **body_out, size_t *count_out) {
+    shared_buf *body = NULL;
+    size_t body_len = 0;
+    size_t body_cap = 0;
+    size_t count = 0;
+    int rc = 0;
+
+    for (size_t i = 0; i < DOC_SHARD_COUNT && rc == 0; ++i) {
+        pthread_mutex_lock(&g_shards[i].mutex);
+        for (doc_entry *entry = g_shards[i].head; entry != NULL; entry = entry->next) {
+            char line[LINE_MAX];
+            int line_len;
+
+            epoch_enter();
+            line_len = format_line(entry, atomic_load(&entry->current), line, sizeof(line));
+            epoch_exit();
+            if (line_len < 0 || (size_t)line_len >= sizeof(line)) {
+                continue;
+            }
+
+            if (body_len + (size_t)line_len > body_cap) {
+                size_t new_cap = body_cap ? body_cap * 2 : LINE_MAX;
+                shared_buf *grown;
+
+                while (new_cap < body_len + (size_t)line_len) {
+                    new_cap *= 2;
+                }
+                grown = shared_buf_new(new_cap);
+                if (!grown) {
+                    rc = -1;
+                    break;
+                }
+                if (body) {
+                    memcpy(grown->data, body->data, body_len);
+                    shared_buf_release(body);
+                }
+                body = grown;
+                body_cap = new_cap;
+            }
+            memcpy(body->data + body_len, line, (size_t)line_len);
+            body_len += (size_t)line_len;
+            count++;
+        }
+        pthread_mutex_unlock(&g_shards[i].mutex);
+    }
+
+    if (rc != 0) {
+        shared_buf_release(body);
+        return -1;
+    }
+    if (body) {
+        body->len = body_len;
+    }
+    *body_out = body;
+    *count_out = count;
+    return 0;
+}
+
+// Queues one "<name> <version> <length>" line per hosted document
+static int queue_doc_list(client_session *session) {
+    shared_buf *body = NULL;
+    size_t count = 0;
+
+    if (build_doc_table(format_list_line, &body, &count) != 0) {
+        return queue_error(session, "INTERNAL");
+    }
+    return queue_reply(session, REPLY_LIST, count, 0, body, NULL);
+}
+
+// Queues server counters, one "<scope> <name> key=value..." line each
+static int queue_stats(client_session *session) {
+    shared_buf *body = NULL;
+    size_t count = 0;
+    char server_line[2 * LINE_MAX];
+    int server_len;
+    shared_buf *full;
+    size_t users;
+    uint64_t role_loads;
+    wal_stats wal;
+    snapshot_stats snap;
+
+    if (build_doc_table(format_stats_line, &body, &count) != 0) {
+        return queue_error(session, "INTERNAL");
+    }
+
+    // One line about the server itself ahead of the per-document lines
+    roles_stats(&users, &role_loads);
+    wal_get_stats(&wal);
+    snapshot_get_stats(&snap);
+    server_len = snprintf(server_line, sizeof(server_line),
+                          "server mode=%s sequencer=%s sessions=%zu shm_sessions=%zu "
+                          "users=%zu role_loads=%llu wal=%s wal_records=%llu wal_bytes=%llu "
+                          "wal_syncs=%llu checkpoints=%llu restored_docs=%zu replayed=%llu "
+                          "replay_rate=%.0f restore_ms=%.1f snapshots=%llu snapshots_failed=%llu "
+                          "snapshot_fork_us=%llu snapshot_ms=%.1f snapshot_pages_copied=%llu "
+                          "snapshot_bytes=%llu\n",
+                          g_mode, g_sequencer ? "on" : "off", atomic_load(&g_sessions),
+                          atomic_load(&g_shm_sessions), users, (unsigned long long)role_loads,
+                          !wal_enabled() ? "off" : wal.failed ? "failed" : "on",
+                          (unsigned long long)wal.records, (unsigned long long)wal.bytes,
+                          (unsigned long long)wal.syncs,
+                          (unsigned long long)atomic_load(&g_checkpoints), g_restore.docs,
+                          (unsigned long long)g_restore.replayed, g_restore.records_per_sec,
+                          g_restore.ms, (unsigned long long)snap.taken,
+                          (unsigned long long)snap.failed, (unsigned long long)snap.fork_us,
+                          snap.ms, (unsigned long long)snap.pages_copied,
+                          (unsigned long long)snap.bytes);
+    full = shared_buf_new((size_t)server_len + (body ? body->len : 0));
+    if (!full) {
+        shared_buf_release(body);
+        return queue_error(session, "INTERNAL");
+    }
+    memcpy(full->data, server_line, (size_t)server_len);
+    if (body) {
+        memcpy(full->data + server_len, body->data, body->len);
+        shared_buf_release(body);
+    }
+
+    return queue_reply(session, REPLY_STATS, 0, 0, full, NULL);
+}
+
+// Edit operations by opcode, so dispatch is one table lookup in both protocols
+typedef int (*edit_fn)(document *doc, const wire_request *req, const char *payload);
+
+static int edit_insert(document *doc, const wire_request *req, const char *payload) {
+    return markdown_insert(doc, req->version, (size_t)req->pos, payload ? payload : "");
+}
+
+static int edit_delete(document *doc, const wire_request *req, const char *payload) {
+    (void)payload;
+    return markdown_delete(doc, req->version, (size_t)req->pos, (size_t)req->len);
+}
+
+static int edit_bold(document *doc, const wire_request *req, const char *payload) {
+    (void)payload;
+    return markdown_bold(doc, req->version, (size_t)req->pos, (size_t)req->len);
+}
+
+static int edit_italic(document *doc, const wire_request *req, const char *payload) {
+    (void)payload;
+    return markdown_italic(doc, req->version, (size_t)req->pos, (size_t)req->len);
+}
+
+static int edit_heading(document *doc, const wire_request *req, const char *payload) {
+    (void)payload;
+    return markdown_heading(doc, req->version, (size_t)req->len, (size_t)req->pos);
+}
+
+static int edit_newline(document *doc, const wire_request *req, const char *payload) {
+    (void)payload;
+    return markdown_newline(doc, req->version, (size_t)req->pos);
+}
+
+static const edit_fn g_edit_ops[OP_COUNT] = {
+    [OP_INSERT] = edit_insert,
+    [OP_DELETE] = edit_delete,
+    [OP_BOLD] = edit_bold,
+    [OP_ITALIC] = edit_italic,
+    [OP_HEADING] = edit_heading,
+    [OP_NEWLINE] = edit_newline,
+};
+
+/*
+ * Parses a text request line, "REQUEST <command> <version> <pos> <len>
+ * <payload_len>" or "DISCONNECT". Unknown command names parse as
+ * OP_INVALID so their payload is still consumed before the error reply.
+ */
+static int parse_text_request(const char *line, wire_request *req) {
+    char command[ROLE_MAX];
+    unsigned long long version = 0;
+    unsigned long long pos = 0;
+    unsigned long long len = 0;
+    unsigned long long payload_len = 0;
+
+    if (strcmp(line, "DISCONNECT") == 0) {
+        memset(req, 0, sizeof(*req));
+        req->op = OP_DISCONNECT;
+        return 0;
+    }
+
+    if (sscanf(line, "REQUEST %15s %llu %llu %llu %llu",
+               command, &version, &pos, &len, &payload_len) != 5 ||
+        payload_len > UINT32_MAX) {
+        return -1;
+    }
+
+    req->op = wire_op_from_name(command);
+    req->version = version;
+    req->pos = pos;
+    req->len = len;
+    req->payload_len = (uint32_t)payload_len;
+    return 0;
+}
+
+/*
+ * Takes the next edit request out of a txn payload, in the session's own
+ * encoding, and points payload_out at its payload bytes.
+ */
+static int next_txn_request(int binary, const char **cursor, const char *end,
+                            wire_request *sub, const char **payload_out) {
+    if (binary) {
+        if ((size_t)(end - *cursor) < WIRE_REQUEST_SIZE) {
+            return -1;
+        }
+        wire_decode_request((const unsigned char *)*cursor, sub);
+        *cursor += WIRE_REQUEST_SIZE;
+    } else {
+        char line[LINE_MAX];
+        const char *newline = memchr(*cursor, '\n', (size_t)(end - *cursor));
+        size_t len;
+
+        if (!newline || (len = (size_t)(newline - *cursor)) >= sizeof(line)) {
+            return -1;
+        }
+        memcpy(line, *cursor, len);
+        line[len] = '\0';
+        if (parse_text_request(line, sub) != 0) {
+            return -1;
+        }
+        *cursor = newline + 1;
+    }
+
+    if (sub->payload_len > (size_t)(end - *cursor)) {
+        return -1;
+    }
+    *payload_out = *cursor;
+    *cursor += sub->payload_len;
+    return 0;
+}
+
+/*
+ * Stale edits. An edit made against an older version is moved onto the
+ * latest one by mapping its positions through every commit since, as long
+ * as those commits are still in the history ring. Commits made by the same
+ * session are never rebased over: its later requests were then built on
+ * versions it predicted (see the client's batch mode), so they stay stale.
+ */
+static int can_rebase(const doc_entry *entry, uint64_t session_id, uint64_t base) {
+    uint64_t latest = entry->doc->version;
+
+    if (base >= latest || latest - base >= HISTORY_MAX) {
+        return 0;
+    }
+    for (uint64_t v = base + 1; v <= latest; ++v) {
+        const commit_record *record = atomic_load(&entry->history[v % HISTORY_MAX]);
+
+        if (!record || record->version != v || record->author == session_id) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Maps position "pos" of the version before a commit to the version after
+ * it. Text the commit inserted exactly at "pos" ends up before the mapped
+ * position if after_inserts is set, behind it otherwise. A position inside
+ * deleted text moves to where that text was.
+ */
+static size_t rebase_pos(const commit_record *record, size_t pos, int after_inserts) {
+    size_t mapped = pos;
+
+    for (size_t i = 0; i < record->change_count; ++i) {
+        const change *c = &record->changes[i];
+
+        if (c->pos > pos) {
+            break;
+        }
+        if (c->type == EDIT_INSERT) {
+            if (c->pos < pos || after_inserts) {
+                mapped += c->len;
+            }
+        } else if (c->pos + c->len <= pos) {
+            mapped -= c->len;
+        } else {
+            mapped -= pos - c->pos;
+        }
+    }
+    return mapped;
+}
+
+/*
+ * Rewrites the positions of one edit made against "base" for the latest
+ * version. Inserts go behind text others inserted at the same spot, while
+ * ranges and headings keep such text outside. Returns 1 if the edit lost
+ * all of its range to deletes, so nothing is left to do.
+ */
+static int rebase_edit(const doc_entry *entry, uint64_t base, wire_request *req) {
+    int ranged = req->op == OP_DELETE || req->op == OP_BOLD || req->op == OP_ITALIC;
+    uint64_t start = req->pos;
+    // Deletes give a length, bold and italic an end position
+    uint64_t end = req->op != OP_DELETE ? req->len
+                   : req->len > UINT64_MAX - req->pos ? UINT64_MAX : req->pos + req->len;
+    int was_empty = end <= start;
+
+    for (uint64_t v = base + 1; v <= entry->doc->version; ++v) {
+        const commit_record *record = atomic_load(&entry->history[v % HISTORY_MAX]);
+
+        start = rebase_pos(record, (size_t)start, req->op != OP_HEADING);
+        if (ranged) {
+            end = rebase_pos(record, (size_t)end, 0);
+        }
+    }
+
+    req->pos = start;
+    if (req->op == OP_DELETE) {
+        req->len = end > start ? end - start : 0;
+    } else if (ranged) {
+        req->len = end;
+    }
+    return ranged && !was_empty && end <= start;
+}
+
+/*
+ * Stages one edit, rebased first if it was made against an older version.
+ * Returns NULL if it was staged or had nothing left to do (staged stays
+ * 0 then), or the error to reply with.
+ */
+static const char *stage_edit(doc_entry *entry, const wire_request *req, const char *payload,
+                              uint64_t base, size_t *staged) {
+    wire_request edit = *req;
+
+    if (base < entry->doc->version && rebase_edit(entry, base, &edit)) {
+        return NULL;
+    }
+    edit.version = entry->doc->version;
+    if (g_edit_ops[edit.op](entry->doc, &edit, payload) != 0) {
+        return "INVALID_EDIT";
+    }
+    ++*staged;
+    return NULL;
+}
+
+/*
+ * Stages every edit packed into a txn payload against the txn's version.
+ * Returns NULL once all of them are staged, or the error to reply with.
+ */
+static const char *stage_txn(const client_session *session, const wire_request *req,
+                             const char *payload, size_t *staged) {
+    const char *cursor = payload;
+    const char *end = payload + req->payload_len;
+    size_t parsed = 0;
+
+    while (cursor < end) {
+        wire_request sub;
+        const char *sub_payload;
+        const char *error;
+        char *text;
+
+        if (next_txn_request(session->binary, &cursor, end, &sub, &sub_payload) != 0) {
+            return "BAD_REQUEST";
+        }
+        if (!g_edit_ops[sub.op]) {
+            return "UNKNOWN_COMMAND";
+        }
+
+        // Edits want a NUL-terminated payload, the txn payload isn't split up
+        text = malloc((size_t)sub.payload_len + 1);
+        if (!text) {
+            return "INTERNAL";
+        }
+        memcpy(text, sub_payload, sub.payload_len);
+        text[sub.payload_len] = '\0';
+
+        error = stage_edit(session->entry, &sub, text, req->version, staged);
+        free(text);
+        if (error) {
+            return error;
+        }
+        parsed++;
+    }
+
+    return parsed > 0 ? NULL : "INVALID_EDIT";
+}
+
+/*
+ * Hands a parked request's outcome back to its session: a loop session is
+ * resumed on its loop thread, a session thread waiting on the sequencer is
+ * woken up.
+ */
+static void answer_parked(client_session *session, int rc) {
+    session->parked_rc = rc;
+    if (session->loop) {
+        event_loop_post(session->loop, &session->resume);
+    } else {
+        sem_post(&session->answered);
+    }
+}
+
+/*
+ * Group commit. With -g, edits are staged on the document as they arrive
+ * and a ticker thread commits whatever was staged once per time interval,
+ * so N writers per interval cost one commit, one published snapshot and
+ * one round of subscriber pushes instead of N. All requests of a group are
+ * staged against the same version, just like the edits of one txn.
+ */
+static void group_commit_locked(doc_entry *entry) {
+    client_session *waiter = entry->group_waiters;
+    uint64_t size = entry->group_size;
+    uint64_t largest = atomic_load(&entry->group_max);
+    uint64_t version = entry->doc->version;
+    int committed;
+
+    entry->group_size = 0;
+    entry->group_waiters = NULL;
+
+    // A group has no single author, every session may rebase over it
+    entry->commit_author = 0;
+    markdown_increment_version(entry->doc);
+    committed = entry->doc->version != version;
+    entry->groups_closed++;
+
+    if (committed) {
+        // If publishing fails readers keep the last version until the next commit
+        (void)publish_snapshot_locked(entry);
+        notify_subscribers(entry);
+
+        atomic_fetch_add_explicit(&entry->group_commits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&entry->group_requests, size, memory_order_relaxed);
+        while (size > largest &&
+               !atomic_compare_exchange_weak(&entry->group_max, &largest, size)) {
+        }
+    } else {
+        // A refused group must not ride along with the next one
+        markdown_discard_staged(entry->doc, 0);
+    }
+
+    pthread_cond_broadcast(&entry->group_done);
+    // Parked sessions read nothing and write nothing until they are answered
+    while (waiter) {
+        client_session *next = waiter->group_next;
+
+        answer_parked(waiter, committed ? queue_version(waiter, waiter->reply_base)
+                                        : queue_error(waiter, commit_error()));
+        waiter = next;
+    }
+}
+
+/*
+ * Adds the request just staged to the document's open group. A session
+ * thread waits for the commit right here. A loop session can't block and
+ * neither can the sequencer, so in those cases the session is parked and
+ * 1 is returned; the commit queues its reply and answers it. The group is
+ * committed at once when it is full, or when the client has already sent
+ * more requests, which may build on this one.
+ */
+static int join_group_locked(client_session *session, uint64_t reply_base) {
+    doc_entry *entry = session->entry;
+    uint64_t version = entry->doc->version;
+
+    entry->group_size++;
+    if (session->input_pending || (g_group_max > 0 && entry->group_size >= g_group_max)) {
+        group_commit_locked(entry);
+    } else if (session->loop || g_sequencer) {
+        session->reply_base = reply_base;
+        session->group_next = entry->group_waiters;
+        entry->group_waiters = session;
+        return 1;
+    } else {
+        uint64_t group = entry->groups_closed;
+
+        while (entry->groups_closed == group) {
+            pthread_cond_wait(&entry->group_done, &entry->mutex);
+        }
+    }
+    if (entry->doc->version == version) {
+        return queue_error(session, commit_error());
+    }
+    return queue_version(session, reply_base);
+}
+
+// Commits every open group. In -s mode this runs as a task on the sequencer
+static void commit_open_groups(void *ctx) {
+    (void)ctx;
+    atomic_store(&g_tick_queued, 0);
+
+    for (size_t i = 0; i < DOC_SHARD_COUNT; ++i) {
+        doc_shard *shard = &g_shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        for (doc_entry *entry = shard->head; entry; entry = entry->next) {
+            if (!g_sequencer) {
+                pthread_mutex_lock(&entry->mutex);
+            }
+            if (entry->group_size > 0) {
+                group_commit_locked(entry);
+            }
+            if (!g_sequencer) {
+                pthread_mutex_unlock(&entry->mutex);
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+static void *group_ticker_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        nanosleep(&g_group_tick, NULL);
+
+        if (!g_sequencer) {
+            commit_open_groups(NULL);
+        } else if (!atomic_exchange(&g_tick_queued, 1)) {
+            // A tick the sequencer hasn't got to yet covers this one too
+            sequencer_submit(&g_tick_task);
+        }
+    }
+    return NULL;
+}
+
+// Runs in the snapshot child, which is alone in its copy of memory: nothing needs locking
+static int save_documents(void *ctx) {
+    (void)ctx;
+    for (size_t i = 0; i < DOC_SHARD_COUNT; ++i) {
+        for (doc_entry *entry = g_shards[i].head; entry != NULL; entry = entry->next) {
+            if (snapshot_save_doc(entry->name, entry->doc->version, entry->doc) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Forks a snapshot of every document. The child only needs the documents
+ * to hold still during fork(), so every shard and document mutex is taken
+ * for just that long, in the same order commit_open_groups uses. In -s
+ * mode this runs on the sequencer, which owns the documents, and the
+ * shard mutexes only keep new documents out.
+ */
+static int start_snapshot(uint64_t *fork_us_out) {
+    snapshot_stats stats;
+    int rc;
+
+    // Don't hold up every writer just to find the last one still running
+    snapshot_get_stats(&stats);
+    if (stats.running) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < DOC_SHARD_COUNT; ++i) {
+        pthread_mutex_lock(&g_shards[i].mutex);
+        for (doc_entry *entry = g_shards[i].head; entry && !g_sequencer; entry = entry->next) {
+            pthread_mutex_lock(&entry->mutex);
+        }
+    }
+    rc = snapshot_start(save_documents, NULL, fork_us_out);
+    for (size_t i = DOC_SHARD_COUNT; i-- > 0;) {
+        for (doc_entry *entry = g_shards[i].head; entry && !g_sequencer; entry = entry->next) {
+            pthread_mutex_unlock(&entry->mutex);
+        }
+        pthread_mutex_unlock(&g_shards[i].mutex);
+    }
+    return rc;
+}
+
+// Sum of published versions plus the document count, it grows with every change
+static uint64_t versions_seen(void) {
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < DOC_SHARD_COUNT; ++i) {
+        pthread_mutex_lock(&g_shards[i].mutex);
+        for (doc_entry *entry = g_shards[i].head; entry != NULL; entry = entry->next) {
+            epoch_enter();
+            seen += atomic_load(&entry->current)->version + 1;
+            epoch_exit();
+        }
+        pthread_mutex_unlock(&g_shards[i].mutex);
+    }
+    return seen;
+}
+
+// Snapshots once per time interval if anything changed. In -s mode this runs on the sequencer
+static void autosave(void *ctx) {
+    uint64_t seen;
+    int rc;
+
+    (void)ctx;
+    atomic_store(&g_save_queued, 0);
+    seen = versions_seen();
+    if (seen == g_autosaved) {
+        return;
+    }
+    rc = start_snapshot(NULL);
+    if (rc == 0) {
+        g_autosaved = seen;
+    } else if (rc < 0) {
+        perror("snapshot");
+    }
+}
+
+static void *snapshot_ticker_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        nanosleep(&g_group_tick, NULL);
+
+        if (!g_sequencer) {
+            autosave(NULL);
+        } else if (!atomic_exchange(&g_save_queued, 1)) {
+            sequencer_submit(&g_save_task);
+        }
+    }
+    return NULL;
+}
+
+// Answers "save" with "snapshot started fork_us=<n>" or "snapshot running"
+static int queue_save(client_session *session) {
+    shared_buf *body;
+    char line[LINE_MAX];
+    uint64_t fork_us = 0;
+    int line_len;
+    int rc;
+
+    if (!g_snapshots) {
+        return queue_error(session, "NO_SNAPSHOT_DIR");
+    }
+    rc = start_snapshot(&fork_us);
+    if (rc < 0) {
+        perror("snapshot");
+        return queue_error(session, "INTERNAL");
+    }
+    line_len = rc == 0 ? snprintf(line, sizeof(line), "snapshot started fork_us=%llu\n",
+                                  (unsigned long long)fork_us)
+                       : snprintf(line, sizeof(line), "snapshot running\n");
+    body = shared_buf_new((size_t)line_len);
+    if (!body) {
+        return queue_error(session, "INTERNAL");
+    }
+    memcpy(body->data, line, (size_t)line_len);
+    return queue_reply(session, REPLY_STATS, 0, 0, body, NULL);
+}
 
-typedef struct {
-    pid_t client_pid;
-} client_thread_arg_t;
+// Gathers the pieces of a kept version into a reply body
+static int copy_span(const char *text, size_t len, void *ctx) {
+    char **out = ctx;
 
-static int g_signal_pipe[2] = {-1, -1};
-static document *g_doc = NULL;
-static pthread_mutex_t g_doc_mutex = PTHREAD_MUTEX_INITIALIZER;
+    memcpy(*out, text, len);
+    *out += len;
+    return 0;
+}
 
-static ssize_t write_full(int fd, const void *buf, size_t count) {
-    const char *cursor = (const char *)buf;
-    size_t written = 0;
+/*
+ * Answers "get_version" with the full text of an older version, as long as
+ * the document still keeps it (see -H). Reads the document, so it needs the
+ * document mutex or the sequencer thread.
+ */
+static int queue_kept_version(client_session *session, uint64_t version) {
+    const document *doc = session->entry->doc;
+    shared_buf *body;
+    char *out;
+    size_t len;
 
-    while (written < count) {
-        ssize_t rc = write(fd, cursor + written, count - written);
-        if (rc < 0) {
-            if (errno == EINTR) {
-                continue;
+    if (markdown_length_at(doc, version, &len) != 0) {
+        return queue_error(session, "NO_SUCH_VERSION");
+    }
+    body = shared_buf_new(len);
+    if (!body) {
+        return queue_error(session, "INTERNAL");
+    }
+    out = body->data;
+    (void)markdown_for_each_span_at(doc, version, copy_span, &out);
+    wait_durable(session, session->entry->wal_offset);
+    return queue_reply(session, REPLY_SNAPSHOT, 0, version, body, NULL);
+}
+
+/*
+ * Undo: commits the text of a kept version as the next version, which
+ * costs the same whatever the size of the document. The client must be on
+ * the latest version, an undo on top of commits it hasn't seen would throw
+ * them away. An open group is committed first, it arrived before the undo.
+ * The commit's changes aren't known, so delta clients get a full snapshot.
+ */
+static int undo_locked(client_session *session, const wire_request *req) {
+    doc_entry *entry = session->entry;
+    uint64_t target = req->len ? req->pos : req->version - 1;
+    size_t len;
+
+    if (entry->group_size > 0) {
+        group_commit_locked(entry);
+    }
+    if (req->version != entry->doc->version) {
+        return queue_error(session, "STALE_VERSION");
+    }
+    if (target >= req->version || markdown_length_at(entry->doc, target, &len) != 0) {
+        return queue_error(session, "NO_SUCH_VERSION");
+    }
+    // The commit hook files the undo under its author
+    entry->commit_author = session->id;
+    if (markdown_revert(entry->doc, target) != 0) {
+        return queue_error(session, commit_error());
+    }
+    if (publish_snapshot_locked(entry) != 0) {
+        return queue_error(session, "INTERNAL");
+    }
+    notify_subscribers(entry);
+    return queue_version(session, req->version);
+}
+
+/*
+ * Applies one request to the document and queues the reply. Only the
+ * document operation happens here, the caller writes the reply to the
+ * client after releasing the mutex so a slow reader can't hold up other
+ * sessions. A txn commits all of its edits as one version or none of them.
+ * In -s mode this runs on the sequencer thread, which owns every document,
+ * and no mutex is held.
+ */
+static int apply_command_locked(client_session *session, const wire_request *req,
+                                const char *payload) {
+    doc_entry *entry = session->entry;
+    document *doc = entry->doc;
+    const char *error = NULL;
+    size_t staged = 0;
+    size_t keep = markdown_staged_count(doc);    // other writers' edits in an open group
+
+    if (session->role != ROLE_WRITE) {
+        return queue_error(session, "READ_ONLY");
+    }
+    // Once the log has failed no commit could be made durable
+    if (wal_failed()) {
+        return queue_error(session, "WAL_FAILED");
+    }
+    if (req->op == OP_UNDO) {
+        return undo_locked(session, req);
+    }
+
+    if (req->version != doc->version && !can_rebase(entry, session->id, req->version)) {
+        return queue_error(session, "STALE_VERSION");
+    }
+
+    if (req->op == OP_TXN) {
+        error = stage_txn(session, req, payload ? payload : "", &staged);
+    } else if (!g_edit_ops[req->op]) {
+        error = "UNKNOWN_COMMAND";
+    } else {
+        error = stage_edit(entry, req, payload, req->version, &staged);
+    }
+
+    // Whatever a failed command staged must not ride along with the next commit
+    if (error) {
+        markdown_discard_staged(doc, keep);
+        return queue_error(session, error);
+    }
+    if (req->version != doc->version) {
+        atomic_fetch_add_explicit(&entry->rebased, 1, memory_order_relaxed);
+    }
+
+    // A rebased edit whose text was deleted meanwhile just gets the latest version
+    if (staged > 0 && g_group_commit) {
+        return join_group_locked(session, req->version);
+    }
+    if (staged > 0) {
+        uint64_t before = doc->version;
+
+        entry->commit_author = session->id;
+        markdown_increment_version(doc);
+        if (doc->version == before) {
+            markdown_discard_staged(doc, keep);
+            return queue_error(session, commit_error());
+        }
+        if (publish_snapshot_locked(entry) != 0) {
+            return queue_error(session, "INTERNAL");
+        }
+        notify_subscribers(entry);
+    }
+    return queue_version(session, req->version);
+}
+
+/*
+ * Parses the handshake line
+ * "<username> [doc=<name>] [delta=1] [proto=bin] [shm=1]".
+ * Clients that only send a username are attached to the default document
+ * and get full snapshots over the text protocol.
+ */
+static int parse_handshake(char *line, handshake_t *hs) {
+    char *save = NULL;
+    char *token = strtok_r(line, " \t", &save);
+
+    if (!token || strlen(token) >= USERNAME_MAX) {
+        return -1;
+    }
+    snprintf(hs->username, sizeof(hs->username), "%s", token);
+    snprintf(hs->doc_name, sizeof(hs->doc_name), "%s", DEFAULT_DOC_NAME);
+    hs->delta = 0;
+    hs->binary = 0;
+    hs->shm = 0;
+
+    while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+        if (strncmp(token, "doc=", 4) == 0) {
+            if (!doc_name_valid(token + 4)) {
+                return -1;
             }
+            snprintf(hs->doc_name, sizeof(hs->doc_name), "%s", token + 4);
+        } else if (strcmp(token, "delta=1") == 0) {
+            hs->delta = 1;
+        } else if (strcmp(token, "proto=bin") == 0) {
+            hs->binary = 1;
+        } else if (strcmp(token, "shm=1") == 0) {
+            hs->shm = 1;
+        } else if (strcmp(token, "delta=0") != 0 && strcmp(token, "proto=text") != 0 &&
+                   strcmp(token, "shm=0") != 0) {
             return -1;
         }
-        written += (size_t)rc;
+    }
+    return 0;
+}
+
+static void connect_signal_handler(int sig, siginfo_t *info, void *context) {
+    pid_t pid;
+
+    (void)sig;
+    (void)context;
+
+    if (!info) {
+        return;
     }
 
-    return (ssize_t)written;
+    pid = info->si_pid;
+    (void)write(g_signal_pipe[1], &pid, sizeof(pid));
 }
 
-static ssize_t read_full(int fd, void *buf, size_t count) {
-    char *cursor = (char *)buf;
-    size_t total = 0;
+/*
+ * Authenticates the handshake line and attaches the session to its
+ * document, queueing the first snapshot. On failure the error reply is
+ * queued and -1 returned, the caller flushes it and drops the client.
+ */
+static int session_start(client_session *session, char *line) {
+    handshake_t hs;
+
+    strip_newline(line);
+    if (parse_handshake(line, &hs) != 0) {
+        (void)queue_error(session, "BAD_HANDSHAKE");
+        return -1;
+    }
+    // Even a rejection is answered in the protocol the client asked for
+    session->binary = hs.binary;
+    session->want_shm = hs.shm;
 
-    while (total < count) {
-        ssize_t rc = read(fd, cursor + total, count - total);
-        if (rc < 0) {
+    if (!roles_lookup(hs.username, &session->role)) {
+        (void)queue_error(session, "UNAUTHORISED");
+        return -1;
+    }
+
+    // Only writers create documents, a reader can't make the table grow
+    session->entry = acquire_doc(hs.doc_name, session->role == ROLE_WRITE);
+    if (!session->entry) {
+        (void)queue_error(session, errno == ENOENT   ? "NO_SUCH_DOCUMENT"
+                                   : errno == ENOSPC ? "TOO_MANY_DOCUMENTS"
+                                                     : "INTERNAL");
+        return -1;
+    }
+    session->delta = hs.delta;
+    session->id = atomic_fetch_add(&g_next_session_id, 1);
+
+    // The first reply is always a full snapshot, deltas need a base
+    return queue_snapshot(session, &session->sent_version);
+}
+
+/*
+ * Reads the next request header in the session's protocol. Returns 1 for
+ * a request, -1 for a malformed text line and 0 once the client is gone.
+ */
+static int read_request(client_session *session, frame_reader *in, wire_request *req) {
+    char line[LINE_MAX];
+
+    if (session->binary) {
+        unsigned char head[WIRE_REQUEST_SIZE];
+
+        if (frame_read_exact(in, head, sizeof(head)) <= 0) {
+            return 0;
+        }
+        wire_decode_request(head, req);
+        return 1;
+    }
+
+    if (frame_read_line(in, line, sizeof(line)) <= 0) {
+        return 0;
+    }
+    strip_newline(line);
+    return parse_text_request(line, req) == 0 ? 1 : -1;
+}
+
+// Sequencer task: applies a session's request, see sequence_request
+static void run_sequenced(void *ctx) {
+    client_session *session = ctx;
+    int rc;
+
+    if (session->seq_req->op == OP_SAVE) {
+        rc = queue_save(session);
+    } else if (session->seq_req->op == OP_GET_VERSION) {
+        rc = queue_kept_version(session, session->seq_req->pos);
+    } else {
+        rc = apply_command_locked(session, session->seq_req, session->seq_payload);
+    }
+
+    // Otherwise the edit joined an open group, whose commit answers it
+    if (rc <= 0) {
+        answer_parked(session, rc);
+    }
+}
+
+/*
+ * Sequencer mode (-s): instead of taking the document mutex, the request
+ * is queued for the sequencer thread, which applies every edit in arrival
+ * order. A session thread waits for the answer; a loop session is parked
+ * and 1 is returned. Either way req and payload must stay valid until the
+ * session is answered.
+ */
+static int sequence_request(client_session *session, const wire_request *req,
+                            const char *payload) {
+    session->seq_req = req;
+    session->seq_payload = payload;
+    sequencer_submit(&session->seq_task);
+    if (session->loop) {
+        return 1;
+    }
+
+    while (sem_wait(&session->answered) != 0) {
+        // EINTR
+    }
+    return session->parked_rc;
+}
+
+/*
+ * Runs one request and queues its reply. Returns 1 instead when a loop
+ * session's edit is parked until the group commit or the sequencer
+ * answers it, -1 if the session must end.
+ */
+static int session_dispatch(client_session *session, const wire_request *req, const char *payload) {
+    int rc;
+
+    switch (req->op) {
+    case OP_GET:
+        // Readers never touch the document mutex
+        rc = queue_version(session, req->version);
+        break;
+    case OP_GET_VERSION:
+        // Old versions live in the document itself, not in its published snapshot
+        if (g_sequencer) {
+            rc = sequence_request(session, req, payload);
+        } else {
+            pthread_mutex_lock(&session->entry->mutex);
+            rc = queue_kept_version(session, req->pos);
+            pthread_mutex_unlock(&session->entry->mutex);
+        }
+        break;
+    case OP_LIST:
+        rc = queue_doc_list(session);
+        break;
+    case OP_STATS:
+        rc = queue_stats(session);
+        break;
+    case OP_SAVE:
+        if (session->role != ROLE_WRITE) {
+            rc = queue_error(session, "READ_ONLY");
+        } else if (g_sequencer) {
+            // Forked between two edits, like a commit
+            rc = sequence_request(session, req, payload);
+        } else {
+            rc = queue_save(session);
+        }
+        break;
+    case OP_SUBSCRIBE:
+        if (!session->sub && subscribe_session(session) != 0) {
+            rc = queue_error(session, "INTERNAL");
+        } else {
+            // Catch the client up from the version it sent, pushes follow
+            session->sent_version = req->version;
+            rc = queue_version(session, req->version);
+        }
+        break;
+    default:
+        if (g_sequencer) {
+            rc = sequence_request(session, req, payload);
+            break;
+        }
+        pthread_mutex_lock(&session->entry->mutex);
+        rc = apply_command_locked(session, req, payload);
+        pthread_mutex_unlock(&session->entry->mutex);
+        break;
+    }
+    return rc;
+}
+
+// Writes the session's queued replies to its ring, or to fd without one
+static int session_flush(client_session *session, int fd) {
+    // Outside every lock: with "-y commit" this is where a reply waits for fdatasync
+    if (session->durable_at > 0) {
+        if (wal_wait_durable(session->durable_at) != 0) {
+            return -1;
+        }
+        session->durable_at = 0;
+    }
+    if (session->shm) {
+        return outq_flush_ring(&session->out, &session->shm->out);
+    }
+    return outq_flush(&session->out, fd);
+}
+
+/*
+ * Answers a "shm=1" handshake on socket sock with the marker byte. Unless
+ * the handshake was rejected or the channel can't be set up, the session
+ * moves onto a new channel. Returns -1 only if the marker can't be sent.
+ */
+static int session_offer_shm(client_session *session, int sock, int accepted) {
+    shm_channel *chan = accepted ? malloc(sizeof(*chan)) : NULL;
+
+    if (chan && shm_channel_create(chan, sock) != 0) {
+        perror("shm_channel_create");
+        free(chan);
+        chan = NULL;
+    }
+    if (shm_channel_offer(sock, chan) != 0) {
+        if (chan) {
+            shm_channel_close(chan);
+            free(chan);
+        }
+        return -1;
+    }
+    if (chan) {
+        session->shm = chan;
+        atomic_fetch_add(&g_shm_sessions, 1);
+    }
+    return 0;
+}
+
+static void session_close_shm(client_session *session) {
+    shm_channel_close(session->shm);
+    free(session->shm);
+    session->shm = NULL;
+    atomic_fetch_sub(&g_shm_sessions, 1);
+}
+
+/*
+ * Waits until the subscriber's client sends something, pushing new
+ * versions to it in the meantime. Returns -1 when the client is gone.
+ */
+static int wait_for_request(client_session *session, frame_reader *in, int fd_s2c) {
+    while (frame_buffered(in) == 0) {
+        struct pollfd fds[3] = {
+            {.fd = in->fd, .events = POLLIN},
+            {.fd = session->sub->notify_pipe[0], .events = POLLIN},
+            {.fd = -1, .events = POLLIN},
+        };
+
+        // On shared memory in->fd is the socket, which only turns readable at hangup
+        if (in->ring) {
+            if (shm_ring_poll_prepare(in->ring)) {
+                return 0;
+            }
+            fds[2].fd = in->ring->wait_fd;
+        }
+
+        if (poll(fds, 3, -1) < 0) {
             if (errno == EINTR) {
                 continue;
             }
             return -1;
         }
-        if (rc == 0) {
+        if (fds[0].revents || fds[2].revents) {
             return 0;
         }
-        total += (size_t)rc;
+        if (fds[1].revents) {
+            if (queue_push(session) < 0 || session_flush(session, fd_s2c) != 0) {
+                return -1;
+            }
+        }
     }
-
-    return (ssize_t)total;
+    return 0;
 }
 
-static ssize_t read_line(int fd, char *buf, size_t capacity) {
-    size_t used = 0;
+/*
+ * FIFO transport: creates the client's FIFO pair, signals it to go ahead
+ * and opens our ends, blocking until the client has opened its own.
+ */
+static int open_session_fifos(pid_t client_pid, int *fd_c2s, int *fd_s2c) {
+    char fifo_c2s[FIFO_NAME_MAX];
+    char fifo_s2c[FIFO_NAME_MAX];
 
-    if (capacity < 2) {
-        errno = EINVAL;
+    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", client_pid);
+    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", client_pid);
+
+    unlink_fifo_if_exists(fifo_c2s);
+    unlink_fifo_if_exists(fifo_s2c);
+
+    if (mkfifo(fifo_c2s, 0666) == -1 || mkfifo(fifo_s2c, 0666) == -1) {
+        perror("mkfifo");
+        return -1;
+    }
+
+    if (kill(client_pid, SIGUSR2) == -1) {
+        perror("kill SIGUSR2");
+        return -1;
+    }
+
+    *fd_s2c = open(fifo_s2c, O_RDWR);
+    if (*fd_s2c < 0) {
+        perror("open FIFO_S2C");
+        return -1;
+    }
+
+    *fd_c2s = open(fifo_c2s, O_RDONLY);
+    if (*fd_c2s < 0) {
+        perror("open FIFO_C2S");
         return -1;
     }
+    return 0;
+}
+
+static void *client_thread_main(void *arg) {
+    client_thread_arg_t *thread_arg = (client_thread_arg_t *)arg;
+    pid_t client_pid = thread_arg->client_pid;
+    int fd_c2s = thread_arg->fd;
+    int fd_s2c = -1;
+    char line[LINE_MAX];
+    frame_reader in;
+    client_session session = {.role = ROLE_NONE, .entry = NULL, .delta = 0, .sub = NULL};
+    outbound_queue *out = &session.out;
+    int rc;
+
+    free(thread_arg);
+    outq_init(out);
+    sem_init(&session.answered, 0, 0);
+    session.seq_task.fn = run_sequenced;
+    session.seq_task.ctx = &session;
+    atomic_fetch_add(&g_sessions, 1);
+
+    // A socket carries both directions, the second descriptor keeps cleanup uniform
+    if (client_pid == 0) {
+        fd_s2c = dup(fd_c2s);
+        if (fd_s2c < 0) {
+            perror("dup");
+            goto cleanup;
+        }
+    } else if (open_session_fifos(client_pid, &fd_c2s, &fd_s2c) != 0) {
+        goto cleanup;
+    }
+
+    frame_reader_init(&in, fd_c2s);
+    if (frame_read_line(&in, line, sizeof(line)) <= 0) {
+        goto cleanup;
+    }
+
+    rc = session_start(&session, line);
+    // The marker goes out ahead of any reply, even an error
+    if (client_pid == 0 && session.want_shm) {
+        if (session_offer_shm(&session, fd_c2s, rc == 0) != 0) {
+            goto cleanup;
+        }
+        if (session.shm) {
+            in.ring = &session.shm->in;
+        }
+    }
+    if (rc != 0) {
+        (void)session_flush(&session, fd_s2c);
+        goto cleanup;
+    }
+    if (session_flush(&session, fd_s2c) != 0) {
+        goto cleanup;
+    }
 
-    while (used < capacity - 1) {
-        char ch;
-        ssize_t rc = read(fd, &ch, 1);
+    while (1) {
+        wire_request req;
+        char *payload = NULL;
+
+        if (session.sub && wait_for_request(&session, &in, fd_s2c) != 0) {
+            break;
+        }
+
+        rc = read_request(&session, &in, &req);
+        if (rc == 0 || (rc > 0 && req.op == OP_DISCONNECT)) {
+            break;
+        }
         if (rc < 0) {
-            if (errno == EINTR) {
-                continue;
+            if (queue_error(&session, "BAD_REQUEST") < 0 || session_flush(&session, fd_s2c) != 0) {
+                break;
             }
-            return -1;
+            continue;
         }
-        if (rc == 0) {
-            if (used == 0) {
-                return 0;
+
+        if (req.payload_len > 0) {
+            payload = calloc((size_t)req.payload_len + 1, 1);
+            if (!payload) {
+                if (queue_error(&session, "INTERNAL") < 0 ||
+                    session_flush(&session, fd_s2c) != 0) {
+                    break;
+                }
+                continue;
+            }
+
+            if (frame_read_exact(&in, payload, (size_t)req.payload_len) <= 0) {
+                free(payload);
+                break;
             }
-            break;
         }
 
-        buf[used++] = ch;
-        if (ch == '\n') {
+        session.input_pending = frame_buffered(&in) > 0;
+        rc = session_dispatch(&session, &req, payload);
+        free(payload);
+
+        // Client I/O happens only after the document mutex is released
+        if (rc < 0 || session_flush(&session, fd_s2c) != 0) {
             break;
         }
     }
 
-    buf[used] = '\0';
-    return (ssize_t)used;
+cleanup:
+    atomic_fetch_sub(&g_sessions, 1);
+    if (session.sub) {
+        unsubscribe_session(&session);
+    }
+    outq_clear(out);
+    sem_destroy(&session.answered);
+    if (session.shm) {
+        session_close_shm(&session);
+    }
+    if (fd_c2s >= 0) {
+        close(fd_c2s);
+    }
+    if (fd_s2c >= 0) {
+        close(fd_s2c);
+    }
+    if (client_pid > 0) {
+        unlink_session_fifos(client_pid);
+    }
+    return NULL;
 }
 
-static void strip_newline(char *text) {
-    size_t len;
+/*
+ * Event-loop mode (-e). Instead of a thread blocking on each client, every
+ * session is pinned to one of a few loop threads and driven by readiness
+ * events on its non-blocking FIFOs, socket or shared-memory rings:
+ *
+ *   handshake line -> request line -> payload bytes -> request line ...
+ *
+ * While a reply can't be written in full the session stops reading, so its
+ * memory stays bounded by the input line buffer and the outbound queue.
+ */
+static void loop_session_close(loop_session *ls);
+static void loop_session_process(loop_session *ls);
+static int loop_session_use_shm(loop_session *ls, int accepted);
+
+static void loop_session_free(void *ctx) {
+    free(ctx);
+}
 
-    if (!text) {
+static void loop_session_close(loop_session *ls) {
+    if (ls->state == SESSION_CLOSED) {
         return;
     }
+    ls->state = SESSION_CLOSED;
 
-    len = strlen(text);
-    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
-        text[--len] = '\0';
+    event_loop_remove(ls->loop, &ls->c2s_watch);
+    if (ls->s2c_watched) {
+        event_loop_remove(ls->loop, &ls->s2c_watch);
+    }
+    if (ls->notify_watched) {
+        event_loop_remove(ls->loop, &ls->notify_watch);
+    }
+    if (ls->hangup_watched) {
+        event_loop_remove(ls->loop, &ls->hangup_watch);
+    }
+    if (ls->session.sub) {
+        unsubscribe_session(&ls->session);
+    }
+    // On shared memory the watched descriptors are the channel's eventfds
+    if (ls->session.shm) {
+        close(ls->hangup_watch.fd);
+        session_close_shm(&ls->session);
+    } else {
+        close(ls->c2s_watch.fd);
+        close(ls->s2c_watch.fd);
+    }
+    if (ls->client_pid > 0) {
+        unlink_session_fifos(ls->client_pid);
     }
+
+    atomic_fetch_sub(&g_sessions, 1);
+
+    // Another thread is still answering a parked session, the resume frees it
+    if (ls->parked) {
+        return;
+    }
+    outq_clear(&ls->session.out);
+    free(ls->payload);
+
+    // Other events of this batch may still point at ls
+    ls->release.fn = loop_session_free;
+    ls->release.ctx = ls;
+    event_loop_defer(ls->loop, &ls->release);
 }
 
-static void unlink_fifo_if_exists(const char *path) {
-    if (unlink(path) == -1 && errno != ENOENT) {
-        perror("unlink");
+/*
+ * Writes what the session has queued. When the FIFO is full the session
+ * waits for EPOLLOUT (or the ring's eventfd) and stops reading requests
+ * until the queue drains.
+ */
+static void loop_session_flush(loop_session *ls) {
+    int rc = session_flush(&ls->session, ls->s2c_watch.fd);
+
+    if (rc < 0) {
+        loop_session_close(ls);
+        return;
+    }
+
+    if (rc > 0) {
+        if (!ls->output_blocked) {
+            ls->output_blocked = 1;
+            if (ls->s2c_watched) {
+                (void)event_loop_modify(ls->loop, &ls->s2c_watch, ls->s2c_events);
+            } else if (event_loop_add(ls->loop, &ls->s2c_watch, ls->s2c_events) == 0) {
+                ls->s2c_watched = 1;
+            }
+            (void)event_loop_modify(ls->loop, &ls->c2s_watch, 0);
+        }
+        return;
+    }
+
+    if (ls->output_blocked) {
+        ls->output_blocked = 0;
+        (void)event_loop_modify(ls->loop, &ls->s2c_watch, 0);
+        if (!ls->parked) {
+            (void)event_loop_modify(ls->loop, &ls->c2s_watch, EPOLLIN);
+        }
+    }
+    if (ls->close_after_flush) {
+        loop_session_close(ls);
+    } else if (ls->push_wanted) {
+        // A commit arrived while the session was busy writing
+        ls->push_wanted = 0;
+        if (queue_push(&ls->session) < 0) {
+            loop_session_close(ls);
+        } else {
+            loop_session_flush(ls);
+        }
     }
 }
 
-static const char *role_to_string(client_role_t role) {
-    if (role == ROLE_WRITE) {
-        return "write";
+/*
+ * Takes the next request header out of the input buffer. Returns 1 when
+ * one was taken, 0 if more input is needed and -1 for a malformed line.
+ */
+static int loop_session_next_request(loop_session *ls) {
+    char line[LINE_MAX];
+
+    if (ls->session.binary) {
+        unsigned char head[WIRE_REQUEST_SIZE];
+
+        if (frame_buffered(&ls->in) < sizeof(head)) {
+            return 0;
+        }
+        (void)frame_take(&ls->in, head, sizeof(head));
+        wire_decode_request(head, &ls->req);
+        return 1;
     }
-    if (role == ROLE_READ) {
-        return "read";
+
+    if (frame_next_line(&ls->in, line, sizeof(line)) == 0) {
+        return 0;
     }
-    return "unknown";
+    strip_newline(line);
+    return parse_text_request(line, &ls->req) == 0 ? 1 : -1;
 }
 
-static int lookup_role(const char *username, client_role_t *role_out) {
-    FILE *roles_file;
-    char line[LINE_MAX];
+// Runs every request the buffered input completes, as long as replies drain
+static void loop_session_process(loop_session *ls) {
+    while (ls->state != SESSION_CLOSED && !ls->output_blocked && !ls->close_after_flush &&
+           !ls->parked) {
+        int rc;
+
+        if (ls->state == SESSION_PAYLOAD) {
+            ls->payload_got += frame_take(&ls->in, ls->payload + ls->payload_got,
+                                          (size_t)ls->req.payload_len - ls->payload_got);
+            if (ls->payload_got < ls->req.payload_len) {
+                return;
+            }
 
-    roles_file = fopen("roles.txt", "r");
-    if (!roles_file) {
-        return 0;
-    }
+            ls->session.input_pending = frame_buffered(&ls->in) > 0;
+            rc = session_dispatch(&ls->session, &ls->req, ls->payload);
+            ls->state = SESSION_REQUEST;
+            // The sequencer may still be reading it, the resume frees it then
+            if (rc <= 0) {
+                free(ls->payload);
+                ls->payload = NULL;
+            }
+        } else if (ls->state == SESSION_HANDSHAKE) {
+            char line[LINE_MAX];
 
-    while (fgets(line, sizeof(line), roles_file) != NULL) {
-        char file_user[USERNAME_MAX];
-        char file_role[ROLE_MAX];
+            if (frame_next_line(&ls->in, line, sizeof(line)) == 0) {
+                return;
+            }
+            // A rejected client still gets its error reply before we hang up
+            if (session_start(&ls->session, line) != 0) {
+                ls->close_after_flush = 1;
+            }
+            rc = 0;
+            if (ls->client_pid == 0 && ls->session.want_shm &&
+                loop_session_use_shm(ls, !ls->close_after_flush) != 0) {
+                rc = -1;
+            }
+            ls->state = SESSION_REQUEST;
+        } else {
+            int parsed = loop_session_next_request(ls);
 
-        if (sscanf(line, "%63s %15s", file_user, file_role) != 2) {
-            continue;
-        }
-        if (strcmp(file_user, username) != 0) {
-            continue;
+            if (parsed == 0) {
+                return;
+            }
+            if (parsed < 0) {
+                rc = queue_error(&ls->session, "BAD_REQUEST");
+            } else if (ls->req.op == OP_DISCONNECT) {
+                loop_session_close(ls);
+                return;
+            } else if (ls->req.payload_len > 0) {
+                ls->payload = calloc((size_t)ls->req.payload_len + 1, 1);
+                if (!ls->payload) {
+                    rc = queue_error(&ls->session, "INTERNAL");
+                } else {
+                    ls->payload_got = 0;
+                    ls->state = SESSION_PAYLOAD;
+                    continue;
+                }
+            } else {
+                ls->session.input_pending = frame_buffered(&ls->in) > 0;
+                rc = session_dispatch(&ls->session, &ls->req, NULL);
+            }
         }
 
-        if (strcmp(file_role, "read") == 0) {
-            *role_out = ROLE_READ;
-            fclose(roles_file);
-            return 1;
+        if (rc < 0) {
+            loop_session_close(ls);
+            return;
         }
-        if (strcmp(file_role, "write") == 0) {
-            *role_out = ROLE_WRITE;
-            fclose(roles_file);
-            return 1;
+        if (rc > 0) {
+            // Parked until answered, nothing is read or written meanwhile
+            ls->parked = 1;
+            (void)event_loop_modify(ls->loop, &ls->c2s_watch, 0);
+            return;
+        }
+        if (ls->session.sub && !ls->notify_watched) {
+            ls->notify_watch.fd = ls->session.sub->notify_pipe[0];
+            if (event_loop_add(ls->loop, &ls->notify_watch, EPOLLIN) == 0) {
+                ls->notify_watched = 1;
+            }
         }
+        loop_session_flush(ls);
     }
+}
 
-    fclose(roles_file);
-    return 0;
+/*
+ * Posted by answer_parked once the parked request is answered: its reply
+ * is queued, or parked_rc says the session must end.
+ */
+static void loop_session_resume(void *ctx) {
+    loop_session *ls = ctx;
+
+    ls->parked = 0;
+    free(ls->payload);
+    ls->payload = NULL;
+    if (ls->state == SESSION_CLOSED) {
+        outq_clear(&ls->session.out);
+        free(ls);
+        return;
+    }
+    if (ls->session.parked_rc < 0) {
+        loop_session_close(ls);
+        return;
+    }
+    if (!ls->output_blocked) {
+        (void)event_loop_modify(ls->loop, &ls->c2s_watch, EPOLLIN);
+    }
+    loop_session_flush(ls);
+    if (ls->state != SESSION_CLOSED) {
+        loop_session_process(ls);
+    }
 }
 
-static int send_error(int fd, const char *message) {
-    char line[LINE_MAX];
+static void loop_session_on_input(void *ctx, uint32_t events) {
+    loop_session *ls = ctx;
 
-    snprintf(line, sizeof(line), "ERROR %s\n", message);
-    return (write_full(fd, line, strlen(line)) < 0) ? -1 : 0;
-}
+    if (ls->state == SESSION_CLOSED) {
+        return;
+    }
 
-static int send_snapshot_locked(int fd, client_role_t role) {
-    char header[LINE_MAX];
-    char *flat;
-    size_t flat_len;
+    if (events & EPOLLIN) {
+        // Whatever was left unparsed is less than a line, so there is room to read
+        while (ls->state != SESSION_CLOSED && !ls->output_blocked && !ls->parked) {
+            ssize_t rc = frame_fill(&ls->in);
+            if (rc > 0) {
+                loop_session_process(ls);
+                continue;
+            }
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            // The client closed its end
+            loop_session_close(ls);
+            return;
+        }
+        return;
+    }
 
-    flat = markdown_flatten(g_doc);
-    if (!flat) {
-        return send_error(fd, "INTERNAL");
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        loop_session_close(ls);
     }
+}
 
-    flat_len = strlen(flat);
-    snprintf(header, sizeof(header), "SNAPSHOT %s %llu %zu\n",
-             role_to_string(role),
-             (unsigned long long)g_doc->version,
-             flat_len);
+static void loop_session_on_output(void *ctx, uint32_t events) {
+    loop_session *ls = ctx;
 
-    if (write_full(fd, header, strlen(header)) < 0 ||
-        write_full(fd, flat, flat_len) < 0) {
-        free(flat);
-        return -1;
+    if (ls->state == SESSION_CLOSED) {
+        return;
+    }
+    if (events & EPOLLERR) {
+        loop_session_close(ls);
+        return;
     }
 
-    free(flat);
-    return 0;
+    loop_session_flush(ls);
+    // Requests that were held back while the reply was blocked
+    if (ls->state != SESSION_CLOSED && !ls->output_blocked) {
+        loop_session_process(ls);
+    }
 }
 
-static int apply_command_locked(const char *command,
-                                uint64_t base_version,
-                                size_t pos,
-                                size_t len,
-                                const char *payload,
-                                client_role_t role,
-                                int fd_s2c) {
-    int rc = -1;
+static void loop_session_on_notify(void *ctx, uint32_t events) {
+    loop_session *ls = ctx;
+    char drain[64];
 
-    if (strcmp(command, "get") == 0) {
-        return send_snapshot_locked(fd_s2c, role);
+    (void)events;
+    if (ls->state == SESSION_CLOSED) {
+        return;
     }
 
-    if (role != ROLE_WRITE) {
-        return send_error(fd_s2c, "READ_ONLY");
+    // "pending" stays set, later commits coalesce until queue_push clears it
+    while (read(ls->notify_watch.fd, drain, sizeof(drain)) > 0) {
     }
+    // A parked session's outbound queue belongs to whoever answers it
+    if (ls->output_blocked || ls->parked) {
+        ls->push_wanted = 1;
+        return;
+    }
+    if (queue_push(&ls->session) < 0) {
+        loop_session_close(ls);
+        return;
+    }
+    loop_session_flush(ls);
+}
+
+/*
+ * Shared-memory sessions: the client never writes to its socket after the
+ * handshake, so the socket turning readable means it is gone. Requests it
+ * left in the ring still run, replies to them fail and close the session.
+ */
+static void loop_session_on_hangup(void *ctx, uint32_t events) {
+    loop_session *ls = ctx;
 
-    if (base_version != g_doc->version) {
-        return send_error(fd_s2c, "STALE_VERSION");
+    (void)events;
+    if (ls->state == SESSION_CLOSED) {
+        return;
     }
 
-    if (strcmp(command, "insert") == 0) {
-        rc = markdown_insert(g_doc, base_version, pos, payload ? payload : "");
-    } else if (strcmp(command, "delete") == 0) {
-        rc = markdown_delete(g_doc, base_version, pos, len);
-    } else if (strcmp(command, "bold") == 0) {
-        rc = markdown_bold(g_doc, base_version, pos, len);
-    } else if (strcmp(command, "italic") == 0) {
-        rc = markdown_italic(g_doc, base_version, pos, len);
-    } else if (strcmp(command, "heading") == 0) {
-        rc = markdown_heading(g_doc, base_version, len, pos);
-    } else if (strcmp(command, "newline") == 0) {
-        rc = markdown_newline(g_doc, base_version, pos);
+    ls->session.shm->in.peer_gone = 1;
+    ls->session.shm->out.peer_gone = 1;
+    event_loop_remove(ls->loop, &ls->hangup_watch);
+    ls->hangup_watched = 0;
+
+    if (ls->output_blocked) {
+        loop_session_flush(ls);
     } else {
-        return send_error(fd_s2c, "UNKNOWN_COMMAND");
+        loop_session_on_input(ls, EPOLLIN);
     }
+}
 
-    if (rc != 0) {
-        return send_error(fd_s2c, "INVALID_EDIT");
+/*
+ * Answers a "shm=1" handshake and, once the client has the channel, swaps
+ * the socket watches for the rings' eventfds. The socket stays open as the
+ * hangup watch, its duplicate is no longer needed.
+ */
+static int loop_session_use_shm(loop_session *ls, int accepted) {
+    int sock = ls->c2s_watch.fd;
+    shm_channel *chan;
+
+    if (session_offer_shm(&ls->session, sock, accepted) != 0) {
+        return -1;
+    }
+    chan = ls->session.shm;
+    if (!chan) {
+        return 0;
     }
 
-    markdown_increment_version(g_doc);
-    return send_snapshot_locked(fd_s2c, role);
+    // Nothing was written before the handshake, so s2c_watch isn't registered yet
+    event_loop_remove(ls->loop, &ls->c2s_watch);
+    close(ls->s2c_watch.fd);
+    ls->hangup_watch.fd = sock;
+    ls->c2s_watch.fd = chan->in.wait_fd;
+    ls->s2c_watch.fd = chan->out.wait_fd;
+    ls->s2c_events = EPOLLIN;
+    chan->in.nonblock = 1;
+    chan->out.nonblock = 1;
+    ls->in.ring = &chan->in;
+
+    if (event_loop_add(ls->loop, &ls->c2s_watch, EPOLLIN) != 0 ||
+        event_loop_add(ls->loop, &ls->hangup_watch, EPOLLIN) != 0) {
+        return -1;
+    }
+    ls->hangup_watched = 1;
+    return 0;
 }
 
-static void connect_signal_handler(int sig, siginfo_t *info, void *context) {
-    pid_t pid;
+/*
+ * Hands a session to a loop thread. Both descriptors must already be
+ * non-blocking; client_pid names the session's FIFOs, 0 for a socket. The
+ * descriptors are closed if the session can't be started.
+ */
+static void start_loop_session(pid_t client_pid, int fd_c2s, int fd_s2c) {
+    loop_session *ls = calloc(1, sizeof(*ls));
 
-    (void)sig;
-    (void)context;
+    if (!ls) {
+        goto fail;
+    }
 
-    if (!info) {
-        return;
+    ls->client_pid = client_pid;
+    ls->loop = event_loop_pick();
+    ls->state = SESSION_HANDSHAKE;
+    ls->session.role = ROLE_NONE;
+    outq_init(&ls->session.out);
+    frame_reader_init(&ls->in, fd_c2s);
+    ls->c2s_watch = (event_watch){fd_c2s, loop_session_on_input, ls};
+    ls->s2c_watch = (event_watch){fd_s2c, loop_session_on_output, ls};
+    ls->notify_watch = (event_watch){-1, loop_session_on_notify, ls};
+    ls->hangup_watch = (event_watch){-1, loop_session_on_hangup, ls};
+    ls->s2c_events = EPOLLOUT;
+    ls->session.loop = ls->loop;
+    ls->session.resume = (event_deferred){loop_session_resume, ls, NULL};
+    ls->session.seq_task.fn = run_sequenced;
+    ls->session.seq_task.ctx = &ls->session;
+
+    // The loop thread owns ls from here on. Anything the client already
+    // wrote is still buffered and shows up as readable right away.
+    atomic_fetch_add(&g_sessions, 1);
+    if (event_loop_add(ls->loop, &ls->c2s_watch, EPOLLIN) != 0) {
+        perror("epoll_ctl");
+        atomic_fetch_sub(&g_sessions, 1);
+        goto fail;
     }
+    return;
 
-    pid = info->si_pid;
-    (void)write(g_signal_pipe[1], &pid, sizeof(pid));
+fail:
+    close(fd_c2s);
+    close(fd_s2c);
+    if (client_pid > 0) {
+        unlink_session_fifos(client_pid);
+    }
+    free(ls);
 }
 
-static void *client_thread_main(void *arg) {
-    client_thread_arg_t *thread_arg = (client_thread_arg_t *)arg;
-    pid_t client_pid = thread_arg->client_pid;
+/*
+ * Sets up the FIFOs for a client that signalled us and hands the session
+ * to a loop thread. Both FIFOs are opened non-blocking before the client is
+ * told to connect, so the accepting thread never waits on a client.
+ */
+static void start_fifo_loop_session(pid_t client_pid) {
     char fifo_c2s[FIFO_NAME_MAX];
     char fifo_s2c[FIFO_NAME_MAX];
     int fd_c2s = -1;
     int fd_s2c = -1;
-    client_role_t role = ROLE_NONE;
-    char username[USERNAME_MAX];
-    char line[LINE_MAX];
-
-    free(thread_arg);
 
     snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", client_pid);
     snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", client_pid);
@@ -282,138 +2562,605 @@ static void *client_thread_main(void *arg) {
     unlink_fifo_if_exists(fifo_c2s);
     unlink_fifo_if_exists(fifo_s2c);
 
-    if (mkfifo(fifo_c2s, 0666) == -1) {
-        perror("mkfifo FIFO_C2S");
-        return NULL;
+    if (mkfifo(fifo_c2s, 0666) == -1 || mkfifo(fifo_s2c, 0666) == -1) {
+        perror("mkfifo");
+        goto fail;
     }
-    if (mkfifo(fifo_s2c, 0666) == -1) {
-        perror("mkfifo FIFO_S2C");
-        unlink_fifo_if_exists(fifo_c2s);
-        return NULL;
+
+    fd_s2c = open(fifo_s2c, O_RDWR | O_NONBLOCK);
+    fd_c2s = open(fifo_c2s, O_RDONLY | O_NONBLOCK);
+    if (fd_s2c < 0 || fd_c2s < 0) {
+        perror("open FIFO");
+        goto fail;
     }
 
     if (kill(client_pid, SIGUSR2) == -1) {
         perror("kill SIGUSR2");
-        goto cleanup;
+        goto fail;
     }
 
-    fd_s2c = open(fifo_s2c, O_RDWR);
-    if (fd_s2c < 0) {
-        perror("open FIFO_S2C");
-        goto cleanup;
+    start_loop_session(client_pid, fd_c2s, fd_s2c);
+    return;
+
+fail:
+    if (fd_c2s >= 0) {
+        close(fd_c2s);
+    }
+    if (fd_s2c >= 0) {
+        close(fd_s2c);
     }
+    unlink_session_fifos(client_pid);
+}
 
-    fd_c2s = open(fifo_c2s, O_RDONLY);
-    if (fd_c2s < 0) {
-        perror("open FIFO_C2S");
-        goto cleanup;
+/*
+ * Socket transport: a client connects to "SOCK_<server pid>" and sends its
+ * handshake line right away, no signals and no FIFOs on disk. Connects
+ * wait in the listen backlog, where pending signals would merge into one.
+ */
+static int open_listener(void) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "SOCK_%d", getpid());
+    snprintf(g_socket_path, sizeof(g_socket_path), "%s", addr.sun_path);
+    unlink_fifo_if_exists(g_socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    if (read_line(fd_c2s, username, sizeof(username)) <= 0) {
-        goto cleanup;
+// fd is the accepted socket, or -1 for a FIFO session
+static void start_session_thread(pid_t client_pid, int fd) {
+    client_thread_arg_t *thread_arg = malloc(sizeof(*thread_arg));
+    pthread_t thread_id;
+
+    if (!thread_arg) {
+        goto fail;
     }
-    strip_newline(username);
+    thread_arg->client_pid = client_pid;
+    thread_arg->fd = fd;
 
-    if (!lookup_role(username, &role)) {
-        (void)send_error(fd_s2c, "UNAUTHORISED");
-        goto cleanup;
+    if (pthread_create(&thread_id, NULL, client_thread_main, thread_arg) != 0) {
+        free(thread_arg);
+        goto fail;
     }
+    pthread_detach(thread_id);
+    return;
 
-    pthread_mutex_lock(&g_doc_mutex);
-    if (send_snapshot_locked(fd_s2c, role) < 0) {
-        pthread_mutex_unlock(&g_doc_mutex);
-        goto cleanup;
+fail:
+    if (fd >= 0) {
+        close(fd);
     }
-    pthread_mutex_unlock(&g_doc_mutex);
+}
 
+// Starts a session for every connection waiting in the backlog
+static void accept_clients(int listen_fd, int loop_mode) {
     while (1) {
-        char command[ROLE_MAX];
-        unsigned long long version_value = 0;
-        unsigned long long pos_value = 0;
-        unsigned long long len_value = 0;
-        unsigned long long payload_len = 0;
-        char *payload = NULL;
+        int fd = accept(listen_fd, NULL, NULL);
+        int fd_out;
 
-        if (read_line(fd_c2s, line, sizeof(line)) <= 0) {
-            break;
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
         }
-        strip_newline(line);
 
-        if (strcmp(line, "DISCONNECT") == 0) {
-            break;
+        if (!loop_mode) {
+            start_session_thread(0, fd);
+            continue;
         }
-
-        if (sscanf(line, "REQUEST %15s %llu %llu %llu %llu",
-                   command,
-                   &version_value,
-                   &pos_value,
-                   &len_value,
-                   &payload_len) != 5) {
-            (void)send_error(fd_s2c, "BAD_REQUEST");
+        // Separate descriptors so input and output get their own epoll watch
+        fd_out = fcntl(fd, F_SETFL, O_NONBLOCK) == 0 ? dup(fd) : -1;
+        if (fd_out < 0) {
+            close(fd);
             continue;
         }
+        start_loop_session(0, fd, fd_out);
+    }
+}
 
-        if (payload_len > 0) {
-            payload = calloc((size_t)payload_len + 1, 1);
-            if (!payload) {
-                (void)send_error(fd_s2c, "INTERNAL");
-                continue;
-            }
+// Removes the socket file, then dies of the signal as before
+static void shutdown_signal_handler(int sig) {
+    unlink(g_socket_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
-            if (read_full(fd_c2s, payload, (size_t)payload_len) <= 0) {
-                free(payload);
-                break;
+// Lets one process hold a descriptor pair per session well past the default limit
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/*
+ * Swaps in a document restored from disk. Only used at startup, before
+ * any session can see the entry.
+ */
+static void replace_doc(doc_entry *entry, document *doc) {
+    markdown_free(entry->doc);
+    entry->doc = doc;
+    markdown_set_commit_hook(doc, record_commit, entry);
+    // Without room for its history the document only loses "get_version" and "undo"
+    (void)markdown_set_history(doc, g_history);
+}
+
+// The entry a restored document name belongs to, NULL if the name isn't valid
+static doc_entry *restore_entry(const char *name, size_t name_len) {
+    char copy[DOC_NAME_MAX];
+
+    if (name_len >= sizeof(copy)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    if (!doc_name_valid(copy)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return acquire_doc(copy, 1);
+}
+
+static int restore_checkpoint_doc(const checkpoint_doc *saved, void *ctx) {
+    doc_entry *entry = restore_entry(saved->name, saved->name_len);
+    document *doc;
+
+    (void)ctx;
+    if (!entry) {
+        return -1;
+    }
+    doc = markdown_load(saved->text, saved->len, saved->version);
+    if (!doc) {
+        return -1;
+    }
+    replace_doc(entry, doc);
+    g_restore.docs++;
+    return 0;
+}
+
+// NUL-terminated copy of the insert being replayed
+typedef struct {
+    char *text;
+    size_t cap;
+} replay_scratch;
+
+/*
+ * Applies one log record through the same staging calls a client's edits
+ * go through. Edits at one position are merged newest first, so staging
+ * the changes last to first keeps them in record order.
+ */
+static int replay_record(const wal_record *record, void *ctx) {
+    replay_scratch *scratch = ctx;
+    doc_entry *entry = restore_entry(record->name, record->name_len);
+    document *doc;
+
+    if (!entry) {
+        return -1;
+    }
+    doc = entry->doc;
+    if (record->version <= doc->version) {
+        g_restore.skipped++;
+        return 0;
+    }
+
+    if (record->kind == WAL_RECORD_SNAPSHOT) {
+        document *loaded = markdown_load(record->text, record->len, record->version);
+
+        if (!loaded) {
+            return -1;
+        }
+        replace_doc(entry, loaded);
+        g_restore.replayed++;
+        return 0;
+    }
+    if (record->version != doc->version + 1) {
+        fprintf(stderr, "wal: %s jumps from version %llu to %llu\n", entry->name,
+                (unsigned long long)doc->version, (unsigned long long)record->version);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = record->count; i-- > 0;) {
+        const change *c = &record->changes[i];
+        int rc;
+
+        if (c->type == EDIT_DELETE) {
+            rc = markdown_delete(doc, doc->version, c->pos, c->len);
+        } else {
+            if (c->len >= scratch->cap) {
+                char *grown = realloc(scratch->text, c->len + 1);
+
+                if (!grown) {
+                    markdown_discard_staged(doc, 0);
+                    return -1;
+                }
+                scratch->text = grown;
+                scratch->cap = c->len + 1;
             }
+            memcpy(scratch->text, c->text, c->len);
+            scratch->text[c->len] = '\0';
+            rc = markdown_insert(doc, doc->version, c->pos, scratch->text);
+        }
+        if (rc != 0) {
+            markdown_discard_staged(doc, 0);
+            return -1;
         }
+    }
+    markdown_increment_version(doc);
+    g_restore.replayed++;
+    return 0;
+}
 
-        pthread_mutex_lock(&g_doc_mutex);
-        if (apply_command_locked(command,
-                                 (uint64_t)version_value,
-                                 (size_t)pos_value,
-                                 (size_t)len_value,
-                                 payload,
-                                 role,
-                                 fd_s2c) < 0) {
-            pthread_mutex_unlock(&g_doc_mutex);
-            free(payload);
-            break;
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) * 1e3 + (double)(to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/*
+ * With -w: maps the latest checkpoint, replays the log records written
+ * after it and opens the log for appending. Only a document left exactly
+ * as the checkpoint has it is published straight from the mapping, the
+ * others are copied once. Runs before any session or background thread
+ * exists.
+ */
+static int restore_documents(const char *wal_path, wal_sync_mode mode, uint64_t every,
+                             uint64_t *checkpoint_offset_out) {
+    struct timespec start;
+    struct timespec replay_start;
+    struct timespec replay_done;
+    struct timespec done;
+    replay_scratch scratch = {NULL, 0};
+    wal_replay_stats replay;
+    uint64_t from;
+    uint64_t offset;
+    double replay_ms;
+    int rc;
+
+    if (snprintf(g_checkpoint_path, sizeof(g_checkpoint_path), "%s.ckpt", wal_path) >=
+        (int)sizeof(g_checkpoint_path)) {
+        fprintf(stderr, "wal: %s: path too long\n", wal_path);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (checkpoint_load(g_checkpoint_path, &from, restore_checkpoint_doc, NULL) < 0) {
+        fprintf(stderr, "checkpoint: %s: %s\n", g_checkpoint_path, strerror(errno));
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+    rc = wal_replay(wal_path, from, replay_record, &scratch, &replay);
+    clock_gettime(CLOCK_MONOTONIC, &replay_done);
+    free(scratch.text);
+    if (rc != 0) {
+        fprintf(stderr, "wal: replaying %s: %s at offset %llu\n", wal_path, strerror(errno),
+                (unsigned long long)replay.end);
+        return -1;
+    }
+    if (replay.dropped > 0) {
+        fprintf(stderr, "wal: dropping %llu bytes of torn tail\n",
+                (unsigned long long)replay.dropped);
+    }
+    if (wal_open(wal_path, mode, every, replay.end) != 0) {
+        perror("wal");
+        return -1;
+    }
+
+    // Everything restored is in the log up to where appending resumes
+    offset = wal_offset();
+    for (size_t i = 0; i < DOC_SHARD_COUNT; ++i) {
+        for (doc_entry *entry = g_shards[i].head; entry != NULL; entry = entry->next) {
+            entry->wal_offset = offset;
+            if (publish_snapshot_locked(entry) != 0) {
+                perror("restore: publish");
+                return -1;
+            }
         }
-        pthread_mutex_unlock(&g_doc_mutex);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done);
+
+    replay_ms = elapsed_ms(&replay_start, &replay_done);
+    g_restore.ms = elapsed_ms(&start, &done);
+    g_restore.records_per_sec = replay_ms > 0 ? (double)g_restore.replayed * 1e3 / replay_ms : 0;
+    printf("restore: %zu documents from checkpoint in %.1f ms, %llu log records replayed "
+           "(%llu skipped) in %.1f ms at %.0f records/s, ready in %.1f ms\n",
+           g_restore.docs, elapsed_ms(&start, &replay_start),
+           (unsigned long long)g_restore.replayed, (unsigned long long)g_restore.skipped,
+           replay_ms, g_restore.records_per_sec, g_restore.ms);
+    *checkpoint_offset_out = from;
+    return 0;
+}
 
-        free(payload);
+/*
+ * Writes a checkpoint from the published snapshots. No document mutex is
+ * taken, so commits carry on meanwhile; the snapshots are pinned by their
+ * references until they are written out.
+ *
+ * Replay starts where the log stood before the documents were listed.
+ * Whatever is logged later lies past that, documents created meanwhile
+ * included. Only a document whose next version was already being logged
+ * when its snapshot was read may have that record further back, so it
+ * moves the start back to the end of its snapshot's record.
+ */
+static int take_checkpoint(void) {
+    uint64_t from = wal_offset();
+    checkpoint_doc *docs = NULL;
+    shared_buf **bodies = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    int rc = 0;
+
+    for (size_t i = 0; i < DOC_SHARD_COUNT && rc == 0; ++i) {
+        pthread_mutex_lock(&g_shards[i].mutex);
+        for (doc_entry *entry = g_shards[i].head; entry != NULL; entry = entry->next) {
+            published_snapshot *snap;
+
+            if (count == cap) {
+                size_t grown = cap ? cap * 2 : 16;
+                checkpoint_doc *more_docs = realloc(docs, grown * sizeof(*docs));
+                shared_buf **more_bodies = more_docs ? realloc(bodies, grown * sizeof(*bodies))
+                                                     : NULL;
+
+                docs = more_docs ? more_docs : docs;
+                bodies = more_bodies ? more_bodies : bodies;
+                if (!more_bodies) {
+                    rc = -1;
+                    break;
+                }
+                cap = grown;
+            }
+
+            epoch_enter();
+            snap = atomic_load(&entry->current);
+            bodies[count] = shared_buf_ref(snap->body);
+            docs[count] = (checkpoint_doc){entry->name, strlen(entry->name), snap->version,
+                                           snap->body->data, snap->body->len};
+            if (atomic_load(&entry->wal_logging) > snap->version && snap->wal_offset < from) {
+                from = snap->wal_offset;
+            }
+            epoch_exit();
+            count++;
+        }
+        pthread_mutex_unlock(&g_shards[i].mutex);
     }
 
-cleanup:
-    if (fd_c2s >= 0) {
-        close(fd_c2s);
+    // The log has to hold everything the checkpoint does before it replaces the old one
+    if (rc == 0 && wal_flush() != 0) {
+        rc = -1;
     }
-    if (fd_s2c >= 0) {
-        close(fd_s2c);
+    if (rc == 0) {
+        rc = checkpoint_write(g_checkpoint_path, from, docs, count);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        shared_buf_release(bodies[i]);
+    }
+    free(docs);
+    free(bodies);
+    return rc;
+}
+
+static void *checkpoint_main(void *arg) {
+    uint64_t last = *(uint64_t *)arg;
+    struct timespec tick = {0, 100 * 1000 * 1000};
+
+    free(arg);
+    while (1) {
+        uint64_t offset;
+        wal_stats wal;
+
+        nanosleep(&tick, NULL);
+        wal_get_stats(&wal);
+        if (wal.failed) {
+            fprintf(stderr, "checkpoint: the log failed, no more checkpoints\n");
+            return NULL;
+        }
+        offset = wal_offset();
+        if (offset - last < g_checkpoint_every) {
+            continue;
+        }
+        if (take_checkpoint() == 0) {
+            atomic_fetch_add(&g_checkpoints, 1);
+        } else {
+            perror("checkpoint");
+        }
+        last = offset;
     }
-    unlink_fifo_if_exists(fifo_c2s);
-    unlink_fifo_if_exists(fifo_s2c);
-    return NULL;
+}
+
+static void print_server_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-e loop_threads] [-g [-m max_group]] [-s cpu]\n"
+            "       [-w wal_file [-y sync] [-c checkpoint_bytes]] [-S snapshot_dir]\n"
+            "       [-H versions]\n"
+            "       <time_interval_seconds>\n"
+            "  -e N  multiplex sessions over N event-loop threads\n"
+            "  -g    group commit: commit the edits of all writers once per time interval\n"
+            "  -m N  with -g, commit early once N requests are waiting\n"
+            "  -s N  apply every edit on one sequencer thread pinned to CPU N\n"
+            "  -w F  log every commit to the write-ahead log F\n"
+            "  -y P  when the log is synced to disk: commit, <N>ms or <N>bytes (default 10ms)\n"
+            "  -c N  write a checkpoint each time the log grew by N bytes (default 8 MB)\n"
+            "  -S D  have a forked child write every document to the directory D on\n"
+            "        \"save\", and once per time interval if anything changed\n"
+            "  -H N  keep the last N versions of each document for \"get_version\" and\n"
+            "        \"undo\" (default 1024)\n",
+            prog);
 }
 
 int main(int argc, char **argv) {
     struct sigaction sa;
+    long loop_threads = 0;
+    long group_max = 0;
+    double interval;
+    char *end = NULL;
+    const char *wal_path = NULL;
+    wal_sync_mode wal_mode = WAL_SYNC_MS;
+    uint64_t wal_every = 10;
+    int listen_fd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:e:gm:s:w:y:H:S:")) != -1) {
+        if (opt == 'e') {
+            errno = 0;
+            loop_threads = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno != 0 || loop_threads <= 0) {
+                print_server_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == 'g') {
+            g_group_commit = 1;
+        } else if (opt == 'm') {
+            errno = 0;
+            group_max = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno != 0 || group_max <= 0) {
+                print_server_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == 's') {
+            long cpu;
+
+            errno = 0;
+            cpu = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno != 0 || cpu < 0 ||
+                cpu > sequencer_max_cpu()) {
+                print_server_usage(argv[0]);
+                return 1;
+            }
+            g_sequencer_cpu = (int)cpu;
+            g_sequencer = 1;
+        } else if (opt == 'c') {
+            errno = 0;
+            g_checkpoint_every = strtoull(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno != 0 || g_checkpoint_every == 0 ||
+                optarg[0] == '-') {
+                print_server_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == 'H') {
+            errno = 0;
+            g_history = strtoull(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno != 0 || optarg[0] == '-') {
+                print_server_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == 'S') {
+            if (snapshot_init(optarg) != 0) {
+                perror(optarg);
+                return 1;
+            }
+            g_snapshots = 1;
+        } else if (opt == 'w') {
+            wal_path = optarg;
+        } else if (opt == 'y') {
+            if (wal_parse_policy(optarg, &wal_mode, &wal_every) != 0) {
+                print_server_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_server_usage(argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <time_interval_seconds>\n", argv[0]);
+    if (argc - optind != 1) {
+        print_server_usage(argv[0]);
         return 1;
     }
+    // Fractions of a second are fine, "-g 0.05" commits every 50 ms
+    interval = strtod(argv[optind], &end);
+    if (end == argv[optind] || *end != '\0' || interval <= 0 ||
+        (g_group_commit && interval > 3600)) {
+        print_server_usage(argv[0]);
+        return 1;
+    }
+    g_group_tick.tv_sec = (time_t)interval;
+    g_group_tick.tv_nsec = (long)((interval - (double)g_group_tick.tv_sec) * 1e9);
+    g_group_max = (size_t)group_max;
 
     if (pipe(g_signal_pipe) == -1) {
         perror("pipe");
         return 1;
     }
 
-    g_doc = markdown_init();
-    if (!g_doc) {
+    // Without inotify the roles loaded now stay in force until a restart
+    if (roles_start("roles.txt") != 0) {
+        perror("roles: watching roles.txt");
+    }
+
+    init_doc_shards();
+    if (wal_path) {
+        uint64_t *checkpoint_offset = malloc(sizeof(*checkpoint_offset));
+        pthread_t checkpointer;
+
+        if (!checkpoint_offset ||
+            restore_documents(wal_path, wal_mode, wal_every, checkpoint_offset) != 0) {
+            return 1;
+        }
+        if (pthread_create(&checkpointer, NULL, checkpoint_main, checkpoint_offset) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(checkpointer);
+    }
+    if (!acquire_doc(DEFAULT_DOC_NAME, 1)) {
         perror("markdown_init");
         return 1;
     }
 
+    if (loop_threads > 0) {
+        g_mode = "event_loop";
+        raise_fd_limit();
+        if (event_loop_pool_start((size_t)loop_threads) != 0) {
+            perror("event_loop_pool_start");
+            return 1;
+        }
+    }
+
+    if (g_sequencer) {
+        g_tick_task.fn = commit_open_groups;
+        g_save_task.fn = autosave;
+        if (sequencer_start(g_sequencer_cpu) != 0) {
+            perror("sequencer_start");
+            return 1;
+        }
+    }
+
+    if (g_group_commit) {
+        pthread_t ticker;
+
+        if (pthread_create(&ticker, NULL, group_ticker_main, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(ticker);
+    }
+
+    if (g_snapshots) {
+        pthread_t snapshotter;
+
+        if (pthread_create(&snapshotter, NULL, snapshot_ticker_main, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(snapshotter);
+    }
+
     memset(&sa, 0, sizeof(sa));
     sa.sa_sigaction = connect_signal_handler;
     sa.sa_flags = SA_SIGINFO;
@@ -421,33 +3168,50 @@ int main(int argc, char **argv) {
 
     if (sigaction(SIGUSR1, &sa, NULL) == -1) {
         perror("sigaction");
-        markdown_free(g_doc);
         return 1;
     }
 
+    // A client that hangs up on its socket must not take the server down with it
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    (void)sigaction(SIGPIPE, &sa, NULL);
+
+    // Signal handshakes keep working if the socket can't be set up
+    listen_fd = open_listener();
+    if (listen_fd < 0) {
+        perror("socket listener");
+    } else {
+        sa.sa_handler = shutdown_signal_handler;
+        (void)sigaction(SIGINT, &sa, NULL);
+        (void)sigaction(SIGTERM, &sa, NULL);
+    }
+
     printf("Server PID: %d\n", getpid());
     fflush(stdout);
 
     while (1) {
-        client_thread_arg_t *thread_arg;
-        pthread_t thread_id;
+        struct pollfd fds[2] = {
+            {.fd = g_signal_pipe[0], .events = POLLIN},
+            {.fd = listen_fd, .events = POLLIN},
+        };
         pid_t client_pid;
 
-        if (read_full(g_signal_pipe[0], &client_pid, sizeof(client_pid)) <= 0) {
-            continue;
+        if (poll(fds, 2, -1) < 0) {
+            continue;   // EINTR, a SIGUSR1 arrived
         }
-
-        thread_arg = malloc(sizeof(*thread_arg));
-        if (!thread_arg) {
+        if (fds[1].revents) {
+            accept_clients(listen_fd, loop_threads > 0);
+        }
+        if (!fds[0].revents ||
+            read_full(g_signal_pipe[0], &client_pid, sizeof(client_pid)) <= 0) {
             continue;
         }
-        thread_arg->client_pid = client_pid;
 
-        if (pthread_create(&thread_id, NULL, client_thread_main, thread_arg) != 0) {
-            free(thread_arg);
-            continue;
+        if (loop_threads > 0) {
+            start_fifo_loop_session(client_pid);
+        } else {
+            start_session_thread(client_pid, -1);
         }
-        pthread_detach(thread_id);
     }
 
     return 0;
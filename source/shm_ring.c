@@ -0,0 +1,357 @@
+// memfd_create is a GNU extension
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../libs/shm_ring.h"
+
+#define SHM_MARKER_RINGS 'S'
+#define SHM_MARKER_DECLINED 'N'
+
+/*
+ * head and tail count every byte ever written and read, so head - tail is
+ * the fill level and neither wraps in practice. Each "waiting" flag is set
+ * by a side about to sleep and cleared by the side that wakes it; both
+ * sides store their counter or flag before loading the other's, so one of
+ * them always sees the other and no wakeup is lost. A clear flag therefore
+ * means the eventfd was rung and not drained since, which lets an event
+ * loop stop reading a ring halfway and rely on the eventfd when it resumes.
+ * Both flags start out set for the same reason.
+ *
+ * The peer can write anything to the mapping, so neither counter is
+ * trusted: a fill level beyond SHM_RING_SIZE ends the channel before any
+ * byte is copied.
+ */
+struct shm_ring_shared {
+    _Alignas(64) atomic_uint_fast64_t head;     // written by the producer only
+    atomic_int reader_waiting;
+    _Alignas(64) atomic_uint_fast64_t tail;     // written by the consumer only
+    atomic_int writer_waiting;
+    _Alignas(64) unsigned char data[SHM_RING_SIZE];
+};
+
+// The mapping: the client-to-server ring, then the server-to-client ring
+#define SHM_MAP_SIZE (2 * sizeof(shm_ring_shared))
+
+static void wake(int fd) {
+    uint64_t one = 1;
+
+    (void)write(fd, &one, sizeof(one));
+}
+
+static void drain(int fd) {
+    uint64_t count;
+
+    (void)read(fd, &count, sizeof(count));
+}
+
+// Sleeps until the other end rings wait_fd or goes away
+static int ring_sleep(shm_ring *ring) {
+    struct pollfd fds[2] = {
+        {.fd = ring->wait_fd, .events = POLLIN},
+        {.fd = ring->hangup_fd, .events = POLLIN},
+    };
+
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (fds[1].revents) {
+        ring->peer_gone = 1;
+    }
+    return 0;
+}
+
+// A peer that broke the ring is treated as gone, every later call fails too
+static int ring_broken(shm_ring *ring, int err) {
+    ring->peer_gone = 1;
+    errno = err;
+    return -1;
+}
+
+static void ring_init(shm_ring *ring, shm_ring_shared *shared, int wait_fd, int wake_fd,
+                      int hangup_fd) {
+    ring->shared = shared;
+    ring->wait_fd = wait_fd;
+    ring->wake_fd = wake_fd;
+    ring->hangup_fd = hangup_fd;
+    ring->nonblock = 0;
+    ring->peer_gone = 0;
+}
+
+int shm_channel_create(shm_channel *chan, int sock) {
+    int fds[4] = {-1, -1, -1, -1};
+    shm_ring_shared *rings;
+
+    chan->map = MAP_FAILED;
+    chan->memfd = memfd_create("text-editor-shm", MFD_CLOEXEC);
+    if (chan->memfd < 0 || ftruncate(chan->memfd, SHM_MAP_SIZE) != 0) {
+        goto fail;
+    }
+    chan->map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, chan->memfd, 0);
+    if (chan->map == MAP_FAILED) {
+        goto fail;
+    }
+    for (int i = 0; i < 4; ++i) {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[i] < 0) {
+            goto fail;
+        }
+    }
+
+    // A fresh memfd reads as zeros, which is an empty ring
+    rings = chan->map;
+    for (int i = 0; i < 2; ++i) {
+        atomic_store(&rings[i].reader_waiting, 1);
+        atomic_store(&rings[i].writer_waiting, 1);
+    }
+    ring_init(&chan->in, &rings[0], fds[0], fds[1], sock);
+    ring_init(&chan->out, &rings[1], fds[3], fds[2], sock);
+    return 0;
+
+fail:
+    for (int i = 0; i < 4; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    if (chan->map != MAP_FAILED) {
+        munmap(chan->map, SHM_MAP_SIZE);
+    }
+    if (chan->memfd >= 0) {
+        close(chan->memfd);
+    }
+    return -1;
+}
+
+int shm_channel_offer(int sock, shm_channel *chan) {
+    char marker = chan ? SHM_MARKER_RINGS : SHM_MARKER_DECLINED;
+    struct iovec iov = {.iov_base = &marker, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    union {
+        char buf[CMSG_SPACE(SHM_CHANNEL_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    ssize_t rc;
+
+    if (chan) {
+        // The client's view: its in is our out and the other way round
+        int fds[SHM_CHANNEL_FDS] = {chan->memfd, chan->in.wait_fd, chan->in.wake_fd,
+                                    chan->out.wake_fd, chan->out.wait_fd};
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+
+    do {
+        rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (rc < 0 && errno == EINTR);
+
+    if (chan) {
+        close(chan->memfd);
+        chan->memfd = -1;
+    }
+    return rc == 1 ? 0 : -1;
+}
+
+int shm_channel_accept(int sock, shm_channel *chan) {
+    char marker;
+    struct iovec iov = {.iov_base = &marker, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(SHM_CHANNEL_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg;
+    int fds[SHM_CHANNEL_FDS];
+    struct stat st;
+    shm_ring_shared *rings;
+    ssize_t rc;
+
+    do {
+        rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc < 0 && errno == EINTR);
+    if (rc != 1) {
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (marker != SHM_MARKER_RINGS) {
+        return marker == SHM_MARKER_DECLINED && !cmsg ? 0 : -1;
+    }
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    chan->memfd = -1;
+    chan->map = MAP_FAILED;
+    if (fstat(fds[0], &st) == 0 && (size_t)st.st_size >= SHM_MAP_SIZE) {
+        chan->map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+    close(fds[0]);
+    if (chan->map == MAP_FAILED) {
+        for (int i = 1; i < SHM_CHANNEL_FDS; ++i) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    rings = chan->map;
+    ring_init(&chan->out, &rings[0], fds[2], fds[1], sock);
+    ring_init(&chan->in, &rings[1], fds[3], fds[4], sock);
+    return 1;
+}
+
+void shm_channel_close(shm_channel *chan) {
+    munmap(chan->map, SHM_MAP_SIZE);
+    close(chan->in.wait_fd);
+    close(chan->in.wake_fd);
+    close(chan->out.wait_fd);
+    close(chan->out.wake_fd);
+    if (chan->memfd >= 0) {
+        close(chan->memfd);
+    }
+}
+
+ssize_t shm_ring_read(shm_ring *ring, void *buf, size_t count) {
+    shm_ring_shared *shared = ring->shared;
+    unsigned char *out = buf;
+
+    while (1) {
+        uint64_t tail = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&shared->head, memory_order_acquire);
+
+        if (head - tail > SHM_RING_SIZE) {
+            return ring_broken(ring, EPROTO);
+        }
+        if (head != tail) {
+            size_t len = (size_t)(head - tail) < count ? (size_t)(head - tail) : count;
+            size_t at = (size_t)(tail & (SHM_RING_SIZE - 1));
+            size_t first = len < SHM_RING_SIZE - at ? len : SHM_RING_SIZE - at;
+
+            memcpy(out, shared->data + at, first);
+            memcpy(out + first, shared->data, len - first);
+            atomic_store(&shared->tail, tail + len);
+            if (atomic_load(&shared->writer_waiting) &&
+                atomic_exchange(&shared->writer_waiting, 0)) {
+                wake(ring->wake_fd);
+            }
+            return (ssize_t)len;
+        }
+
+        if (ring->peer_gone) {
+            return 0;
+        }
+        drain(ring->wait_fd);
+        atomic_store(&shared->reader_waiting, 1);
+        if (atomic_load(&shared->head) != tail) {
+            continue;
+        }
+        if (ring->nonblock) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (ring_sleep(ring) != 0) {
+            return -1;
+        }
+    }
+}
+
+ssize_t shm_ring_writev(shm_ring *ring, const struct iovec *iov, int iov_count) {
+    shm_ring_shared *shared = ring->shared;
+
+    while (1) {
+        uint64_t head = atomic_load_explicit(&shared->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&shared->tail, memory_order_acquire);
+        size_t room;
+        size_t copied = 0;
+
+        if (head - tail > SHM_RING_SIZE) {
+            return ring_broken(ring, EPIPE);
+        }
+        room = SHM_RING_SIZE - (size_t)(head - tail);
+        if (ring->peer_gone) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (room > 0) {
+            for (int i = 0; i < iov_count && copied < room; ++i) {
+                const unsigned char *src = iov[i].iov_base;
+                size_t len = iov[i].iov_len < room - copied ? iov[i].iov_len : room - copied;
+                size_t at = (size_t)((head + copied) & (SHM_RING_SIZE - 1));
+                size_t first = len < SHM_RING_SIZE - at ? len : SHM_RING_SIZE - at;
+
+                memcpy(shared->data + at, src, first);
+                memcpy(shared->data, src + first, len - first);
+                copied += len;
+            }
+            atomic_store(&shared->head, head + copied);
+            if (atomic_load(&shared->reader_waiting) &&
+                atomic_exchange(&shared->reader_waiting, 0)) {
+                wake(ring->wake_fd);
+            }
+            return (ssize_t)copied;
+        }
+
+        drain(ring->wait_fd);
+        atomic_store(&shared->writer_waiting, 1);
+        if (atomic_load(&shared->tail) != tail) {
+            continue;
+        }
+        if (ring->nonblock) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (ring_sleep(ring) != 0) {
+            return -1;
+        }
+    }
+}
+
+ssize_t shm_ring_write_full(shm_ring *ring, const void *buf, size_t count) {
+    size_t written = 0;
+
+    while (written < count) {
+        struct iovec iov = {.iov_base = (char *)buf + written, .iov_len = count - written};
+        ssize_t rc = shm_ring_writev(ring, &iov, 1);
+
+        if (rc < 0) {
+            return -1;
+        }
+        written += (size_t)rc;
+    }
+    return (ssize_t)written;
+}
+
+int shm_ring_poll_prepare(shm_ring *ring) {
+    shm_ring_shared *shared = ring->shared;
+    uint64_t tail = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+
+    if (atomic_load(&shared->head) != tail || ring->peer_gone) {
+        return 1;
+    }
+    drain(ring->wait_fd);
+    atomic_store(&shared->reader_waiting, 1);
+    return atomic_load(&shared->head) != tail;
+}
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libs/frame_io.h"
+#include "../libs/markdown.h"
+#include "../libs/snapshot.h"
+
+#define SNAPSHOT_MANIFEST "MANIFEST"
+#define SNAPSHOT_NAME_MAX 256
+#define SNAPSHOT_WRITE_BUF (64 * 1024)
+
+// What the child sends back before it exits
+typedef struct {
+    int status;         // 0 if every file was written
+    int err;            // errno of the failure
+    size_t docs;
+    uint64_t bytes;
+    uint64_t pages_copied;
+} snapshot_report;
+
+typedef struct {
+    pid_t pid;
+    int report_fd;
+    struct timespec started;
+} snapshot_job;
+
+static struct {
+    char dir[4096];
+    pthread_mutex_t mutex;
+    snapshot_stats stats;
+} g_snap = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Child state, only ever touched after the fork
+static struct {
+    int dir_fd;
+    int manifest_fd;
+    snapshot_report report;
+    int out_fd;
+    size_t out_len;
+    char out[SNAPSHOT_WRITE_BUF];
+} g_child;
+
+int snapshot_init(const char *dir) {
+    struct stat st;
+
+    if (strlen(dir) >= sizeof(g_snap.dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (stat(dir, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    strcpy(g_snap.dir, dir);
+    return 0;
+}
+
+static int flush_out(void) {
+    if (g_child.out_len > 0 && write_full(g_child.out_fd, g_child.out, g_child.out_len) < 0) {
+        return -1;
+    }
+    g_child.out_len = 0;
+    return 0;
+}
+
+// Pieces are often a few bytes, so they are gathered into large writes
+static int write_span(const char *text, size_t len, void *ctx) {
+    (void)ctx;
+    g_child.report.bytes += len;
+    if (g_child.out_len + len > sizeof(g_child.out) && flush_out() != 0) {
+        return -1;
+    }
+    if (len >= sizeof(g_child.out)) {
+        return write_full(g_child.out_fd, text, len) < 0 ? -1 : 0;
+    }
+    memcpy(g_child.out + g_child.out_len, text, len);
+    g_child.out_len += len;
+    return 0;
+}
+
+// Creates tmp_name in the snapshot directory. The caller renames it into place
+static int open_tmp(const char *tmp_name) {
+    return openat(g_child.dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static int close_and_rename(int fd, const char *tmp_name, const char *name) {
+    if (fdatasync(fd) != 0) {
+        int saved = errno;
+
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+    return renameat(g_child.dir_fd, tmp_name, g_child.dir_fd, name);
+}
+
+// snprintf may allocate or lock, so the child builds its few strings by hand
+static int append_str(char *buf, size_t cap, size_t *len, const char *s) {
+    size_t n = strlen(s);
+
+    if (*len + n >= cap) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(buf + *len, s, n + 1);
+    *len += n;
+    return 0;
+}
+
+static int append_u64(char *buf, size_t cap, size_t *len, uint64_t value) {
+    char digits[21];
+    size_t at = sizeof(digits) - 1;
+
+    digits[at] = '\0';
+    do {
+        digits[--at] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    return append_str(buf, cap, len, digits + at);
+}
+
+int snapshot_save_doc(const char *name, uint64_t version, const document *doc) {
+    char file[SNAPSHOT_NAME_MAX];
+    char tmp[SNAPSHOT_NAME_MAX];
+    char line[SNAPSHOT_NAME_MAX + 48];
+    uint64_t before = g_child.report.bytes;
+    size_t file_len = 0;
+    size_t tmp_len = 0;
+    size_t line_len = 0;
+
+    // Document names never start with '.', so the temporary names can't clash
+    if (append_str(file, sizeof(file), &file_len, name) != 0 ||
+        append_str(file, sizeof(file), &file_len, ".md") != 0 ||
+        append_str(tmp, sizeof(tmp), &tmp_len, ".") != 0 ||
+        append_str(tmp, sizeof(tmp), &tmp_len, file) != 0 ||
+        append_str(tmp, sizeof(tmp), &tmp_len, ".tmp") != 0) {
+        return -1;
+    }
+    g_child.out_fd = open_tmp(tmp);
+    if (g_child.out_fd < 0) {
+        return -1;
+    }
+    g_child.out_len = 0;
+    if (markdown_for_each_span(doc, write_span, NULL) != 0 || flush_out() != 0) {
+        int saved = errno;
+
+        close(g_child.out_fd);
+        unlinkat(g_child.dir_fd, tmp, 0);
+        errno = saved;
+        return -1;
+    }
+    if (close_and_rename(g_child.out_fd, tmp, file) != 0) {
+        return -1;
+    }
+
+    if (append_str(line, sizeof(line), &line_len, name) != 0 ||
+        append_str(line, sizeof(line), &line_len, " ") != 0 ||
+        append_u64(line, sizeof(line), &line_len, version) != 0 ||
+        append_str(line, sizeof(line), &line_len, " ") != 0 ||
+        append_u64(line, sizeof(line), &line_len, g_child.report.bytes - before) != 0 ||
+        append_str(line, sizeof(line), &line_len, "\n") != 0 ||
+        write_full(g_child.manifest_fd, line, line_len) < 0) {
+        return -1;
+    }
+    g_child.report.docs++;
+    return 0;
+}
+
+/*
+ * Right after the fork every page is shared. A page either side writes is
+ * copied, which leaves the child's page mapped only by the child, so its
+ * private pages are the ones copied since, its own writes included.
+ */
+static uint64_t pages_copied(void) {
+    char buf[4096];
+    size_t len = 0;
+    ssize_t got = 1;
+    uint64_t kb = 0;
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+    // read_full would call the short read at EOF a failure
+    while (got > 0 && len < sizeof(buf) - 1) {
+        got = read(fd, buf + len, sizeof(buf) - 1 - len);
+        len += got > 0 ? (size_t)got : 0;
+    }
+    close(fd);
+    buf[len] = '\0';
+    for (const char *line = buf; line; line = strchr(line, '\n')) {
+        line += *line == '\n';
+        if (strncmp(line, "Private_Clean:", 14) == 0 || strncmp(line, "Private_Dirty:", 14) == 0) {
+            kb += strtoull(line + 14, NULL, 10);
+        }
+    }
+    return kb * 1024 / (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+static int write_snapshot(snapshot_fn fn, void *ctx) {
+    const char *tmp = "." SNAPSHOT_MANIFEST ".tmp";
+
+    g_child.dir_fd = open(g_snap.dir, O_RDONLY | O_DIRECTORY);
+    if (g_child.dir_fd < 0) {
+        return -1;
+    }
+    g_child.manifest_fd = open_tmp(tmp);
+    if (g_child.manifest_fd < 0) {
+        return -1;
+    }
+    if (fn(ctx) != 0 || close_and_rename(g_child.manifest_fd, tmp, SNAPSHOT_MANIFEST) != 0) {
+        return -1;
+    }
+    return fsync(g_child.dir_fd);
+}
+
+/*
+ * Closes every descriptor the child inherited except the standard ones and
+ * report_fd, which is moved to 3 and returned. Otherwise the child would
+ * hold the listen socket and every client's socket, FIFOs and eventfds
+ * open while it writes, and a client that hung up wouldn't look gone.
+ */
+static int close_inherited(int report_fd) {
+    struct rlimit limit;
+    int fd_max = 65536;
+
+    if (report_fd != 3 && dup2(report_fd, 3) < 0) {
+        return -1;
+    }
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 4u, ~0u, 0u) == 0) {
+        return 3;
+    }
+#endif
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)fd_max) {
+        fd_max = (int)limit.rlim_cur;
+    }
+    for (int fd = 4; fd < fd_max; ++fd) {
+        (void)close(fd);
+    }
+    return 3;
+}
+
+static void run_child(snapshot_fn fn, void *ctx, int report_fd) {
+    struct sigaction sa;
+
+    // The parent's handlers would remove its socket or take its clients
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_DFL;
+    (void)sigaction(SIGINT, &sa, NULL);
+    (void)sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    (void)sigaction(SIGUSR1, &sa, NULL);
+
+    report_fd = close_inherited(report_fd);
+    if (report_fd < 0) {
+        _exit(1);
+    }
+    g_child.report.status = write_snapshot(fn, ctx);
+    g_child.report.err = g_child.report.status != 0 ? errno : 0;
+    g_child.report.pages_copied = pages_copied();
+    (void)write_full(report_fd, &g_child.report, sizeof(g_child.report));
+    _exit(g_child.report.status != 0);
+}
+
+static void *snapshot_wait_main(void *arg) {
+    snapshot_job *job = arg;
+    snapshot_report report;
+    struct timespec finished;
+    ssize_t got = read_full(job->report_fd, &report, sizeof(report));
+    int status = 0;
+
+    close(job->report_fd);
+    while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    if (got != (ssize_t)sizeof(report)) {
+        report.status = -1;
+        report.err = 0;
+    }
+    pthread_mutex_lock(&g_snap.mutex);
+    g_snap.stats.running = 0;
+    if (report.status == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        g_snap.stats.taken++;
+        g_snap.stats.ms = (double)(finished.tv_sec - job->started.tv_sec) * 1e3 +
+                          (double)(finished.tv_nsec - job->started.tv_nsec) / 1e6;
+        g_snap.stats.pages_copied = report.pages_copied;
+        g_snap.stats.bytes = report.bytes;
+        g_snap.stats.docs = report.docs;
+    } else {
+        g_snap.stats.failed++;
+    }
+    pthread_mutex_unlock(&g_snap.mutex);
+
+    if (report.status != 0) {
+        fprintf(stderr, "snapshot: %s\n",
+                report.err ? strerror(report.err) : "the child died before reporting");
+    }
+    free(job);
+    return NULL;
+}
+
+int snapshot_start(snapshot_fn fn, void *ctx, uint64_t *fork_us_out) {
+    int fds[2];
+    struct timespec forked;
+    snapshot_job *job;
+    pthread_t waiter;
+
+    pthread_mutex_lock(&g_snap.mutex);
+    if (g_snap.stats.running) {
+        pthread_mutex_unlock(&g_snap.mutex);
+        return 1;
+    }
+    job = malloc(sizeof(*job));
+    if (!job || pipe(fds) != 0) {
+        pthread_mutex_unlock(&g_snap.mutex);
+        free(job);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    job->pid = fork();
+    clock_gettime(CLOCK_MONOTONIC, &forked);
+    if (job->pid == 0) {
+        close(fds[0]);
+        run_child(fn, ctx, fds[1]);
+    }
+    close(fds[1]);
+    if (job->pid < 0) {
+        int saved = errno;
+
+        close(fds[0]);
+        free(job);
+        pthread_mutex_unlock(&g_snap.mutex);
+        errno = saved;
+        return -1;
+    }
+
+    job->report_fd = fds[0];
+    g_snap.stats.running = 1;
+    g_snap.stats.fork_us = (uint64_t)((forked.tv_sec - job->started.tv_sec) * 1000000 +
+                                      (forked.tv_nsec - job->started.tv_nsec) / 1000);
+    if (fork_us_out) {
+        *fork_us_out = g_snap.stats.fork_us;
+    }
+    pthread_mutex_unlock(&g_snap.mutex);
+
+    // Without a thread to wait on it the child is reaped right here
+    if (pthread_create(&waiter, NULL, snapshot_wait_main, job) != 0) {
+        snapshot_wait_main(job);
+    } else {
+        pthread_detach(waiter);
+    }
+    return 0;
+}
+
+void snapshot_get_stats(snapshot_stats *stats) {
+    pthread_mutex_lock(&g_snap.mutex);
+    *stats = g_snap.stats;
+    pthread_mutex_unlock(&g_snap.mutex);
+}
@@ -0,0 +1,587 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libs/frame_io.h"
+#include "../libs/wal.h"
+
+#define WAL_HEADER_LEN 8
+#define WAL_VARINT_MAX 10
+
+/*
+ * appended and synced are file offsets: everything before synced is known
+ * to be on disk. Whoever syncs drops the mutex around fdatasync, so
+ * commits keep appending meanwhile and the next sync takes them all.
+ */
+static struct {
+    int fd;
+    wal_sync_mode mode;
+    uint64_t every;
+    pthread_mutex_t mutex;
+    pthread_cond_t synced_cond;     // a sync finished
+    pthread_cond_t sync_wanted;     // bytes mode: enough was appended
+    uint64_t appended;
+    uint64_t synced;
+    int syncing;
+    wal_stats stats;
+} g_wal = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .synced_cond = PTHREAD_COND_INITIALIZER,
+    .sync_wanted = PTHREAD_COND_INITIALIZER,
+};
+
+static uint32_t g_crc_table[256];
+static pthread_once_t g_crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        g_crc_table[i] = crc;
+    }
+}
+
+static uint32_t crc32(const unsigned char *data, size_t len) {
+    uint32_t crc = 0xFFFFFFFFu;
+
+    for (size_t i = 0; i < len; ++i) {
+        crc = g_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static unsigned char *put_varint(unsigned char *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+static void put_u32(unsigned char *out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+// NULL if the varint runs past end or doesn't fit 64 bits
+static const unsigned char *get_varint(const unsigned char *in, const unsigned char *end,
+                                       uint64_t *value_out) {
+    uint64_t value = 0;
+
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        unsigned char byte = *in++;
+
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value_out = value;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 |
+           (uint32_t)in[3] << 24;
+}
+
+// Called with the mutex held, reports only the first failure
+static void wal_fail(const char *what) {
+    if (!g_wal.stats.failed) {
+        perror(what);
+        fprintf(stderr, "wal: refusing every further commit\n");
+    }
+    g_wal.stats.failed = 1;
+    pthread_cond_broadcast(&g_wal.synced_cond);
+}
+
+// Called with the mutex held and no sync running
+static void sync_locked(void) {
+    uint64_t target = g_wal.appended;
+    int rc;
+
+    g_wal.syncing = 1;
+    pthread_mutex_unlock(&g_wal.mutex);
+    rc = fdatasync(g_wal.fd);
+    pthread_mutex_lock(&g_wal.mutex);
+    g_wal.syncing = 0;
+
+    if (rc != 0) {
+        wal_fail("wal: fdatasync");
+        return;
+    }
+    g_wal.synced = target;
+    g_wal.stats.syncs++;
+    pthread_cond_broadcast(&g_wal.synced_cond);
+}
+
+// The first thread to get here syncs for everyone waiting behind it
+static void wait_synced_locked(uint64_t offset) {
+    while (g_wal.synced < offset && !g_wal.stats.failed) {
+        if (g_wal.syncing) {
+            pthread_cond_wait(&g_wal.synced_cond, &g_wal.mutex);
+        } else {
+            sync_locked();
+        }
+    }
+}
+
+static void *wal_sync_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&g_wal.mutex);
+    while (!g_wal.stats.failed) {
+        if (g_wal.mode == WAL_SYNC_MS) {
+            struct timespec tick = {(time_t)(g_wal.every / 1000),
+                                    (long)(g_wal.every % 1000) * 1000000L};
+
+            pthread_mutex_unlock(&g_wal.mutex);
+            while (nanosleep(&tick, &tick) != 0 && errno == EINTR) {
+            }
+            pthread_mutex_lock(&g_wal.mutex);
+        } else {
+            while (g_wal.appended - g_wal.synced < g_wal.every && !g_wal.stats.failed) {
+                pthread_cond_wait(&g_wal.sync_wanted, &g_wal.mutex);
+            }
+        }
+        if (g_wal.appended > g_wal.synced && !g_wal.syncing && !g_wal.stats.failed) {
+            sync_locked();
+        }
+    }
+    pthread_mutex_unlock(&g_wal.mutex);
+    return NULL;
+}
+
+/*
+ * Fills in the record header and writes the record. body points
+ * WAL_HEADER_LEN bytes into record. Returns where the record ends, 0 if it
+ * wasn't written. Nothing waits for the sync here: the caller may hold a
+ * document lock, see wal_wait_durable.
+ */
+static uint64_t wal_append(unsigned char *record, size_t len) {
+    unsigned char *body = record + WAL_HEADER_LEN;
+    uint64_t end;
+
+    put_u32(record, (uint32_t)(len - WAL_HEADER_LEN));
+    put_u32(record + 4, crc32(body, len - WAL_HEADER_LEN));
+
+    pthread_mutex_lock(&g_wal.mutex);
+    if (g_wal.stats.failed) {
+        pthread_mutex_unlock(&g_wal.mutex);
+        return 0;
+    }
+    if (write_full(g_wal.fd, record, len) < 0) {
+        wal_fail("wal: write");
+        pthread_mutex_unlock(&g_wal.mutex);
+        return 0;
+    }
+    g_wal.appended += len;
+    end = g_wal.appended;
+    g_wal.stats.records++;
+    g_wal.stats.bytes += len;
+
+    if (g_wal.mode == WAL_SYNC_BYTES && g_wal.appended - g_wal.synced >= g_wal.every) {
+        pthread_cond_signal(&g_wal.sync_wanted);
+    }
+    pthread_mutex_unlock(&g_wal.mutex);
+    return end;
+}
+
+// Writes kind, name and version, returns where the rest of the body goes
+static unsigned char *put_prefix(unsigned char *record, int kind, const char *name,
+                                 uint64_t version) {
+    unsigned char *out = record + WAL_HEADER_LEN;
+    size_t name_len = strlen(name);
+
+    *out++ = (unsigned char)kind;
+    *out++ = (unsigned char)name_len;
+    memcpy(out, name, name_len);
+    return put_varint(out + name_len, version);
+}
+
+static size_t prefix_max(const char *name) {
+    return WAL_HEADER_LEN + 2 + strlen(name) + WAL_VARINT_MAX;
+}
+
+uint64_t wal_log_commit(const char *name, uint64_t version, const change *changes,
+                        size_t count) {
+    size_t capacity = prefix_max(name) + WAL_VARINT_MAX;
+    unsigned char *record;
+    unsigned char *out;
+    uint64_t end;
+
+    if (g_wal.fd < 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        capacity += 1 + 2 * WAL_VARINT_MAX + (changes[i].type == EDIT_INSERT ? changes[i].len : 0);
+    }
+    record = malloc(capacity);
+    if (!record) {
+        pthread_mutex_lock(&g_wal.mutex);
+        wal_fail("wal: malloc");
+        pthread_mutex_unlock(&g_wal.mutex);
+        return 0;
+    }
+
+    out = put_prefix(record, WAL_RECORD_COMMIT, name, version);
+    out = put_varint(out, count);
+    for (size_t i = 0; i < count; ++i) {
+        *out++ = (unsigned char)changes[i].type;
+        out = put_varint(out, changes[i].pos);
+        out = put_varint(out, changes[i].len);
+        if (changes[i].type == EDIT_INSERT) {
+            memcpy(out, changes[i].text, changes[i].len);
+            out += changes[i].len;
+        }
+    }
+
+    end = wal_append(record, (size_t)(out - record));
+    free(record);
+    return end;
+}
+
+uint64_t wal_log_snapshot(const char *name, uint64_t version, const char *text, size_t len) {
+    unsigned char *record;
+    unsigned char *out;
+    uint64_t end;
+
+    if (g_wal.fd < 0) {
+        return 0;
+    }
+    record = malloc(prefix_max(name) + WAL_VARINT_MAX + len);
+    if (!record) {
+        pthread_mutex_lock(&g_wal.mutex);
+        wal_fail("wal: malloc");
+        pthread_mutex_unlock(&g_wal.mutex);
+        return 0;
+    }
+
+    out = put_prefix(record, WAL_RECORD_SNAPSHOT, name, version);
+    out = put_varint(out, len);
+    memcpy(out, text, len);
+    out += len;
+
+    end = wal_append(record, (size_t)(out - record));
+    free(record);
+    return end;
+}
+
+int wal_parse_policy(const char *spec, wal_sync_mode *mode_out, uint64_t *every_out) {
+    char *end = NULL;
+    unsigned long long every;
+
+    if (strcmp(spec, "commit") == 0) {
+        *mode_out = WAL_SYNC_COMMIT;
+        *every_out = 0;
+        return 0;
+    }
+
+    errno = 0;
+    every = strtoull(spec, &end, 10);
+    if (end == spec || errno != 0 || every == 0 || spec[0] == '-') {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        *mode_out = WAL_SYNC_MS;
+    } else if (strcmp(end, "bytes") == 0) {
+        *mode_out = WAL_SYNC_BYTES;
+    } else {
+        return -1;
+    }
+    *every_out = every;
+    return 0;
+}
+
+/*
+ * Decodes the body of one record. The change array is the caller's, grown
+ * as needed. Returns -1 if the body is malformed.
+ */
+static int decode_record(const unsigned char *body, size_t len, wal_record *record,
+                         change **changes, size_t *capacity) {
+    const unsigned char *in = body;
+    const unsigned char *end = body + len;
+    uint64_t value;
+
+    if (len < 2) {
+        return -1;
+    }
+    memset(record, 0, sizeof(*record));
+    record->kind = *in++;
+    record->name_len = *in++;
+    record->name = (const char *)in;
+    if ((size_t)(end - in) < record->name_len) {
+        return -1;
+    }
+    in = get_varint(in + record->name_len, end, &record->version);
+    if (!in || !(in = get_varint(in, end, &value))) {
+        return -1;
+    }
+
+    if (record->kind == WAL_RECORD_SNAPSHOT) {
+        if (value != (uint64_t)(end - in)) {
+            return -1;
+        }
+        record->text = (const char *)in;
+        record->len = (size_t)value;
+        return 0;
+    }
+    if (record->kind != WAL_RECORD_COMMIT || value > len) {
+        return -1;
+    }
+
+    // Every change takes at least three bytes, so count is bounded by len
+    if (value > *capacity) {
+        change *grown = realloc(*changes, (size_t)value * sizeof(change));
+
+        if (!grown) {
+            return -1;
+        }
+        *changes = grown;
+        *capacity = (size_t)value;
+    }
+    record->count = (size_t)value;
+    for (size_t i = 0; i < record->count; ++i) {
+        change *c = &(*changes)[i];
+        uint64_t pos;
+        uint64_t n;
+
+        if (in == end || *in > EDIT_DELETE) {
+            return -1;
+        }
+        c->type = (edit_type)*in++;
+        if (!(in = get_varint(in, end, &pos)) || !(in = get_varint(in, end, &n))) {
+            return -1;
+        }
+        c->pos = (size_t)pos;
+        c->len = (size_t)n;
+        c->text = NULL;
+        if (c->type == EDIT_INSERT) {
+            if (n > (uint64_t)(end - in)) {
+                return -1;
+            }
+            c->text = (const char *)in;
+            in += n;
+        }
+    }
+    record->changes = *changes;
+    return in == end ? 0 : -1;
+}
+
+// The file may have grown before its data reached the disk, which reads as zeros
+static int all_zero(const unsigned char *p, uint64_t len) {
+    for (uint64_t i = 0; i < len; ++i) {
+        if (p[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int wal_replay(const char *path, uint64_t from, wal_replay_fn fn, void *ctx,
+               wal_replay_stats *stats) {
+    struct stat st;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uint64_t base;
+    unsigned char *map;
+    change *changes = NULL;
+    size_t capacity = 0;
+    int borrowed = 0;
+    int rc = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    pthread_once(&g_crc_once, crc_init);
+    memset(stats, 0, sizeof(*stats));
+    if (fd < 0) {
+        return errno == ENOENT && from == 0 ? 0 : -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // A crash while the log was being created can leave part of the magic
+    if ((uint64_t)st.st_size < WAL_MAGIC_LEN) {
+        char magic[WAL_MAGIC_LEN];
+        ssize_t got = read_full(fd, magic, (size_t)st.st_size);
+
+        close(fd);
+        if (got != st.st_size || memcmp(magic, WAL_MAGIC, (size_t)got) != 0 || from > 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        stats->dropped = (uint64_t)st.st_size;
+        return 0;
+    }
+    if (from == 0) {
+        from = WAL_MAGIC_LEN;
+    }
+    if (from > (uint64_t)st.st_size) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Only the tail after "from" is mapped, from the page it starts in
+    base = from - from % page;
+    map = mmap(NULL, (size_t)((uint64_t)st.st_size - base), PROT_READ, MAP_PRIVATE, fd,
+               (off_t)base);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (base == 0 && memcmp(map, WAL_MAGIC, WAL_MAGIC_LEN) != 0) {
+        munmap(map, (size_t)((uint64_t)st.st_size - base));
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    close(fd);
+    posix_madvise(map, (size_t)((uint64_t)st.st_size - base), POSIX_MADV_SEQUENTIAL);
+
+    stats->end = from;
+    while (stats->end < (uint64_t)st.st_size) {
+        const unsigned char *header = map + (stats->end - base);
+        uint64_t left = (uint64_t)st.st_size - stats->end;
+        wal_record record;
+        uint32_t len;
+
+        if (left < WAL_HEADER_LEN) {
+            break;
+        }
+        len = get_u32(header);
+        // A record cut short or torn as the last one is what a crash leaves
+        if (all_zero(header, left) || len > left - WAL_HEADER_LEN ||
+            (len == left - WAL_HEADER_LEN &&
+             get_u32(header + 4) != crc32(header + WAL_HEADER_LEN, len))) {
+            break;
+        }
+        // Anything else that doesn't read is damage, and durable commits follow it
+        if (get_u32(header + 4) != crc32(header + WAL_HEADER_LEN, len) ||
+            decode_record(header + WAL_HEADER_LEN, len, &record, &changes, &capacity) != 0) {
+            errno = EBADMSG;
+            rc = -1;
+            break;
+        }
+        if (fn(&record, ctx) != 0) {
+            rc = -1;
+            break;
+        }
+        borrowed |= record.kind == WAL_RECORD_SNAPSHOT;
+        stats->records++;
+        stats->bytes += WAL_HEADER_LEN + len;
+        stats->end += WAL_HEADER_LEN + len;
+    }
+    stats->dropped = (uint64_t)st.st_size - stats->end;
+
+    free(changes);
+    if (!borrowed) {
+        munmap(map, (size_t)((uint64_t)st.st_size - base));
+    }
+    return rc;
+}
+
+int wal_open(const char *path, wal_sync_mode mode, uint64_t every, uint64_t end) {
+    pthread_t thread;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        return -1;
+    }
+    pthread_once(&g_crc_once, crc_init);
+    // Drops a torn tail, or starts a new log with its magic
+    if (ftruncate(fd, (off_t)end) != 0 ||
+        (end == 0 && write_full(fd, WAL_MAGIC, WAL_MAGIC_LEN) < 0) || fdatasync(fd) != 0 ||
+        sync_parent_dir(path) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    g_wal.fd = fd;
+    g_wal.mode = mode;
+    g_wal.every = every;
+    g_wal.appended = end > 0 ? end : WAL_MAGIC_LEN;
+    g_wal.synced = g_wal.appended;
+
+    if (mode != WAL_SYNC_COMMIT) {
+        if (pthread_create(&thread, NULL, wal_sync_main, NULL) != 0) {
+            g_wal.fd = -1;
+            close(fd);
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+uint64_t wal_offset(void) {
+    uint64_t offset;
+
+    pthread_mutex_lock(&g_wal.mutex);
+    offset = g_wal.appended;
+    pthread_mutex_unlock(&g_wal.mutex);
+    return offset;
+}
+
+int wal_flush(void) {
+    int failed;
+
+    pthread_mutex_lock(&g_wal.mutex);
+    wait_synced_locked(g_wal.appended);
+    failed = g_wal.stats.failed;
+    pthread_mutex_unlock(&g_wal.mutex);
+    return failed ? -1 : 0;
+}
+
+int wal_wait_durable(uint64_t offset) {
+    int rc = 0;
+
+    if (g_wal.fd < 0) {
+        return 0;
+    }
+    // The other policies never promised the disk before a reply
+    if (g_wal.mode != WAL_SYNC_COMMIT) {
+        return 0;
+    }
+    pthread_mutex_lock(&g_wal.mutex);
+    wait_synced_locked(offset);
+    if (g_wal.synced < offset) {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&g_wal.mutex);
+    return rc;
+}
+
+int wal_failed(void) {
+    int failed;
+
+    pthread_mutex_lock(&g_wal.mutex);
+    failed = g_wal.stats.failed;
+    pthread_mutex_unlock(&g_wal.mutex);
+    return failed;
+}
+
+int wal_enabled(void) {
+    return g_wal.fd >= 0;
+}
+
+void wal_get_stats(wal_stats *stats) {
+    pthread_mutex_lock(&g_wal.mutex);
+    *stats = g_wal.stats;
+    pthread_mutex_unlock(&g_wal.mutex);
+}
@@ -0,0 +1,115 @@
+#include <string.h>
+
+#include "../libs/wire.h"
+
+static const char *const g_op_names[OP_COUNT] = {
+    [OP_INVALID] = "",
+    [OP_GET] = "get",
+    [OP_LIST] = "list",
+    [OP_STATS] = "stats",
+    [OP_SUBSCRIBE] = "subscribe",
+    [OP_INSERT] = "insert",
+    [OP_DELETE] = "delete",
+    [OP_BOLD] = "bold",
+    [OP_ITALIC] = "italic",
+    [OP_HEADING] = "heading",
+    [OP_NEWLINE] = "newline",
+    [OP_DISCONNECT] = "DISCONNECT",
+    [OP_TXN] = "txn",
+    [OP_SAVE] = "save",
+    [OP_GET_VERSION] = "get_version",
+    [OP_UNDO] = "undo",
+};
+
+const char *wire_op_name(wire_op op) {
+    if (op <= OP_INVALID || op >= OP_COUNT) {
+        return "";
+    }
+    return g_op_names[op];
+}
+
+wire_op wire_op_from_name(const char *name) {
+    for (int op = OP_INVALID + 1; op < OP_COUNT; ++op) {
+        if (strcmp(name, g_op_names[op]) == 0) {
+            return (wire_op)op;
+        }
+    }
+    return OP_INVALID;
+}
+
+const char *wire_role_name(uint8_t role) {
+    switch (role) {
+    case 1:
+        return "read";
+    case 2:
+        return "write";
+    default:
+        return "none";
+    }
+}
+
+static void put_u32(unsigned char *out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char *out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+    uint32_t value = 0;
+
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static uint64_t get_u64(const unsigned char *in) {
+    uint64_t value = 0;
+
+    for (int i = 7; i >= 0; --i) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+void wire_encode_request(const wire_request *req, unsigned char out[WIRE_REQUEST_SIZE]) {
+    out[0] = (unsigned char)req->op;
+    put_u64(out + 1, req->version);
+    put_u64(out + 9, req->pos);
+    put_u64(out + 17, req->len);
+    put_u32(out + 25, req->payload_len);
+}
+
+void wire_decode_request(const unsigned char in[WIRE_REQUEST_SIZE], wire_request *req) {
+    req->op = (in[0] < OP_COUNT) ? (wire_op)in[0] : OP_INVALID;
+    req->version = get_u64(in + 1);
+    req->pos = get_u64(in + 9);
+    req->len = get_u64(in + 17);
+    req->payload_len = get_u32(in + 25);
+}
+
+void wire_encode_reply(const wire_reply *reply, unsigned char out[WIRE_REPLY_SIZE]) {
+    out[0] = (unsigned char)reply->kind;
+    out[1] = reply->role;
+    put_u64(out + 2, reply->from);
+    put_u64(out + 10, reply->version);
+    put_u64(out + 18, reply->body_len);
+}
+
+int wire_decode_reply(const unsigned char in[WIRE_REPLY_SIZE], wire_reply *reply) {
+    if (in[0] < REPLY_SNAPSHOT || in[0] > REPLY_ERROR) {
+        return -1;
+    }
+    reply->kind = (wire_reply_kind)in[0];
+    reply->role = in[1];
+    reply->from = get_u64(in + 2);
+    reply->version = get_u64(in + 10);
+    reply->body_len = get_u64(in + 18);
+    return 0;
+}